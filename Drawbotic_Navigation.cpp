@@ -1,4 +1,139 @@
 #include "Drawbotic_Navigation.h"
+#include <string.h>
+#if defined(__AVR__) && !defined(NAV_WAIT_FOR_INTERRUPT)
+#include <avr/sleep.h>
+#endif
+
+// Wrap an angle in degrees into the range -180 to 180
+static float wrapAngle(float angle) {
+  while (angle > 180.0f)
+    angle -= 360.0f;
+  while (angle <= -180.0f)
+    angle += 360.0f;
+  return angle;
+}
+
+// Wait in the lightest sleep mode until the next interrupt, which is at most the timer behind millis(). Boards this
+// doesn't know, or sketches that want a deeper sleep, can define NAV_WAIT_FOR_INTERRUPT() for the whole build
+static void waitForInterrupt() {
+#if defined(NAV_WAIT_FOR_INTERRUPT)
+  NAV_WAIT_FOR_INTERRUPT();
+#elif defined(__AVR__)
+  set_sleep_mode(SLEEP_MODE_IDLE);
+  sleep_mode();
+#elif defined(__arm__)
+  __WFI();
+#else
+  yield();
+#endif
+}
+
+// Disable interrupts, returning what is needed to put them back as they were. Boards this doesn't know are assumed to
+// have had them enabled
+static uint32_t disableInterrupts() {
+#if defined(__AVR__)
+  uint8_t state = SREG;
+  cli();
+  return state;
+#elif defined(__arm__)
+  uint32_t state = __get_PRIMASK();
+  __disable_irq();
+  return state;
+#else
+  noInterrupts();
+  return 0;
+#endif
+}
+
+static void restoreInterrupts(uint32_t state) {
+#if defined(__AVR__)
+  SREG = (uint8_t)state;
+#elif defined(__arm__)
+  // PRIMASK is set while interrupts are disabled
+  if (!state)
+    __enable_irq();
+#else
+  (void)state;
+  interrupts();
+#endif
+}
+
+// Round a value to the nearest integer
+static int32_t roundToInt(float value) {
+  return (int32_t)(value < 0 ? value - 0.5f : value + 0.5f);
+}
+
+// Read a decimal number such as -12.5 from a stream command line, moving past it
+static bool parseNumber(const char **text, float *value) {
+  const char *p = *text;
+  while (*p == ' ')
+    p++;
+  bool negative = *p == '-';
+  if (*p == '-' || *p == '+')
+    p++;
+
+  float result = 0;
+  float scale = 1;
+  bool digits = false;
+  bool fraction = false;
+  for (;; p++) {
+    if (*p >= '0' && *p <= '9') {
+      if (fraction)
+        result += (*p - '0') * (scale *= 0.1f);
+      else
+        result = result * 10 + (*p - '0');
+      digits = true;
+    }
+    else if (*p == '.' && !fraction)
+      fraction = true;
+    else
+      break;
+  }
+  if (!digits)
+    return false;
+
+  *value = negative ? -result : result;
+  *text = p;
+  return true;
+}
+
+// Read a value in tenths stored as two bytes, low byte first, from a program in flash
+static float programTenths(const uint8_t *p) {
+  return (int16_t)(pgm_read_byte(p) | (pgm_read_byte(p + 1) << 8)) * 0.1f;
+}
+
+// Quantise a value to tenths, saturating at the limits of a 16 bit signed integer
+static int16_t toTenths(float value) {
+  float tenths = value * 10.0f;
+  if (tenths >= 32767.0f)
+    return 32767;
+  if (tenths <= -32767.0f)
+    return -32767;
+  return (int16_t)(tenths < 0 ? tenths - 0.5f : tenths + 0.5f);
+}
+
+// Whether a value can be stored in tenths without toTenths() saturating
+static bool fitsTenths(float value) {
+  return abs(value * 10.0f) < 32767.5f;
+}
+
+// Polyline corners are compared against the cosine of NAV_PATH_CORNER so the control step needs no trigonometry
+static const float PATH_CORNER_COS = cos(NAV_PATH_CORNER * M_PI / 180.0f);
+
+// A cubic bezier, its first derivative and its second derivative along one axis
+static float bezier(const float *p, float t) {
+  float u = 1 - t;
+  return u * u * u * p[0] + 3 * u * u * t * p[1] + 3 * u * t * t * p[2] + t * t * t * p[3];
+}
+
+static float bezierSlope(const float *p, float t) {
+  float u = 1 - t;
+  return 3 * u * u * (p[1] - p[0]) + 6 * u * t * (p[2] - p[1]) + 3 * t * t * (p[3] - p[2]);
+}
+
+static float bezierBend(const float *p, float t) {
+  return 6 * (1 - t) * (p[2] - 2 * p[1] + p[0]) + 6 * t * (p[3] - 2 * p[2] + p[1]);
+}
 
 /*!
  * \brief Construct a new Drawbotic_Navigation object with it's own Navigation queue
@@ -11,29 +146,156 @@
  * \note Using the IMU should provide better angular accuracy than counting encoder steps. However, the IMU may be effected by strong magnetic fields. If this is the case it migth be more accurate to disable IMU based rotations.
  */
 Drawbotic_Navigation::Drawbotic_Navigation(bool useIMU, float updateRate_ms, float speed, float correctionPower) {
+  // first, the setters called below enter critical sections
+  m_interruptDriven = false;
+  m_criticalDepth = 0;
+  m_interruptState = 0;
   m_timeBank = 0;
   m_updateRate_ms = updateRate_ms;
+  m_recorder = NULL;
   m_queueSize = 0;
+  m_queueHead = NO_ACTION;
+  m_queueTail = NO_ACTION;
+  m_freeList = NO_ACTION;
+  m_currentActive = false;
   m_speed = speed;
-  m_cp = correctionPower;
+  m_rotateSpeed = speed;
+  m_stepTime_ms = updateRate_ms;
+
+  // The wheel sync loops start out as the plain proportional correction, the heading loop as proportional to the angle left
+  for (int i = 0; i < NAV_LOOP_COUNT; i++) {
+    m_gains[i].feedforward = 1;
+    m_gains[i].kp = correctionPower;
+    m_gains[i].ki = 0;
+    m_gains[i].kd = 0;
+    m_gains[i].integralLimit = SYNC_LIMIT;
+    m_gains[i].outputLimit = 1;
+  }
+  m_calibration = defaultCalibration();
+  m_gains[NAV_LOOP_HEADING].kp = m_calibration.rotateKp;
+  m_headingGainsSet = false;
+  m_gains[NAV_LOOP_HEADING].ki = ROTATE_KI;
+  m_gains[NAV_LOOP_HEADING].kd = ROTATE_KD;
+  m_gains[NAV_LOOP_HEADING].integralLimit = SPEED_MIN;
+  m_gains[NAV_LOOP_VELOCITY].feedforward = 1.0f / WHEEL_SPEED;
+  m_gains[NAV_LOOP_VELOCITY].kp = VELOCITY_KP;
+  m_gains[NAV_LOOP_VELOCITY].ki = VELOCITY_KI;
+  m_gains[NAV_LOOP_VELOCITY].integralLimit = VELOCITY_LIMIT;
+  m_motorStage = defaultMotorOutput();
+  setVelocityControl(false);
   m_useIMU = useIMU;
+  m_entrySpeed = 0;
+  m_carry = 0;
+  m_carryType = NAV_STOP;
+  m_carryFlags = 0;
+  m_carryRatio = RATIO_ONE;
+  m_headingValid = false;
+  m_rotateCarry = 0;
+  m_encoderResidual = 0;
+
+  m_stream = NULL;
+  m_streamLength = 0;
+  m_streamOverflow = false;
+  m_streamLowWater = 0;
+  m_streamCredit = 0;
+  m_streamCurveCredit = 0;
+  m_streamActions = 0;
+  m_streamErrors = 0;
+  m_program = NULL;
+  m_programNext = NULL;
+  m_programDepth = 0;
+  m_programError = -1;
+  m_outOfRange = false;
+  m_fixedTimestep = false;
+  m_maxCatchUp = 4;
+  m_lateTicks = 0;
+  m_missedTicks = 0;
+  m_encoderDelta1 = 0;
+  m_encoderDelta2 = 0;
+  m_motorCommand[0] = 0;
+  m_motorCommand[1] = 0;
+  for (int i = 0; i < 2; i++) {
+    m_motorPower[i] = 0;
+    m_motorOutput[i] = 0;
+    m_motorAge_ms[i] = 0;
+  }
+  m_motorWrites = 0;
+  m_stepPen = 0;
+  m_eventFirst = 0;
+  m_eventCount = 0;
+  m_droppedEvents = 0;
+  m_onStart = NULL;
+  m_onStartContext = NULL;
+  m_onComplete = NULL;
+  m_onCompleteContext = NULL;
+  m_onQueueLow = NULL;
+  m_onQueueLowContext = NULL;
+  m_queueLowWater = 0;
+  m_pose.x = 0;
+  m_pose.y = 0;
+  m_pose.heading = 0;
+  m_headingCos = 1;
+  m_headingSin = 0;
+  m_imuOffset = 0;
+  m_imuOffsetValid = false;
+  m_imuValid = false;
+  m_imuFresh = false;
+  m_imuSample = 0;
+  m_imuExtrapolation = 0;
+  m_imuPeriod_ms = IMU_PERIOD_MS;
+  m_imuTimer_ms = 0;
+  m_imuSampleTime_ms = 0;
+
+#ifdef NAV_INSTRUMENTATION
+  m_actionStart_ms = 0;
+  m_actionSteps = 0;
+  m_actionPeakCorrection = 0;
+  m_traceDumping = false;
+  clearInstrumentation();
+#endif
+
+  // Thread every slot of the action pool onto the free list, no further allocation happens after this
+  for (int i = NAV_QUEUE_CAPACITY - 1; i >= 0; i--) {
+    m_actionPool[i].type = NAV_STOP;
+    m_actionGeneration[i] = 0;
+    m_actionSpeed[i] = 0;
+    m_actionState[i] = 0;
+    releaseAction(i);
+  }
+  m_pathFreeList = NO_CHUNK;
+  for (int i = NAV_PATH_CHUNKS - 1; i >= 0; i--) {
+    m_pathPool[i].next = m_pathFreeList;
+    m_pathFreeList = i;
+  }
 }
 
 /*!
- * \brief Clears all actions from the navigation queue
+ * \brief Clears all actions from the navigation queue, and stops any program started with runProgram()
  */
 void Drawbotic_Navigation::clearAllActions() {
+  if (m_recorder)
+    m_recorder->write((uint8_t)NAV_REC_CLEAR);
+  enterCritical();
   // Iterate through the queue until there is nothing next
-  while (m_queueHead != NULL)
+  while (m_queueHead != NO_ACTION)
   {
-    NavigationAction *a = m_queueHead;
-    m_queueHead = a->next;
-    delete a; // Delete each action object
+    NavigationIndex a = m_queueHead;
+    m_queueHead = m_actionPool[a].next;
+    releaseAction(a); // Return each action to the pool
   }
   // Reset the queue state
   m_queueSize = 0;
-  m_queueHead = NULL;
-  m_queueTail = NULL;
+  m_queueHead = NO_ACTION;
+  m_queueTail = NO_ACTION;
+  m_currentActive = false;
+  m_entrySpeed = 0;
+  // nothing is left to credit an overshoot to
+  m_encoderResidual += m_carry + (m_rotateCarry != 0 ? rotationTicks(m_rotateCarry) * (m_rotateCarry > 0 ? 1 : -1) : 0);
+  m_carry = 0;
+  m_rotateCarry = 0;
+  m_headingValid = false;
+  m_programNext = NULL;
+  exitCritical();
 }
 
 /*!
@@ -41,15 +303,12 @@ void Drawbotic_Navigation::clearAllActions() {
  * 
  * \param distance_mm The distance in millimetres to travel
  * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or the distance is too far to count in encoder signals
  */
-void Drawbotic_Navigation::addForwardAction(float distance_mm, bool front) {
-  NavigationAction* a = makeForwardAction(distance_mm);
-  if(front) {
-    addActionFront(a);
-  }
-  else {
-    addActionBack(a);
-  }
+NavigationHandle Drawbotic_Navigation::addForwardAction(float distance_mm, bool front) {
+  if (m_recorder)
+    recordAction(NAV_FORWARD, front, &distance_mm, 1);
+  return enqueueAction(makeForwardAction(distance_mm), front);
 }
 
 /*!
@@ -58,15 +317,14 @@ void Drawbotic_Navigation::addForwardAction(float distance_mm, bool front) {
  * \param radius_mm The radius of the circle that defines the arc for DB-1 to follow
  * \param angle_deg The number of degrees around that circle that DB-1 should go. A positive angle moves DB-1 in a Counter-Clockwise direction, a negative angle moves DB-1 in a Clockwise direction.
  * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or the outside wheel would travel further than 65535 encoder signals
  */
-void Drawbotic_Navigation::addTurnAction(float radius_mm, float angle_deg, bool front) {
-  NavigationAction* a = makeTurnAction(radius_mm, angle_deg);
-  if(front) {
-    addActionFront(a);
-  }
-  else {
-    addActionBack(a);
+NavigationHandle Drawbotic_Navigation::addTurnAction(float radius_mm, float angle_deg, bool front) {
+  if (m_recorder) {
+    float values[2] = { radius_mm, angle_deg };
+    recordAction(NAV_TURN, front, values, 2);
   }
+  return enqueueAction(makeTurnAction(radius_mm, angle_deg), front);
 }
 
 /*!
@@ -74,17 +332,14 @@ void Drawbotic_Navigation::addTurnAction(float radius_mm, float angle_deg, bool
  * 
  * \param angle_deg The number of degrees to rotate. A positive angle moves DB-1 in a Counter-Clockwise direction, a negative angle moves DB-1 in a Clockwise direction.
  * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or the angle is beyond +/-3276.7 degrees
  * 
  * \note This action is made more accurate by using the IMU which may be susceptible to magnetic interference. If accuracy issues present try disabling the IMU in the constructor.
  */
-void Drawbotic_Navigation::addRotateAction(float angle_deg, bool front) {
-  NavigationAction* a = makeRotateAction(angle_deg);
-  if(front) {
-    addActionFront(a);
-  }
-  else {
-    addActionBack(a);
-  }
+NavigationHandle Drawbotic_Navigation::addRotateAction(float angle_deg, bool front) {
+  if (m_recorder)
+    recordAction(NAV_ROTATE, front, &angle_deg, 1);
+  return enqueueAction(makeRotateAction(angle_deg), front);
 }
 
 /*!
@@ -92,15 +347,12 @@ void Drawbotic_Navigation::addRotateAction(float angle_deg, bool front) {
  * 
  * \param time_ms The time (in milliseconds) to stop for
  * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or the time is longer than 2^32 - 1 ms
  */
-void Drawbotic_Navigation::addStopAction(float time_ms, bool front) {
-  NavigationAction* a = makeStopAction(time_ms);
-  if(front) {
-    addActionFront(a);
-  }
-  else {
-    addActionBack(a);
-  }
+NavigationHandle Drawbotic_Navigation::addStopAction(float time_ms, bool front) {
+  if (m_recorder)
+    recordAction(NAV_STOP, front, &time_ms, 1);
+  return enqueueAction(makeStopAction(time_ms), front);
 }
 
 /*!
@@ -108,389 +360,3095 @@ void Drawbotic_Navigation::addStopAction(float time_ms, bool front) {
  * 
  * \param down If true the action will cause DB-1 to lower the pen when processed. If false the action will raise the pen
  * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions
  */
-void Drawbotic_Navigation::addPenAction(bool down, bool front) {
-  NavigationAction* a = makePenAction(down);
-  if(front) {
-    addActionFront(a);
-  }
-  else {
-    addActionBack(a);
+NavigationHandle Drawbotic_Navigation::addPenAction(bool down, bool front) {
+  if (m_recorder) {
+    float value = down ? 1.0f : 0.0f;
+    recordAction(down ? NAV_PEN_DOWN : NAV_PEN_UP, front, &value, 1);
   }
+  return enqueueAction(makePenAction(down), front);
 }
 
 /*!
- * \brief Update the navigation system. This method will recalculate the motor speeds based on the current action to perform. If an action is complete calling update will cause the queue to move on to the next action. Calling update while the queue is empty will have no effect.
+ * \brief Add a new rotate to action to the navigation queue. The action will cause DB-1 to rotate on the spot until it faces an absolute heading
  * 
- * \param deltaTime_ms The number of milliseconds that have past since update was last called. This is required to ensure that timing based actions are performed correctly. It is also used to determine if the next step of the navigation logic should be performed. See the updateRate_ms paramter in the Constructor
+ * \param heading_deg The heading to face, in degrees counter-clockwise from the heading DB-1 had when the pose was last reset. See getPose()
+ * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or the heading isn't a number
  * 
- * \note Update must be called peroidically within the main execution loop. The delta time parameter must be correctly provided by the calling code.
+ * \note The rotation needed is worked out from the estimated pose when the action starts, so errors from earlier actions are not carried forward.
  */
-void Drawbotic_Navigation::update(float deltaTime_ms) {
-  m_timeBank += deltaTime_ms;
-
-  // if enough time has passed for another update
-  if (m_timeBank >= m_updateRate_ms) {
-    // assign the action at the head of the queue as the current action
-    NavigationAction *currentAction = m_queueHead;
-    if (currentAction != NULL) {
-      // perform a step of the current action and check if the action has finished
-      bool finished = false;
-      switch (currentAction->type) {
-      case NAV_FORWARD:
-        finished = driveForward(currentAction);
-        break;
-      case NAV_TURN:
-          finished = turn(currentAction);
-        break;
-      case NAV_ROTATE:
-        if(m_useIMU)
-          finished = rotateIMU(currentAction);
-        else
-          finished = rotateEnc(currentAction);
-        break;
-      case NAV_STOP:
-        finished = stop(currentAction, deltaTime_ms);
-        break;
-      case NAV_PEN_UP:
-        finished = penUp();
-        break;
-      case NAV_PEN_DOWN:
-        finished = penDown();
-        break;
-      }
-
-      if (finished) {
-        // Move to the next item in the queue
-        m_queueHead = currentAction->next;
-        delete currentAction;
-        m_queueSize--;
-
-        if(m_queueHead) {
-          if(m_queueHead->type == NAV_ROTATE && m_useIMU) {
-            setupRotationAction(m_queueHead);
-          }
-        }
-
-        //reset encoder deltas to play nice with next action
-        DB1.resetEncoderDeltas();
-
-        // if the queue is empty, stop the robot
-        if (m_queueSize == 0) {
-          DB1.setMotorSpeed(1, 0);
-          DB1.setMotorSpeed(2, 0);
-          m_queueHead = NULL;
-          m_queueTail = NULL;
-        }
-      }
-    }
-    m_timeBank = 0; // reset the time bank for the next update
+NavigationHandle Drawbotic_Navigation::addRotateToAction(float heading_deg, bool front) {
+  if (m_recorder)
+    recordAction(NAV_ROTATE_TO, front, &heading_deg, 1);
+  // only the direction matters, so any heading can be wrapped into range without losing anything
+  heading_deg = wrapAngle(fmod(heading_deg, 360.0f));
+  if (!fitsTenths(heading_deg)) {
+    m_outOfRange = true;
+    return NAV_NO_HANDLE;
   }
+  NavigationIndex a = allocateAction(NAV_ROTATE_TO);
+  if (a != NO_ACTION)
+    m_actionPool[a].params.rotate.angle = toTenths(heading_deg);
+  return enqueueAction(a, front);
 }
 
 /*!
- * \brief Sets the maximum speed that DB-1 will use during navigation movements
+ * \brief Add a new move to action to the navigation queue. The action will cause DB-1 to rotate to face an absolute position and then drive forward to it
  * 
- * \param speed A vaule between 0.0-1.0 where 0.0 is no power and 1.0 is full power
+ * \param x_mm The x coordinate to move to, in millimetres. See getPose()
+ * \param y_mm The y coordinate to move to, in millimetres. See getPose()
+ * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or a coordinate is beyond +/-3276.7 mm
+ * 
+ * \note The rotation and distance needed are worked out from the estimated pose when each part of the action starts. Ending a shape with a move to its starting point closes it regardless of how much error built up while drawing it.
  */
-void Drawbotic_Navigation::setSpeed(float speed) {
-  if (speed > 0 && speed < 1)
-    m_speed = speed;
-}
-
-Drawbotic_Navigation::NavigationAction *Drawbotic_Navigation::makeForwardAction(float distance_mm) {
-  NavigationAction *newAction = new NavigationAction();
-  newAction->type = NAV_FORWARD;
-  newAction->desiredDistance = distance_mm;
-  newAction->followSpeed = m_speed;
-  newAction->progress = 0;
-
-  return newAction;
+NavigationHandle Drawbotic_Navigation::addMoveToAction(float x_mm, float y_mm, bool front) {
+  if (m_recorder) {
+    float values[2] = { x_mm, y_mm };
+    recordAction(NAV_MOVE_TO, front, values, 2);
+  }
+  if (!fitsTenths(x_mm) || !fitsTenths(y_mm)) {
+    m_outOfRange = true;
+    return NAV_NO_HANDLE;
+  }
+  NavigationIndex a = allocateAction(NAV_MOVE_TO);
+  if (a != NO_ACTION) {
+    m_actionPool[a].params.point.x = toTenths(x_mm);
+    m_actionPool[a].params.point.y = toTenths(y_mm);
+  }
+  return enqueueAction(a, front);
 }
 
-Drawbotic_Navigation::NavigationAction *Drawbotic_Navigation::makeTurnAction(float radius_mm, float angle_deg) {
-  NavigationAction *newAction = new NavigationAction();
-  newAction->type = NAV_TURN;
-  newAction->desiredRadius = radius_mm;
-  newAction->followSpeed = m_speed;
-  newAction->progress = 0;
-  if(m_useIMU) {
-    //newAction->initialAngle = DB1.getOrientation().heading;
-    newAction->desiredAngle = angle_deg;
-  } 
-  else {
-    newAction->desiredAngle = angle_deg;
+/*!
+ * \brief Add a new arc to action to the navigation queue. The action will cause DB-1 to follow a circular arc that continues on from its current heading and ends at an absolute position
+ * 
+ * \param x_mm The x coordinate to finish at, in millimetres. See getPose()
+ * \param y_mm The y coordinate to finish at, in millimetres. See getPose()
+ * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue is already holding NAV_QUEUE_CAPACITY actions or a coordinate is beyond +/-3276.7 mm
+ * 
+ * \note The arc is worked out from the estimated pose when the action starts and then performed as a turn action. If the target is straight ahead DB-1 drives forward to it, a target directly behind DB-1 can't be reached.
+ */
+NavigationHandle Drawbotic_Navigation::addArcToAction(float x_mm, float y_mm, bool front) {
+  if (m_recorder) {
+    float values[2] = { x_mm, y_mm };
+    recordAction(NAV_ARC_TO, front, values, 2);
   }
-
-  return newAction;
+  if (!fitsTenths(x_mm) || !fitsTenths(y_mm)) {
+    m_outOfRange = true;
+    return NAV_NO_HANDLE;
+  }
+  NavigationIndex a = allocateAction(NAV_ARC_TO);
+  if (a != NO_ACTION) {
+    m_actionPool[a].params.point.x = toTenths(x_mm);
+    m_actionPool[a].params.point.y = toTenths(y_mm);
+  }
+  return enqueueAction(a, front);
 }
 
-Drawbotic_Navigation::NavigationAction *Drawbotic_Navigation::makeRotateAction(float angle_deg) {
-  NavigationAction *newAction = new NavigationAction();
-  newAction->type = NAV_ROTATE;
-  newAction->followSpeed = m_speed;
-  newAction->progress = 0;
-  newAction->desiredAngle = angle_deg;
-  
-  if(m_useIMU) 
-    setupRotationAction(newAction);
-
-  return newAction;
+/*!
+ * \brief Add a new bezier action to the navigation queue. The action will cause DB-1 to follow a cubic bezier curve from wherever it is to an absolute position
+ * 
+ * \param c1x_mm The x coordinate of the first control point, in millimetres. See getPose()
+ * \param c1y_mm The y coordinate of the first control point, in millimetres
+ * \param c2x_mm The x coordinate of the second control point, in millimetres
+ * \param c2y_mm The y coordinate of the second control point, in millimetres
+ * \param x_mm The x coordinate to finish at, in millimetres
+ * \param y_mm The y coordinate to finish at, in millimetres
+ * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue or the NAV_PATH_POINTS curve points are full, or a coordinate is beyond +/-3276.7 mm
+ * 
+ * \note The curve starts from the estimated pose when the action starts, like the current point of an SVG path. DB-1 first rotates on the spot to face along the curve, then steers continuously along it.
+ */
+NavigationHandle Drawbotic_Navigation::addBezierAction(float c1x_mm, float c1y_mm, float c2x_mm, float c2y_mm, float x_mm, float y_mm, bool front) {
+  float points[6] = { c1x_mm, c1y_mm, c2x_mm, c2y_mm, x_mm, y_mm };
+  if (m_recorder)
+    recordAction(NAV_BEZIER, front, points, 6);
+  return enqueueAction(makePathAction(NAV_BEZIER, points, 3), front);
 }
 
-Drawbotic_Navigation::NavigationAction *Drawbotic_Navigation::makeStopAction(float time_ms) {
-  NavigationAction *newAction = new NavigationAction();
-  newAction->type = NAV_STOP;
-  newAction->desiredTime = time_ms;
-  newAction->followSpeed = m_speed;
-  newAction->progress = 0;
-
-  return newAction;
+/*!
+ * \brief Add a new polyline action to the navigation queue. The action will cause DB-1 to follow a series of straight lines through absolute positions, starting from wherever it is
+ * 
+ * \param points_mm The points to visit as pairs of x and y coordinates in millimetres, count pairs in total. See getPose()
+ * \param count The number of points
+ * \param front (Default: false) If true this action will be inserted at the front of the queue, before all existing queued actions
+ * \return The handle of the queued action, or NAV_NO_HANDLE if the queue or the NAV_PATH_POINTS curve points are full, or a coordinate is beyond +/-3276.7 mm
+ * 
+ * \note Gentle corners are smoothed over by steering towards a point NAV_PATH_LOOKAHEAD ahead along the line, so a finely divided curve is followed without stopping. At corners sharper than NAV_PATH_CORNER degrees DB-1 stops and rotates on the spot instead.
+ */
+NavigationHandle Drawbotic_Navigation::addPolylineAction(const float *points_mm, int count, bool front) {
+  if (m_recorder && count > 0)
+    recordAction(NAV_POLYLINE, front, points_mm, count * 2);
+  return enqueueAction(makePathAction(NAV_POLYLINE, points_mm, count), front);
 }
 
-Drawbotic_Navigation::NavigationAction *Drawbotic_Navigation::makePenAction(bool down) {
-  NavigationAction *newAction = new NavigationAction();
-  newAction->type = down ? NAV_PEN_DOWN : NAV_PEN_UP;
-  newAction->followSpeed = m_speed;
-  newAction->progress = 0;
-
-  return newAction;
+/*!
+ * \brief Remove a queued action, whether or not it has started, without disturbing the rest of the queue
+ * 
+ * \param action The handle returned when the action was queued
+ * \return true if the action was removed, false if it had already completed or been removed
+ * 
+ * \note Cancelling the action being performed stops the motors where DB-1 is, and the next action starts from rest. A cancelled action never completes, so onActionComplete() isn't called for it.
+ */
+bool Drawbotic_Navigation::cancelAction(NavigationHandle action) {
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_CANCEL);
+    recordHandle(action);
+  }
+  enterCritical();
+  NavigationIndex a = handleAction(action);
+  if (a != NO_ACTION) {
+    if (a == m_queueHead && m_currentActive)
+      abandonAction();
+    unlinkAction(a);
+    // the action being performed may have been slowing down for the one removed
+    if (m_currentActive)
+      m_current.exitSpeed = planExitSpeed();
+  }
+  exitCritical();
+  return a != NO_ACTION;
 }
 
-void Drawbotic_Navigation::setupRotationAction(NavigationAction* action) {
-  float currentAngle = DB1.getOrientation().heading;
-  action->finalAngle = currentAngle + action->desiredAngle;
-  if(action->finalAngle >= 360.0f) {
-    action->finalAngle -= 360.0f;
+/*!
+ * \brief Put one queued action in the place of another, which is removed. The replacement is usually one that was just queued, for example replaceAction(action, addForwardAction(50))
+ * 
+ * \param action The handle of the action to remove
+ * \param replacement The handle of the action to move into its place, it keeps this handle
+ * \return true if the action was replaced, false if either action had already completed or been removed
+ * 
+ * \note Replacing the action being performed stops the motors where DB-1 is and starts the replacement from rest, as cancelAction() does. Moving the action being performed into the place of another stops the motors too, and it carries on from where it was stopped once it is reached.
+ */
+bool Drawbotic_Navigation::replaceAction(NavigationHandle action, NavigationHandle replacement) {
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_REPLACE);
+    recordHandle(action);
+    recordHandle(replacement);
   }
-  else if(action->finalAngle < 0) {
-    action->finalAngle += 360.0f;
+  enterCritical();
+  NavigationIndex a = handleAction(action);
+  NavigationIndex r = handleAction(replacement);
+  bool replaced = a != NO_ACTION && r != NO_ACTION && a != r;
+  if (replaced) {
+    if (a == m_queueHead && m_currentActive)
+      abandonAction();
+    else if (r == m_queueHead && m_currentActive) {
+      // the replacement is being performed, keep what is left of it for when it is reached and start whatever is
+      // first now from rest
+      suspendAction();
+      abandonAction();
+    }
+    // take the replacement out of the queue first, it may be next to the action it replaces
+    detachAction(r);
+    NavigationIndex prev = m_actionPool[a].prev;
+    NavigationIndex next = m_actionPool[a].next;
+    m_actionPool[r].prev = prev;
+    m_actionPool[r].next = next;
+    if (prev != NO_ACTION)
+      m_actionPool[prev].next = r;
+    else
+      m_queueHead = r;
+    if (next != NO_ACTION)
+      m_actionPool[next].prev = r;
+    else
+      m_queueTail = r;
+    releaseAction(a);
+    m_queueSize--;
+    if (m_currentActive)
+      m_current.exitSpeed = planExitSpeed();
   }
+  exitCritical();
+  return replaced;
 }
 
-void Drawbotic_Navigation::addActionFront(NavigationAction *action) {
-  // The previous node of the current head is the new node
-  m_queueHead->prev = action;
-
-  // The previous node of the new node is nothing (it's at the head of the queue)
-  action->prev = NULL;
-  // The next node of the new node is the current head node
-  action->next = m_queueHead;
-  // Update the head node to point to the new node
-  m_queueHead = action;
-
-  // If the queue is empty the new node is also the current tail node
-  if (m_queueSize == 0)
-    m_queueTail = action;
+/*!
+ * \brief Change the maximum speed of a single queued action, in place of the speed given to setSpeed() or setVelocity()
+ * 
+ * \param action The handle returned when the action was queued
+ * \param speed A value between 0.0-1.0 on the same scale as setSpeed(), used for both moving and rotating. 0 goes back to the speeds given to setSpeed()
+ * \return true if the speed was changed, false if the speed is out of range or the action has already completed or been removed
+ * 
+ * \note The speed is kept to 1/255 and takes effect straight away, even part way through the action. The actions either side of it blend into it at no more than this speed. optimize() only combines actions with the same speed.
+ */
+bool Drawbotic_Navigation::setActionSpeed(NavigationHandle action, float speed) {
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_SPEED);
+    recordHandle(action);
+    recordFloat(speed);
+  }
+  if (speed < 0 || speed >= 1)
+    return false;
 
-  // Update the size of the queue
-  m_queueSize++;
+  enterCritical();
+  NavigationIndex a = handleAction(action);
+  if (a != NO_ACTION) {
+    m_actionSpeed[a] = speed > 0 ? (uint8_t)constrain(roundToInt(speed * 255.0f), 1, 255) : 0;
+    // the speed the running action finishes at depends on the speeds of the actions after it
+    if (m_currentActive)
+      m_current.exitSpeed = planExitSpeed();
+  }
+  exitCritical();
+  return a != NO_ACTION;
 }
 
-void Drawbotic_Navigation::addActionBack(NavigationAction *action) {
-  // The next node of the current tail is the new node
-  m_queueTail->next = action;
+/*!
+ * \brief Check whether an action is still in the queue
+ * 
+ * \param action The handle returned when the action was queued
+ * \return true if the action is waiting or being performed, false once it has completed or been removed
+ */
+bool Drawbotic_Navigation::isActionQueued(NavigationHandle action) {
+  enterCritical();
+  bool queued = handleAction(action) != NO_ACTION;
+  exitCritical();
+  return queued;
+}
 
-  // The previous node of the new node is the current tail
-  action->prev = m_queueTail;
-  // The next node of the new node is nothing (it's at the end of the queue)
-  action->next = NULL;
-  // Update the tail node to point to the new node
-  m_queueTail = action;
+/*!
+ * \brief The action at the front of the queue, which is being performed or will be by the next step
+ * 
+ * \return The handle of the action, or NAV_NO_HANDLE if the queue is empty
+ */
+NavigationHandle Drawbotic_Navigation::getCurrentAction() {
+  enterCritical();
+  NavigationHandle action = m_queueHead != NO_ACTION ? actionHandle(m_queueHead) : NAV_NO_HANDLE;
+  exitCritical();
+  return action;
+}
 
-  // If the queue is empty the new node is also the current head node
-  if (m_queueSize == 0)
-    m_queueHead = action;
+/*!
+ * \brief Set the function update() calls when an action starts, once per action even if it is suspended by an action added to the front of the queue and resumed
+ * 
+ * \param callback The function to call, or NULL to stop calling one
+ * \param context (Default: NULL) A pointer passed to the function, for example the sketch object that owns this instance
+ * 
+ * \note Starts and completions happen during the navigation steps and are passed on at the end of the call to update() they happen in, or the next one when the steps are run from an interrupt, in the order they happened. The callbacks can safely add, cancel and replace actions. See getDroppedEvents()
+ */
+void Drawbotic_Navigation::onActionStart(NavigationActionCallback callback, void *context) {
+  enterCritical();
+  m_onStart = callback;
+  m_onStartContext = context;
+  exitCritical();
+}
 
-  // Update the size of the queue
-  m_queueSize++;
+/*!
+ * \brief Set the function update() calls when an action completes, see onActionStart()
+ * 
+ * \param callback The function to call, or NULL to stop calling one. The handle it is given no longer refers to a queued action
+ * \param context (Default: NULL) A pointer passed to the function
+ */
+void Drawbotic_Navigation::onActionComplete(NavigationActionCallback callback, void *context) {
+  enterCritical();
+  m_onComplete = callback;
+  m_onCompleteContext = context;
+  exitCritical();
 }
 
-bool Drawbotic_Navigation::driveForward(NavigationAction *action) {
-  float encoderCount = action->progress;
-  float dist = action->desiredDistance;
+/*!
+ * \brief Set the function update() calls when completed actions leave the queue running low, so more can be queued just in time
+ * 
+ * \param callback The function to call, or NULL to stop calling one
+ * \param lowWater (Default: a quarter of the queue capacity) The function is called, once per call to update(), when actions have completed and this many or fewer are left. At least NAV_LOOKAHEAD keeps the speed planning blending between actions
+ * \param context (Default: NULL) A pointer passed to the function
+ */
+void Drawbotic_Navigation::onQueueLow(NavigationQueueCallback callback, int lowWater, void *context) {
+  enterCritical();
+  m_onQueueLow = callback;
+  m_queueLowWater = lowWater;
+  m_onQueueLowContext = context;
+  exitCritical();
+}
 
-  //float circum = 2 * WHEEL_RADIUS * M_PI;
+/*!
+ * \brief Simplify the queued actions before they are performed. Consecutive forward, rotate, stop and matching turn actions are combined, actions that have no effect are removed, rotations followed by an absolute rotate to, or by a move to or curve that takes DB-1 somewhere else, are dropped and only the last of several pen actions in a row is kept
+ * 
+ * \param reorderStrokes (Default: false) If true the pen down strokes in the queue are also reordered, nearest first, to reduce the distance travelled with the pen up. The travel between strokes is replaced by move to and rotate to actions, and if the queue ends with travel after the last stroke DB-1 still finishes at the same pose
+ * \return How many actions were removed and the estimated pen up travel saved, both 0 if the steps are interrupt driven
+ * 
+ * \note Nothing is changed while the steps are run from a timer interrupt, see setInterruptDriven(), as the interrupt would have to be held off for the whole of the passes. Optimise the queue before enabling it.
+ * \note The action currently being performed is never changed. Handles to the actions that are combined, removed or reordered may no longer be queued, or may refer to the action that took their place. Strokes are only reordered when no action has started yet, every stroke begins with a pen down action and ends with a pen up action, the pen is up when the queue starts and there are no stop actions between strokes. Otherwise the queue is only simplified.
+ */
+NavigationOptimizeResult Drawbotic_Navigation::optimize(bool reorderStrokes) {
+  NavigationOptimizeResult result;
+  result.actionsRemoved = 0;
+  result.travelSaved_mm = 0;
+  // the passes take time that grows with the square of the queue, far too long to keep the timer interrupt waiting
+  if (m_interruptDriven)
+    return result;
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_OPTIMIZE);
+    m_recorder->write((uint8_t)reorderStrokes);
+  }
 
-  // calculating how many encoder signals are equivalent to the input travel distance
-  float encLimit = (dist * ENC_BITS_P_MM * FORWARD_ERROR);//ENC_BITS_P_REV * FORWARD_ERROR) / circum;
+  int sizeBefore = m_queueSize;
+  // keep simplifying until nothing changes, removing one action can leave its neighbours ready to be combined
+  while (removeRedundantActions() > 0) {
+  }
+  if (reorderStrokes && !m_currentActive)
+    result.travelSaved_mm = this->reorderStrokes();
+  result.actionsRemoved = sizeBefore - m_queueSize;
 
-  int encError = encLimit - encoderCount;
-  float power = constrain(m_speed * (encError * FORWARD_KP), SPEED_MIN, m_speed);
+  return result;
+}
 
-  if (encError > 0) {
-    // finding the difference between the two encoders since last read
-    float d1 = DB1.getM1EncoderDelta();
-    float d2 = DB1.getM2EncoderDelta();
-    float error = d1 - d2;
-    // calculating the second motor speed based on the error value and the correction "strength" factor
-    action->followSpeed += (error * m_cp);
-
-    DB1.setMotorSpeed(1, power);
-    DB1.setMotorSpeed(2, action->followSpeed);
-    action->progress = encoderCount + d1;
-    return false; // not finished
+/*!
+ * \brief Sets the estimated pose of DB-1, for example after placing it at a known position on the page
+ * 
+ * \param x_mm The x coordinate in millimetres
+ * \param y_mm The y coordinate in millimetres
+ * \param heading_deg The heading in degrees counter-clockwise from the x axis
+ */
+void Drawbotic_Navigation::setPose(float x_mm, float y_mm, float heading_deg) {
+  // the IMU is read first, an I2C read takes far too long to hold the timer interrupt off for
+  if (m_useIMU)
+    sampleIMU();
+  float heading = wrapAngle(heading_deg);
+  float headingCos = cos(heading * M_PI / 180.0f);
+  float headingSin = sin(heading * M_PI / 180.0f);
+
+  enterCritical();
+  m_pose.x = x_mm;
+  m_pose.y = y_mm;
+  m_pose.heading = heading;
+  m_headingCos = headingCos;
+  m_headingSin = headingSin;
+
+  // Remember how the IMU heading relates to the pose heading so the two can be combined
+  if (m_useIMU) {
+    m_imuFresh = false;
+    m_imuOffset = wrapAngle(imuHeading() - m_pose.heading);
+    m_imuOffsetValid = true;
+  }
+  exitCritical();
+
+  // recorded after the IMU sample it took, so a replay has the heading ready
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_POSE);
+    recordFloat(x_mm);
+    recordFloat(y_mm);
+    recordFloat(heading_deg);
   }
-  return true; // finished
 }
 
-bool Drawbotic_Navigation::turn(NavigationAction *action)
-{
-  float angleCount = action->progress;
-  float arcRad = action->desiredRadius;
-  float angle = action->desiredAngle;
-
-  // left turn
-  if (angle >= 0) {
-    float r1 = arcRad + BOT_RADIUS;
-    float r2 = arcRad - BOT_RADIUS;
-
-    // how much slower the inside wheel needs to spin to match the angular velocity of the outside wheel
-    float multiplier = r2 / r1;
+/*!
+ * \brief Update the navigation system. This method will recalculate the motor speeds based on the current action to perform. If an action is complete calling update will cause the queue to move on to the next action. Calling update while the queue is empty will have no effect.
+ * 
+ * \param deltaTime_ms The number of milliseconds that have past since update was last called. This is required to ensure that timing based actions are performed correctly. It is also used to determine if the next step of the navigation logic should be performed. See the updateRate_ms paramter in the Constructor
+ * 
+ * \note Update must be called peroidically within the main execution loop. The delta time parameter must be correctly provided by the calling code.
+ * \note By default each update performs at most one navigation step which covers all of the time banked since the last step. See setFixedTimestep() to instead step at exactly updateRate_ms intervals, and setInterruptDriven() to run the navigation steps from a timer interrupt.
+ */
+void Drawbotic_Navigation::update(float deltaTime_ms) {
+  unsigned long start_ms = m_recorder ? millis() : 0;
+
+  // the IMU is sampled at its own rate, outside of the navigation steps, so a slow read never holds up the motors
+  if (m_useIMU) {
+    m_imuTimer_ms += deltaTime_ms;
+    if (m_imuTimer_ms >= m_imuPeriod_ms) {
+      // keep to the period however the calls fall, but don't try to catch up on samples missed during a long gap
+      m_imuTimer_ms -= m_imuPeriod_ms;
+      if (m_imuTimer_ms >= m_imuPeriod_ms)
+        m_imuTimer_ms = 0;
+      sampleIMU();
+    }
+  }
 
-    if (angleCount < angle)
-    {
-      // finding the difference between the two encoders since last read
-      float d1 = DB1.getM1EncoderDelta();
-      float d2 = DB1.getM2EncoderDelta();
-      float error = d1 - (d2 / multiplier);
+  if (m_stream)
+    serviceStream();
+  if (m_programNext)
+    serviceProgram();
 
-      // calculating the second motor speed based on the error value and the correction "strength" factor
-      action->followSpeed += (error * m_cp);
+  // when the steps are being run from an interrupt there is nothing else for the main loop to do but report what they did
+  if (m_interruptDriven) {
+    dispatchEvents();
+    return;
+  }
 
-      DB1.setMotorSpeed(1, m_speed);
-      DB1.setMotorSpeed(2, action->followSpeed * multiplier);
-      // calculating progress in degrees based on encoder signals
-      action->progress = angleCount + (180 * d1) / (M_PI * ENC_BITS_P_MM * r1 * L_TURN_ERROR);
+  m_timeBank += deltaTime_ms;
 
-      return false;
+  // time slept through while there was nothing to do, see getIdleTime(), is covered by a single step that isn't late
+  if (m_timeBank >= 2 * m_updateRate_ms && isResting()) {
+    step(m_timeBank);
+    m_timeBank = 0;
+  }
+  // if enough time has passed for another update
+  else if (m_timeBank >= m_updateRate_ms) {
+    // more than a whole step has gone by without one being performed
+    if (m_timeBank >= 2 * m_updateRate_ms)
+      m_lateTicks++;
+
+    if (m_fixedTimestep) {
+      // perform steps of exactly the update rate, catching up on a limited number of steps if update was called late
+      uint8_t steps = 0;
+      while (m_timeBank >= m_updateRate_ms && steps <= m_maxCatchUp) {
+        step(m_updateRate_ms);
+        m_timeBank -= m_updateRate_ms;
+        steps++;
+      }
+      // give up on any steps that couldn't be caught up, keeping the fraction of a step left over
+      while (m_timeBank >= m_updateRate_ms) {
+        m_timeBank -= m_updateRate_ms;
+        m_missedTicks++;
+      }
+    }
+    else {
+      // perform a single step covering all of the banked time, any further whole steps in it are missed
+      m_missedTicks += (uint32_t)(m_timeBank / m_updateRate_ms) - 1;
+      step(m_timeBank);
+      m_timeBank = 0; // reset the time bank for the next update
     }
   }
-  else if (angle < 0) { // right turn
-    float r1 = arcRad - BOT_RADIUS;
-    float r2 = arcRad + BOT_RADIUS;
-
-    // how much slower the inside wheel needs to spin to match the angular velocity of the outside wheel
-    float multiplier = r1 / r2;
 
-    // angle is negative so the absolute value is taken
-    if (angleCount < abs(angle)) {
-      // finding the difference between the two encoders since last read
-      float d1 = DB1.getM1EncoderDelta();
-      float d2 = DB1.getM2EncoderDelta();
-      float error = d2 - (d1 / multiplier);
+  // the update is recorded after the inputs its steps read, so a replay has them ready when it calls update()
+  if (m_recorder) {
+    uint8_t record[5] = { NAV_REC_UPDATE, (uint8_t)start_ms, (uint8_t)(start_ms >> 8), (uint8_t)(start_ms >> 16), (uint8_t)(start_ms >> 24) };
+    m_recorder->write(record, sizeof(record));
+    recordFloat(deltaTime_ms);
+  }
 
-      // calculating the first motor speed based on the error value and the correction "strength" factor
-      action->followSpeed += (error * m_cp);
+  // the callbacks come last, so anything they queue is recorded after the update that led to it
+  dispatchEvents();
+}
 
-      DB1.setMotorSpeed(1, action->followSpeed * multiplier);
-      DB1.setMotorSpeed(2, m_speed);
-      // calculating progress in degrees based on encoder signals
-      action->progress = angleCount + (180 * d2) / (M_PI * ENC_BITS_P_MM * r2 * R_TURN_ERROR);
-      return false;
-    }
+/*!
+ * \brief How long the sketch can leave update() before it next has something to do, so it can sleep in between, see idleUntilNeeded()
+ * 
+ * \return The time in milliseconds: 0 if update() has work to do now, the time to the next step while DB-1 is moving, what is left of a stop action, or NAV_IDLE_FOREVER if nothing will happen until another action is queued
+ * 
+ * \note A stream with lines waiting, or a program with actions to queue, needs update() straight away. When the steps are run from an interrupt update() is only needed to sample the IMU while DB-1 moves
+ */
+float Drawbotic_Navigation::getIdleTime() {
+  if (m_stream && (m_stream->available() > 0 || m_queueSize + m_streamCredit <= m_streamLowWater ||
+                   (m_streamCurveCredit == 0 && m_pathFreeList != NO_CHUNK)))
+    return 0;
+  if (m_programNext && m_queueSize <= NAV_LOOKAHEAD)
+    return 0;
+
+  enterCritical();
+  float idle_ms = NAV_IDLE_FOREVER;
+  if (m_eventCount > 0)
+    idle_ms = 0;  // starts and completions from an interrupt are waiting for update() to pass them on
+  else if (m_interruptDriven) {
+    if (!isResting() && m_useIMU)
+      idle_ms = m_imuPeriod_ms - m_imuTimer_ms;
   }
-  return true;
+  else if (m_queueSize > 0) {
+    // the next step is due once a whole step has built up, a stop that has started only needs the step that ends it
+    idle_ms = m_updateRate_ms - m_timeBank;
+    if (m_currentActive && m_current.type == NAV_STOP && m_current.desiredTime - m_current.elapsedTime - m_timeBank > idle_ms)
+      idle_ms = m_current.desiredTime - m_current.elapsedTime - m_timeBank;
+  }
+  exitCritical();
+  return idle_ms > 0 ? idle_ms : 0;
 }
 
-bool Drawbotic_Navigation::rotateEnc(NavigationAction *action) {
-  float angleCount = action->progress;
-  float angle = action->desiredAngle;
-
-  // anti-clockwise rotation
-  if (angle >= 0) {
-    if (angleCount < angle) {
-      // finding the difference between the two encoders since last read
-      float d1 = DB1.getM1EncoderDelta();
-      float d2 = DB1.getM2EncoderDelta();
-
-      // the absolute values are taken as negative values are expected
-      d1 = abs(d1);
-      d2 = abs(d2);
-      float error = d1 - d2;
-
-      // calculating the second motor speed based on the error value and the correction "strength" factor
-      action->followSpeed += (error * m_cp);
-      DB1.setMotorSpeed(1, m_speed);
-      DB1.setMotorSpeed(2, -action->followSpeed); // motor 2 needs to spin in the opposite direction
-      
-      // calculating progress in degrees based on encoder signals
-      action->progress = angleCount + (180 * d1) / (M_PI * ENC_BITS_P_MM * BOT_RADIUS * L_ROTATE_ERROR);
-      return false;
-    }
+/*!
+ * \brief Sleep until update() next has something to do, see getIdleTime(), or until an action is queued, started or completed from an interrupt, or a stream given to beginStream() receives data
+ * 
+ * \param maxTime_ms (Default: NAV_IDLE_FOREVER) The longest time to sleep for, for a sketch that has other work to do
+ * 
+ * \note The sleep is the lightest one the board has, waking at every interrupt including the timer behind millis(), so it is only skipped for less than a millisecond. On AVR boards it is the idle sleep mode and on ARM boards a wait for interrupt. Define NAV_WAIT_FOR_INTERRUPT() for the whole build to use another one
+ */
+void Drawbotic_Navigation::idleUntilNeeded(float maxTime_ms) {
+  float idle_ms = getIdleTime();
+  if (idle_ms > maxTime_ms)
+    idle_ms = maxTime_ms;
+  if (idle_ms < 1)
+    return;
+
+  // micros() wraps after about 71 minutes, so longer sleeps end early and the sketch goes back to sleep
+  bool forever = idle_ms >= NAV_IDLE_FOREVER;
+  unsigned long wait_us = (unsigned long)((idle_ms < 3600000.0f ? idle_ms : 3600000.0f) * 1000.0f);
+  unsigned long start_us = micros();
+  enterCritical();
+  int queued = m_queueSize;
+  exitCritical();
+  for (;;) {
+    if (!forever && micros() - start_us >= wait_us)
+      break;
+    if (m_stream && m_stream->available() > 0)
+      break;
+    enterCritical();
+    bool changed = m_queueSize != queued || m_eventCount > 0;
+    exitCritical();
+    if (changed)
+      break;
+    waitForInterrupt();
   }
-  else if (angle < 0) { // clockwise rotation
-    // angle is negative so the absolute value is taken
-    if (angleCount < abs(angle)) {
-      // finding the difference between the two encoders since last read
-      float d1 = DB1.getM1EncoderDelta();
-      float d2 = DB1.getM2EncoderDelta();
+}
 
-      // the absolute values are taken as negative values are expected
-      d1 = abs(d1);
-      d2 = abs(d2);
-      float error = d2 - d1;
+/*!
+ * \brief Start queuing actions sent as text lines over a stream such as Serial, for drawings too large to queue up front. Each call to update() reads a limited number of bytes, so the stream never delays the navigation
+ * 
+ * \param stream The stream to read commands from, and to send flow control replies to
+ * \param lowWater (Default: a quarter of the queue capacity) More actions are asked for once the queue, plus the actions already asked for, drops to this many
+ * 
+ * \note Each line holds one command letter and its numbers separated by spaces: F distance, T radius angle, R angle, S time, P 1 (down) or 0 (up), M x y (move to), H heading (rotate to), A x y (arc to) and B c1x c1y c2x c2y x y (bezier), all in millimetres, degrees and milliseconds. DB-1 replies K n when the sender may send n more command lines, C n when n more of those lines may be beziers, and E for each line it couldn't queue. The sender must never send more lines, or more bezier lines, than it has been allowed.
+ * \note Actions queued by the sketch or a running program share the queue and the curve points with the stream. Only the space that is free when the lines are asked for is granted, so they can be sent at any time without the stream's lines being refused.
+ */
+void Drawbotic_Navigation::beginStream(Stream &stream, int lowWater) {
+  m_stream = &stream;
+  m_streamLength = 0;
+  m_streamOverflow = false;
+  m_streamLowWater = constrain(lowWater, 0, NAV_QUEUE_CAPACITY - 1);
+  m_streamCredit = 0;
+  m_streamCurveCredit = 0;
+  m_streamActions = 0;
+  m_streamErrors = 0;
+}
 
-      // calculating the first motor speed based on the error value and the correction "strength" factor
-      action->followSpeed += (error * m_cp);
+/*!
+ * \brief Stop reading actions from the stream given to beginStream(). Actions already queued are still performed
+ */
+void Drawbotic_Navigation::endStream() {
+  m_stream = NULL;
+}
 
-      DB1.setMotorSpeed(1, -action->followSpeed); // motor 1 needs to spin in the opposite direction
-      DB1.setMotorSpeed(2, m_speed);
+void Drawbotic_Navigation::serviceStream() {
+  // Read what has arrived, a limited number of bytes at a time, and queue each complete line
+  for (int budget = NAV_STREAM_BUDGET; budget > 0 && m_stream->available() > 0; budget--) {
+    int c = m_stream->read();
+    if (c < 0)
+      break;
+    if (c == '\r')
+      continue;
+    if (c != '\n') {
+      if (m_streamLength < NAV_STREAM_LINE - 1)
+        m_streamLine[m_streamLength++] = (char)c;
+      else
+        m_streamOverflow = true;
+      continue;
+    }
 
-      // calculating progress in degrees based on encoder signals
-      action->progress = angleCount + (180 * d2) / (M_PI * ENC_BITS_P_MM * BOT_RADIUS * R_ROTATE_ERROR);
-      return false;
+    m_streamLine[m_streamLength] = '\0';
+    if (m_streamLength > 0 || m_streamOverflow) {
+      // every line uses up one of the sender's credits, whether or not it could be queued
+      if (m_streamCredit > 0)
+        m_streamCredit--;
+      if (m_streamLine[0] == 'B' && m_streamCurveCredit > 0)
+        m_streamCurveCredit--;
+      if (!m_streamOverflow && parseStreamLine())
+        m_streamActions++;
+      else {
+        m_streamErrors++;
+        m_stream->print("E\n");
+      }
     }
+    m_streamLength = 0;
+    m_streamOverflow = false;
   }
-  return true;
-}
-
-bool Drawbotic_Navigation::rotateIMU(NavigationAction *action) {
-  float currentAngle = DB1.getOrientation().heading;
-  
-  //Calculate amount of degrees remaining
-  float error = (int)((currentAngle - action->finalAngle + 540) * 1000) % 360000 - 180000;
-  error /= 1000;
-
-  //motor power is speed, corrected by a proportion defined by the error (directionless)
-  float power = constrain(m_speed * (ROTATE_KP * abs(error)), SPEED_MIN, m_speed);
 
-  //If we've reached the IMU tolerance threshold then we are finished
-  if(error > -IMU_TOLERANCE && error < IMU_TOLERANCE) {
-    return true;
-  }
-  else if(error > 0) {
-    //rotate clockwise if positive error
-    DB1.setMotorSpeed(1, -power);
-    DB1.setMotorSpeed(2, power);
-  }
-  else {
-    //rotate counter clockwise if negative error
-    DB1.setMotorSpeed(1, power);
-    DB1.setMotorSpeed(2, -power);
+  // Once the queue runs low, let the sender fill the rest of it. Actions queued by the sketch or a program share the
+  // queue, so only the slots that are really free are granted
+  int expected = m_queueSize + m_streamCredit;
+  if (expected <= m_streamLowWater) {
+    int grant = NAV_QUEUE_CAPACITY - m_queueSize - m_streamCredit;
+    if (grant > 0) {
+      m_streamCredit += grant;
+      m_stream->print("K ");
+      m_stream->print(grant);
+      m_stream->print("\n");
+    }
   }
 
-  return false;
+  // A bezier line also needs a chunk of curve points, which are granted separately once the sender has used up the
+  // last grant, so lines of other actions are never held back by curves queued elsewhere
+  if (m_streamCurveCredit == 0 && m_pathFreeList != NO_CHUNK) {
+    enterCritical();
+    int chunks = 0;
+    for (NavigationChunkIndex c = m_pathFreeList; c != NO_CHUNK; c = m_pathPool[c].next)
+      chunks++;
+    exitCritical();
+    m_streamCurveCredit = chunks;
+    m_stream->print("C ");
+    m_stream->print(chunks);
+    m_stream->print("\n");
+  }
 }
 
-bool Drawbotic_Navigation::stop(NavigationAction *action, float deltaTime_ms) {
-  float stopDuration = action->desiredTime;
-
-  if (action->progress < stopDuration) {
-    DB1.setMotorSpeed(1, 0);
-    DB1.setMotorSpeed(2, 0);
-    action->progress += deltaTime_ms;
+bool Drawbotic_Navigation::parseStreamLine() {
+  // the command letter, followed by up to six numbers
+  const char *p = m_streamLine;
+  char command = *p++;
+  float v[6];
+  int count = 0;
+  while (count < 6 && parseNumber(&p, &v[count]))
+    count++;
+  while (*p == ' ')
+    p++;
+  if (*p != '\0')
     return false;
+
+  switch (command) {
+  case 'F': return count == 1 && addForwardAction(v[0]);
+  case 'T': return count == 2 && addTurnAction(v[0], v[1]);
+  case 'R': return count == 1 && addRotateAction(v[0]);
+  case 'S': return count == 1 && v[0] >= 0 && addStopAction(v[0]);
+  case 'P': return count == 1 && addPenAction(v[0] != 0);
+  case 'M': return count == 2 && addMoveToAction(v[0], v[1]);
+  case 'H': return count == 1 && addRotateToAction(v[0]);
+  case 'A': return count == 2 && addArcToAction(v[0], v[1]);
+  case 'B': return count == 6 && addBezierAction(v[0], v[1], v[2], v[3], v[4], v[5]);
+  default: return false;
   }
-  return true;
 }
 
-bool Drawbotic_Navigation::penUp() {
-  DB1.setPen(false);
-  return true;
+/*!
+ * \brief Start queuing the actions of a program, usually kept in flash with PROGMEM, as DB-1 performs them. Only the next few actions are queued at a time, so a program of any length takes no extra memory and starts straight away
+ * 
+ * \param program The program, a byte array written with the NAV_PROG_ macros and finished with NAV_PROG_END. It must stay valid until the program finishes
+ * 
+ * \note Starting a program stops any program that is already running, the actions it has queued are still performed. A program stops early if it holds an instruction that isn't valid, or more than NAV_PROGRAM_DEPTH nested repeat blocks, see getProgramError()
+ */
+void Drawbotic_Navigation::runProgram(const uint8_t *program) {
+  m_program = program;
+  m_programNext = program;
+  m_programDepth = 0;
+  m_programError = -1;
 }
 
-bool Drawbotic_Navigation::penDown() {
-  DB1.setPen(true);
-  return true;
-}
\ No newline at end of file
+/*!
+ * \brief Stop queuing the actions of the program started with runProgram(). Actions already queued are still performed
+ */
+void Drawbotic_Navigation::stopProgram() {
+  m_programNext = NULL;
+}
+
+void Drawbotic_Navigation::serviceProgram() {
+  // Keep enough of the program queued for the speed planning to see the actions coming up, a limited number of instructions at a time
+  for (int budget = NAV_PROGRAM_BUDGET; budget > 0 && m_programNext && m_queueSize <= NAV_LOOKAHEAD; budget--) {
+    if (!programInstruction())
+      break;
+  }
+}
+
+bool Drawbotic_Navigation::programInstruction() {
+  const uint8_t *p = m_programNext;
+  uint8_t op = pgm_read_byte(p++);
+  bool queued = true;
+  bool valid = true;
+  m_outOfRange = false;
+  switch (op) {
+  case NAV_OP_END:
+    m_programNext = NULL;
+    return false;
+  case NAV_OP_FORWARD:
+    queued = addForwardAction(programTenths(p));
+    p += 2;
+    break;
+  case NAV_OP_TURN:
+    queued = addTurnAction(programTenths(p), programTenths(p + 2));
+    p += 4;
+    break;
+  case NAV_OP_ROTATE:
+    queued = addRotateAction(programTenths(p));
+    p += 2;
+    break;
+  case NAV_OP_STOP:
+    queued = addStopAction(pgm_read_byte(p) | (pgm_read_byte(p + 1) << 8));
+    p += 2;
+    break;
+  case NAV_OP_PEN_UP:
+  case NAV_OP_PEN_DOWN:
+    queued = addPenAction(op == NAV_OP_PEN_DOWN);
+    break;
+  case NAV_OP_ROTATE_TO:
+    queued = addRotateToAction(programTenths(p));
+    p += 2;
+    break;
+  case NAV_OP_MOVE_TO:
+  case NAV_OP_ARC_TO:
+    if (op == NAV_OP_MOVE_TO)
+      queued = addMoveToAction(programTenths(p), programTenths(p + 2));
+    else
+      queued = addArcToAction(programTenths(p), programTenths(p + 2));
+    p += 4;
+    break;
+  case NAV_OP_BEZIER:
+    queued = addBezierAction(programTenths(p), programTenths(p + 2), programTenths(p + 4),
+                             programTenths(p + 6), programTenths(p + 8), programTenths(p + 10));
+    p += 12;
+    break;
+  case NAV_OP_REPEAT: {
+    uint8_t count = pgm_read_byte(p++);
+    if (count == 0 || m_programDepth == NAV_PROGRAM_DEPTH)
+      valid = false;
+    else {
+      m_programRepeats[m_programDepth].start = p;
+      m_programRepeats[m_programDepth].remaining = count - 1;
+      m_programDepth++;
+    }
+    break;
+  }
+  case NAV_OP_LOOP:
+    if (m_programDepth == 0)
+      valid = false;
+    else if (m_programRepeats[m_programDepth - 1].remaining > 0) {
+      // go round the block again
+      m_programRepeats[m_programDepth - 1].remaining--;
+      p = m_programRepeats[m_programDepth - 1].start;
+    }
+    else
+      m_programDepth--;
+    break;
+  default:
+    valid = false;
+    break;
+  }
+
+  // an action whose values are out of range will never be queued, so it is treated like an instruction that isn't valid
+  if (m_outOfRange)
+    valid = false;
+  if (!valid) {
+    // the program can't be followed past an instruction that isn't valid
+    m_programError = m_programNext - m_program;
+    m_programNext = NULL;
+    return false;
+  }
+  // an action that can't be queued yet (for example because the curve points are all in use) is tried again on the next update
+  if (!queued)
+    return false;
+  m_programNext = p;
+  return true;
+}
+
+/*!
+ * \brief Start recording everything the navigation reads from DB1 and writes to it, along with the actions queued and the settings changed, so the run can be played back on a desktop machine with extras/simulator/nav_replay
+ * 
+ * \param out Where to write the recording, for example a file on an SD card. Each navigation step adds 14 bytes and each call to update() 9 more, so at the default update rate the output has to take over 20 KB a second
+ * \return true if recording started, false if actions are already queued or the steps are run from an interrupt
+ * 
+ * \note Start recording in setup(), before the first call to update() or setPose(), so the replay starts from the same state. The recording is binary, see NAV_RECORD_VERSION
+ */
+bool Drawbotic_Navigation::beginRecording(Print &out) {
+  if (m_queueSize > 0 || m_interruptDriven)
+    return false;
+
+  m_recorder = &out;
+  uint8_t header[4] = { 'N', 'R', NAV_RECORD_VERSION, (uint8_t)m_useIMU };
+  out.write(header, sizeof(header));
+  recordFloat(m_updateRate_ms);
+  out.write((uint8_t)NAV_LOOP_COUNT);
+  recordSettings();
+  out.write((uint8_t)NAV_REC_VELOCITY);
+  out.write((uint8_t)m_velocityControl);
+  return true;
+}
+
+/*!
+ * \brief Stop the recording started with beginRecording()
+ */
+void Drawbotic_Navigation::endRecording() {
+  if (m_recorder)
+    m_recorder->write((uint8_t)NAV_REC_END);
+  m_recorder = NULL;
+}
+
+void Drawbotic_Navigation::recordFloat(float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  uint8_t bytes[4] = { (uint8_t)bits, (uint8_t)(bits >> 8), (uint8_t)(bits >> 16), (uint8_t)(bits >> 24) };
+  m_recorder->write(bytes, sizeof(bytes));
+}
+
+void Drawbotic_Navigation::recordSettings() {
+  m_recorder->write((uint8_t)NAV_REC_SETTINGS);
+  recordFloat(m_speed);
+  recordFloat(m_rotateSpeed);
+  m_recorder->write((uint8_t)m_fixedTimestep);
+  m_recorder->write(m_maxCatchUp);
+  recordFloat(m_imuPeriod_ms);
+  for (int i = 0; i < NAV_LOOP_COUNT; i++) {
+    recordFloat(m_gains[i].feedforward);
+    recordFloat(m_gains[i].kp);
+    recordFloat(m_gains[i].ki);
+    recordFloat(m_gains[i].kd);
+    recordFloat(m_gains[i].integralLimit);
+    recordFloat(m_gains[i].outputLimit);
+  }
+  recordFloat(m_calibration.turnErrorLeft);
+  recordFloat(m_calibration.turnErrorRight);
+  recordFloat(m_calibration.rotateErrorLeft);
+  recordFloat(m_calibration.rotateErrorRight);
+  recordFloat(m_calibration.forwardError);
+  recordFloat(m_calibration.forwardKp);
+  recordFloat(m_calibration.rotateKp);
+  recordFloat(m_calibration.imuTolerance);
+  recordFloat(m_motorStage.deadband);
+  recordFloat(m_motorStage.slewRate);
+  recordFloat(m_motorStage.writeThreshold);
+  recordFloat(m_motorStage.refresh_ms);
+}
+
+void Drawbotic_Navigation::recordAction(NavigationType type, bool front, const float *values, int count) {
+  // the call is recorded rather than the action it queues, so a replay queues it again exactly as this build would
+  uint8_t record[5] = { NAV_REC_ACTION, (uint8_t)type, (uint8_t)front, (uint8_t)count, (uint8_t)(count >> 8) };
+  m_recorder->write(record, sizeof(record));
+  for (int i = 0; i < count; i++)
+    recordFloat(values[i]);
+}
+
+void Drawbotic_Navigation::recordStep(int encoderDelta1, int encoderDelta2) {
+  int16_t delta1 = (int16_t)constrain(encoderDelta1, -32768, 32767);
+  int16_t delta2 = (int16_t)constrain(encoderDelta2, -32768, 32767);
+  uint8_t record[5] = { NAV_REC_STEP, (uint8_t)delta1, (uint8_t)((uint16_t)delta1 >> 8), (uint8_t)delta2, (uint8_t)((uint16_t)delta2 >> 8) };
+  m_recorder->write(record, sizeof(record));
+  recordFloat(m_motorOutput[0]);
+  recordFloat(m_motorOutput[1]);
+  m_recorder->write(m_stepPen);
+}
+
+void Drawbotic_Navigation::recordHandle(NavigationHandle handle) {
+  // always 32 bits, so a recording reads the same whatever the queue capacity of the build that made it
+  uint32_t value = handle;
+  uint8_t bytes[4] = { (uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16), (uint8_t)(value >> 24) };
+  m_recorder->write(bytes, sizeof(bytes));
+}
+
+/*!
+ * \brief Perform a single navigation step of updateRate_ms. This is intended to be called from a timer interrupt that fires every updateRate_ms, see setInterruptDriven()
+ */
+void Drawbotic_Navigation::tick() {
+  step(m_updateRate_ms);
+}
+
+/*!
+ * \brief Choose how update() schedules navigation steps
+ * 
+ * \param enabled If true update() performs steps of exactly updateRate_ms, running extra steps to catch up if it was called late and keeping any left over time for the next call. If false (the default) update() performs a single step covering all of the time since the last step
+ * \param maxCatchUp (Default: 4) The maximum number of extra steps a single call to update() will perform to catch up. Steps beyond this are dropped and counted by getMissedTicks()
+ */
+void Drawbotic_Navigation::setFixedTimestep(bool enabled, uint8_t maxCatchUp) {
+  m_fixedTimestep = enabled;
+  m_maxCatchUp = maxCatchUp;
+  if (m_recorder)
+    recordSettings();
+}
+
+/*!
+ * \brief Choose whether navigation steps are run from a timer interrupt rather than from update()
+ * 
+ * \param enabled If true update() only samples the IMU and tick() must be called every updateRate_ms, typically from a hardware timer interrupt. The methods that change the queue then briefly disable interrupts so they can be safely used from the main loop, and optimize() does nothing
+ * 
+ * \note The DB1 encoder and motor functions are called from inside tick(), make sure the board's timer interrupt allows this. The IMU is only read from update(), sampleIMU() and setPose(), never from tick(). Enabling this takes a first IMU sample if none has been taken yet, so rotations always have a heading to start from.
+ */
+void Drawbotic_Navigation::setInterruptDriven(bool enabled) {
+  // steps run from an interrupt can't write to the recording, or read the IMU to plan the first rotation
+  if (enabled) {
+    endRecording();
+    if (m_useIMU && !m_imuValid)
+      sampleIMU();
+  }
+  m_interruptDriven = enabled;
+}
+
+/*!
+ * \brief Resets the late and missed step counters, the count of motor writes and the count of dropped events to zero
+ */
+void Drawbotic_Navigation::resetTickCounters() {
+  enterCritical();
+  m_lateTicks = 0;
+  m_missedTicks = 0;
+  m_motorWrites = 0;
+  m_droppedEvents = 0;
+  exitCritical();
+}
+
+void Drawbotic_Navigation::step(float stepTime_ms) {
+  m_stepTime_ms = stepTime_ms;
+#ifdef NAV_INSTRUMENTATION
+  unsigned long stepStart_us = micros();
+#endif
+  // read how far each wheel has moved since the last step and keep track of where the robot is
+  m_encoderDelta1 = DB1.getM1EncoderDelta();
+  m_encoderDelta2 = DB1.getM2EncoderDelta();
+  int encoderDelta1 = m_encoderDelta1;
+  int encoderDelta2 = m_encoderDelta2;
+  m_stepPen = 0;
+  updatePose();
+
+  if (m_queueHead != NO_ACTION) {
+    // unpack the action at the head of the queue into the current action state if it hasn't started yet
+    if (!m_currentActive) {
+      beginAction();
+      // an action resumed after being suspended was already reported as started
+      if (!(m_actionState[m_queueHead] & NAV_SLOT_STARTED)) {
+        m_actionState[m_queueHead] |= NAV_SLOT_STARTED;
+        if (m_onStart)
+          pushEvent(m_queueHead, false);
+      }
+    }
+
+    NavigationState *currentAction = &m_current;
+    // perform a step of the current action and check if the action has finished
+    bool finished = false;
+    switch (currentAction->type) {
+    case NAV_FORWARD:
+      finished = driveForward(currentAction);
+      break;
+    case NAV_TURN:
+        finished = turn(currentAction);
+      break;
+    case NAV_ROTATE:
+      if(m_useIMU)
+        finished = rotateIMU(currentAction);
+      else
+        finished = rotateEnc(currentAction);
+      break;
+    case NAV_MOVE_TO:
+      finished = moveTo(currentAction);
+      break;
+    case NAV_BEZIER:
+    case NAV_POLYLINE:
+      finished = followPath(currentAction);
+      break;
+    case NAV_STOP:
+      finished = stop(currentAction, stepTime_ms);
+      break;
+    case NAV_PEN_UP:
+      finished = penUp();
+      break;
+    case NAV_PEN_DOWN:
+      finished = penDown();
+      break;
+    default:
+      break;
+    }
+
+#ifdef NAV_INSTRUMENTATION
+    m_actionSteps++;
+    if (abs(currentAction->followCorrection) > m_actionPeakCorrection)
+      m_actionPeakCorrection = abs(currentAction->followCorrection);
+    if (finished)
+      recordActionStats();
+#endif
+
+    if (finished) {
+      // The next action starts at whatever speed this one was planned to finish at, and from wherever this one finished
+      m_entrySpeed = currentAction->exitSpeed;
+      carryResidual(currentAction);
+      if (m_onComplete || m_onQueueLow)
+        pushEvent(m_queueHead, true);
+
+      // Move to the next item in the queue
+      removeHeadAction();
+
+      // if the queue is empty, stop the robot
+      if (m_queueSize == 0) {
+        setMotorSpeeds(0, 0);
+        m_entrySpeed = 0;
+      }
+    }
+  }
+  writeMotors();
+  if (m_recorder)
+    recordStep(encoderDelta1, encoderDelta2);
+
+#ifdef NAV_INSTRUMENTATION
+  recordTraceSample();
+  recordStepTime(micros() - stepStart_us);
+#endif
+}
+
+/*!
+ * \brief Change the gains of one of the navigation control loops, for example after tuning them with the simulator in extras/simulator. See NavigationGains
+ * 
+ * \param loop The control loop to change
+ * \param gains The new gains, they take effect from the next navigation step
+ * 
+ * \note The heading loop's error is the degrees left to rotate times the rotation speed, so its gains are fractions of the rotation speed and don't need changing with setSpeed(). Once they are set here, setCalibration() no longer changes the heading loop's kp to its rotateKp
+ */
+void Drawbotic_Navigation::setGains(NavigationLoop loop, const NavigationGains &gains) {
+  if (loop >= 0 && loop < NAV_LOOP_COUNT) {
+    m_gains[loop] = gains;
+    // the calibration no longer sets the heading gain once it has been chosen here
+    if (loop == NAV_LOOP_HEADING)
+      m_headingGainsSet = true;
+    if (m_recorder)
+      recordSettings();
+  }
+}
+
+/*!
+ * \brief The gains of one of the navigation control loops
+ * 
+ * \param loop The control loop
+ * \return The gains that loop is currently using
+ */
+NavigationGains Drawbotic_Navigation::getGains(NavigationLoop loop) {
+  return m_gains[loop < NAV_LOOP_COUNT ? loop : NAV_LOOP_FORWARD];
+}
+
+/*!
+ * \brief Replace the calibration constants, for example with a profile made by extras/simulator/nav_autotune or one saved in EEPROM. See NavigationCalibration
+ * 
+ * \param calibration The new calibration, distances apply to actions queued afterwards and gains from the next navigation step
+ * \return true if the calibration was applied, false if any value was out of range (such as from EEPROM that was never written) and the current calibration was kept
+ * 
+ * \note rotateKp becomes the proportional gain of the heading loop, unless that loop's gains have been set with setGains(), which then take precedence
+ */
+bool Drawbotic_Navigation::setCalibration(const NavigationCalibration &calibration) {
+  // the multipliers are corrections of a few percent and the gains small fractions, so anything far outside that is
+  // garbage. The comparisons are written so that NaN fails them too
+  const float multipliers[5] = { calibration.turnErrorLeft, calibration.turnErrorRight, calibration.rotateErrorLeft,
+                                 calibration.rotateErrorRight, calibration.forwardError };
+  for (int i = 0; i < 5; i++) {
+    if (!(multipliers[i] > 0.5f && multipliers[i] < 2.0f))
+      return false;
+  }
+  if (!(calibration.forwardKp > 0 && calibration.forwardKp <= 1) || !(calibration.rotateKp > 0 && calibration.rotateKp <= 1) ||
+      !(calibration.imuTolerance > 0 && calibration.imuTolerance < 45))
+    return false;
+
+  enterCritical();
+  m_calibration = calibration;
+  if (!m_headingGainsSet)
+    m_gains[NAV_LOOP_HEADING].kp = calibration.rotateKp;
+  exitCritical();
+  if (m_recorder)
+    recordSettings();
+  return true;
+}
+
+/*!
+ * \brief The calibration built into the library, from the L_TURN_ERROR, R_TURN_ERROR, L_ROTATE_ERROR, R_ROTATE_ERROR, FORWARD_ERROR, FORWARD_KP, ROTATE_KP and IMU_TOLERANCE defines
+ * 
+ * \return The default calibration
+ */
+NavigationCalibration Drawbotic_Navigation::defaultCalibration() {
+  NavigationCalibration calibration;
+  calibration.turnErrorLeft = L_TURN_ERROR;
+  calibration.turnErrorRight = R_TURN_ERROR;
+  calibration.rotateErrorLeft = L_ROTATE_ERROR;
+  calibration.rotateErrorRight = R_ROTATE_ERROR;
+  calibration.forwardError = FORWARD_ERROR;
+  calibration.forwardKp = FORWARD_KP;
+  calibration.rotateKp = ROTATE_KP;
+  calibration.imuTolerance = IMU_TOLERANCE;
+  return calibration;
+}
+
+/*!
+ * \brief Configure the motor output stage. Every action's motor powers pass through it once per navigation step: the change in each power is limited to the slew rate, non-zero powers are lifted over the motor deadband, and a power is only written to DB1 when it has changed by more than the write threshold or hasn't been written for refresh_ms. See NavigationMotorOutput
+ * 
+ * \param output The new settings, used from the next navigation step
+ * \return true if the settings were applied, false if any value was out of range and the current settings were kept
+ * 
+ * \note With deadband compensation the slowest speed the actions ask for is lowered so that it still gives the power of SPEED_MIN. The refresh puts right any power written to DB1 by something other than the library
+ */
+bool Drawbotic_Navigation::setMotorOutput(const NavigationMotorOutput &output) {
+  if (!(output.deadband >= 0 && output.deadband < 0.5f) || !(output.slewRate >= 0) ||
+      !(output.writeThreshold >= 0 && output.writeThreshold < 0.1f) || !(output.refresh_ms >= 0))
+    return false;
+
+  enterCritical();
+  m_motorStage = output;
+  m_minSpeed = minimumSpeed();
+  exitCritical();
+  if (m_recorder)
+    recordSettings();
+  return true;
+}
+
+/*!
+ * \brief The motor output stage settings built into the library, from the MOTOR_DEADBAND, MOTOR_SLEW_RATE, MOTOR_THRESHOLD and MOTOR_REFRESH_MS defines
+ * 
+ * \return The default settings
+ */
+NavigationMotorOutput Drawbotic_Navigation::defaultMotorOutput() {
+  NavigationMotorOutput output;
+  output.deadband = MOTOR_DEADBAND;
+  output.slewRate = MOTOR_SLEW_RATE;
+  output.writeThreshold = MOTOR_THRESHOLD;
+  output.refresh_ms = MOTOR_REFRESH_MS;
+  return output;
+}
+
+/*!
+ * \brief Change how often update() samples the IMU. Between samples the heading is carried forward using the wheel encoders
+ * 
+ * \param period_ms The time between IMU samples in milliseconds, 0 samples on every call to update()
+ */
+void Drawbotic_Navigation::setIMUPeriod(float period_ms) {
+  m_imuPeriod_ms = period_ms;
+  if (m_recorder)
+    recordSettings();
+}
+
+/*!
+ * \brief Read the IMU now and cache its heading. update() calls this every IMU period, it only needs to be called directly when the IMU is sampled on a different schedule
+ */
+void Drawbotic_Navigation::sampleIMU() {
+  float heading = DB1.getOrientation().heading;
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_IMU);
+    recordFloat(heading);
+  }
+  storeIMUSample(heading);
+}
+
+/*!
+ * \brief Provide an IMU heading that was read elsewhere, for example by a driver that reads the IMU asynchronously or from its data ready interrupt
+ * 
+ * \param heading_deg The IMU heading in degrees, as returned by DB1.getOrientation()
+ */
+void Drawbotic_Navigation::setIMUHeading(float heading_deg) {
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_HEADING);
+    recordFloat(heading_deg);
+  }
+  storeIMUSample(heading_deg);
+}
+
+void Drawbotic_Navigation::storeIMUSample(float heading_deg) {
+  // the sample and the turn since it must change together in case a step runs from an interrupt in between
+  enterCritical();
+  // A rotation's overshoot is measured from the heading the encoders carried forward, which part counted signals
+  // leave slightly out, so put it right by however far the new sample says that heading was out
+  if (m_useIMU && m_imuValid && m_headingValid)
+    m_rotateCarry += wrapAngle(heading_deg - m_imuSample - m_imuExtrapolation);
+  m_imuSample = heading_deg;
+  m_imuExtrapolation = 0;
+  m_imuSampleTime_ms = millis();
+  m_imuValid = true;
+  m_imuFresh = true;
+  exitCritical();
+}
+
+/*!
+ * \brief The IMU heading used by the navigation, the last sample carried forward by the turn measured by the wheel encoders since it was taken
+ * \return The heading in degrees, from 0 to 360
+ */
+float Drawbotic_Navigation::getIMUHeading() {
+  enterCritical();
+  float heading = imuHeading();
+  exitCritical();
+  return heading;
+}
+
+/*!
+ * \brief Check whether the IMU heading is being worked out from the encoders alone, because no sample has arrived for IMU_STALE_MS
+ * \return true if the last IMU sample is too old to rely on, or no sample has been taken
+ * 
+ * \note This is advisory, the navigation carries on regardless. While the IMU is stale the heading is carried forward by the encoders alone, so IMU rotations are in effect encoder rotations until samples arrive again.
+ */
+bool Drawbotic_Navigation::isIMUStale() {
+  enterCritical();
+  bool stale = !m_imuValid || millis() - m_imuSampleTime_ms > IMU_STALE_MS;
+  exitCritical();
+  return stale;
+}
+
+/*!
+ * \brief Sets the maximum speed that DB-1 will use during navigation movements
+ * 
+ * \param speed A vaule between 0.0-1.0 where 0.0 is no power and 1.0 is full power
+ * \param rotateSpeed (Default: 0) The maximum speed of rotations on the same scale, 0 uses speed
+ */
+void Drawbotic_Navigation::setSpeed(float speed, float rotateSpeed) {
+  if (speed > 0 && speed < 1) {
+    m_speed = speed;
+    m_rotateSpeed = rotateSpeed > 0 && rotateSpeed < 1 ? rotateSpeed : speed;
+    if (m_recorder)
+      recordSettings();
+  }
+}
+
+/*!
+ * \brief Sets the maximum speeds that DB-1 will use during navigation movements in real units. This also enables velocity control, so the speeds are held regardless of the battery level or the surface, see setVelocityControl()
+ * 
+ * \param speed_mm_s The maximum speed of forward actions, turns and curves in millimetres per second
+ * \param rotation_deg_s The maximum speed of rotations in degrees per second
+ */
+void Drawbotic_Navigation::setVelocity(float speed_mm_s, float rotation_deg_s) {
+  float speed = speed_mm_s / WHEEL_SPEED;
+  float rotateSpeed = rotation_deg_s * (M_PI / 180.0f) * BOT_RADIUS / WHEEL_SPEED;
+  if (speed > 0 && speed < 1)
+    m_speed = speed;
+  if (rotateSpeed > 0 && rotateSpeed < 1)
+    m_rotateSpeed = rotateSpeed;
+  if (m_recorder)
+    recordSettings();
+  setVelocityControl(true);
+}
+
+/*!
+ * \brief Choose whether the motors are driven at the power the actions ask for, or at the wheel speeds they ask for
+ * 
+ * \param enabled If true each wheel has its own velocity loop, measuring its speed from the encoders and adjusting the motor power to hold the requested fraction of WHEEL_SPEED. If false (the default) the requested power is written to the motors directly
+ */
+void Drawbotic_Navigation::setVelocityControl(bool enabled) {
+  if (m_recorder) {
+    m_recorder->write((uint8_t)NAV_REC_VELOCITY);
+    m_recorder->write((uint8_t)enabled);
+  }
+  enterCritical();
+  m_velocityControl = enabled;
+  m_minSpeed = minimumSpeed();
+  for (int i = 0; i < 2; i++) {
+    m_wheelControl[i].integral = 0;
+    m_wheelControl[i].rate = 0;
+    m_wheelControl[i].primed = false;
+    m_wheelRate[i] = 0;
+  }
+  exitCritical();
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::makeForwardAction(float distance_mm) {
+  // calculating how many encoder signals are equivalent to the input travel distance
+  float ticks = distance_mm * ENC_BITS_P_MM * m_calibration.forwardError;
+  if (!(abs(ticks) < 2147483648.0f)) {
+    m_outOfRange = true;
+    return NO_ACTION;
+  }
+  NavigationIndex newAction = allocateAction(NAV_FORWARD);
+  if (newAction == NO_ACTION)
+    return NO_ACTION;
+  m_actionPool[newAction].params.ticks = roundToInt(ticks);
+
+  return newAction;
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::makeTurnAction(float radius_mm, float angle_deg) {
+  uint16_t ticks;
+  int16_t ratio;
+  if (!turnParameters(radius_mm, angle_deg, &ticks, &ratio)) {
+    m_outOfRange = true;
+    return NO_ACTION;
+  }
+  NavigationIndex newAction = allocateAction(NAV_TURN);
+  if (newAction == NO_ACTION)
+    return NO_ACTION;
+
+  NavigationAction *a = &m_actionPool[newAction];
+  a->params.turn.ticks = ticks;
+  a->params.turn.ratio = ratio;
+  a->flags = angle_deg < 0 ? NAV_CLOCKWISE : 0;
+
+  return newAction;
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::makeRotateAction(float angle_deg) {
+  if (!fitsTenths(angle_deg)) {
+    m_outOfRange = true;
+    return NO_ACTION;
+  }
+  NavigationIndex newAction = allocateAction(NAV_ROTATE);
+  if (newAction == NO_ACTION)
+    return NO_ACTION;
+
+  // the angle is kept for IMU rotations, encoder rotations only need the number of signals
+  NavigationAction *a = &m_actionPool[newAction];
+  a->params.rotate.ticks = rotationTicks(angle_deg);
+  a->params.rotate.angle = toTenths(angle_deg);
+  a->flags = angle_deg < 0 ? NAV_CLOCKWISE : 0;
+
+  return newAction;
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::makeStopAction(float time_ms) {
+  if (!(time_ms < 4294967296.0f)) {
+    m_outOfRange = true;
+    return NO_ACTION;
+  }
+  NavigationIndex newAction = allocateAction(NAV_STOP);
+  if (newAction == NO_ACTION)
+    return NO_ACTION;
+  m_actionPool[newAction].params.time = time_ms > 0 ? (uint32_t)(time_ms + 0.5f) : 0;
+
+  return newAction;
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::makePenAction(bool down) {
+  return allocateAction(down ? NAV_PEN_DOWN : NAV_PEN_UP);
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::makePathAction(NavigationType type, const float *points_mm, int count) {
+  if (count <= 0 || count > NAV_PATH_POINTS)
+    return NO_ACTION;
+  for (int i = 0; i < count * 2; i++) {
+    if (!fitsTenths(points_mm[i])) {
+      m_outOfRange = true;
+      return NO_ACTION;
+    }
+  }
+
+  // Take enough chunks for every point from the front of the free list, or none at all if there aren't enough
+  int chunks = (count + NAV_PATH_CHUNK - 1) / NAV_PATH_CHUNK;
+  enterCritical();
+  NavigationChunkIndex first = m_pathFreeList;
+  NavigationChunkIndex last = first;
+  for (int i = 1; i < chunks && last != NO_CHUNK; i++) {
+    last = m_pathPool[last].next;
+  }
+  if (last == NO_CHUNK) {
+    exitCritical();
+    return NO_ACTION;
+  }
+  m_pathFreeList = m_pathPool[last].next;
+  m_pathPool[last].next = NO_CHUNK;
+  exitCritical();
+
+  NavigationIndex newAction = allocateAction(type);
+  if (newAction == NO_ACTION) {
+    enterCritical();
+    releasePathChunks(first);
+    exitCritical();
+    return NO_ACTION;
+  }
+  NavigationAction *a = &m_actionPool[newAction];
+  a->params.path.chunk = first;
+  a->params.path.first = 0;
+  a->params.path.count = count;
+  for (int i = 0; i < count; i++) {
+    setPathPoint(newAction, i, points_mm[i * 2], points_mm[i * 2 + 1]);
+  }
+
+  return newAction;
+}
+
+void Drawbotic_Navigation::releasePathChunks(NavigationChunkIndex chunk) {
+  // Push each chunk of a curve back onto the free list
+  while (chunk != NO_CHUNK) {
+    NavigationChunkIndex next = m_pathPool[chunk].next;
+    m_pathPool[chunk].next = m_pathFreeList;
+    m_pathFreeList = chunk;
+    chunk = next;
+  }
+}
+
+bool Drawbotic_Navigation::pathPoint(NavigationIndex action, uint16_t index, float *x, float *y) {
+  const NavigationAction *a = &m_actionPool[action];
+  if (index >= a->params.path.count)
+    return false;
+
+  // Follow the chunks along to the one holding the point
+  index += a->params.path.first;
+  NavigationChunkIndex chunk = a->params.path.chunk;
+  while (index >= NAV_PATH_CHUNK) {
+    chunk = m_pathPool[chunk].next;
+    index -= NAV_PATH_CHUNK;
+  }
+  *x = m_pathPool[chunk].x[index] / 10.0f;
+  *y = m_pathPool[chunk].y[index] / 10.0f;
+  return true;
+}
+
+void Drawbotic_Navigation::setPathPoint(NavigationIndex action, uint16_t index, float x, float y) {
+  const NavigationAction *a = &m_actionPool[action];
+  index += a->params.path.first;
+  NavigationChunkIndex chunk = a->params.path.chunk;
+  while (index >= NAV_PATH_CHUNK) {
+    chunk = m_pathPool[chunk].next;
+    index -= NAV_PATH_CHUNK;
+  }
+  m_pathPool[chunk].x[index] = toTenths(x);
+  m_pathPool[chunk].y[index] = toTenths(y);
+}
+
+void Drawbotic_Navigation::dropPathPoints(NavigationIndex action, uint16_t count) {
+  NavigationAction *a = &m_actionPool[action];
+  if (count >= a->params.path.count)
+    count = a->params.path.count - 1;
+
+  // Forget the first points of a curve, returning any chunks that are no longer used
+  a->params.path.count -= count;
+  uint16_t first = a->params.path.first + count;
+  while (first >= NAV_PATH_CHUNK) {
+    NavigationChunkIndex chunk = a->params.path.chunk;
+    a->params.path.chunk = m_pathPool[chunk].next;
+    m_pathPool[chunk].next = m_pathFreeList;
+    m_pathFreeList = chunk;
+    first -= NAV_PATH_CHUNK;
+  }
+  a->params.path.first = first;
+}
+
+void Drawbotic_Navigation::setupRotationAction(NavigationState* action) {
+  // a rotation can't be planned without knowing where the IMU is pointing. The IMU isn't read from inside the timer
+  // interrupt, setInterruptDriven() took a sample before it was enabled
+  if (!m_imuValid && !m_interruptDriven)
+    sampleIMU();
+
+  // the IMU target heading is kept in hundredths of a degree so the control step can use integer maths
+  int32_t currentAngle = roundToInt(imuHeading() * 100.0f);
+  action->finalAngle = currentAngle + roundToInt(action->desiredAngle * 100.0f);
+  while (action->finalAngle >= 36000) {
+    action->finalAngle -= 36000;
+  }
+  while (action->finalAngle < 0) {
+    action->finalAngle += 36000;
+  }
+}
+
+void Drawbotic_Navigation::setupRelativeRotation(float angle_deg) {
+  m_current.type = NAV_ROTATE;
+  m_current.desiredAngle = angle_deg;
+  m_current.target = rotationTicks(angle_deg);
+  m_current.flags = angle_deg < 0 ? NAV_CLOCKWISE : 0;
+  if(m_useIMU)
+    setupRotationAction(&m_current);
+}
+
+// Number of encoder signals each wheel travels to rotate on the spot by an angle
+uint16_t Drawbotic_Navigation::rotationTicks(float angle_deg) {
+  float ticks = (abs(angle_deg) * M_PI * ENC_BITS_P_MM * BOT_RADIUS *
+                 (angle_deg >= 0 ? m_calibration.rotateErrorLeft : m_calibration.rotateErrorRight)) / 180;
+  return ticks < 65535.0f ? (uint16_t)(ticks + 0.5f) : 65535;
+}
+
+// Returns false if the outside wheel travels further than the 65535 encoder signals a turn can hold, the ticks are clamped
+bool Drawbotic_Navigation::turnParameters(float radius_mm, float angle_deg, uint16_t *ticks, int16_t *ratio) {
+  // the outside wheel leads, the inside wheel follows at a fixed ratio of its speed
+  float outside = radius_mm + BOT_RADIUS;
+  float inside = radius_mm - BOT_RADIUS;
+  float t = (abs(angle_deg) * M_PI * ENC_BITS_P_MM * outside * (angle_deg >= 0 ? m_calibration.turnErrorLeft : m_calibration.turnErrorRight)) / 180;
+  float r = outside > 0 ? inside / outside : 0;
+
+  *ticks = t > 0 ? (t < 65535.0f ? (uint16_t)(t + 0.5f) : 65535) : 0;
+  *ratio = (int16_t)constrain(roundToInt(r * RATIO_ONE), -32767, 32767);
+  return t < 65535.5f;
+}
+
+void Drawbotic_Navigation::setupTurn(uint16_t ticks, int16_t ratio, uint8_t flags) {
+  m_current.type = NAV_TURN;
+  m_current.flags = flags;
+  m_current.target = ticks;
+  m_current.ratio = ratio;
+  m_current.multiplier = (float)ratio / RATIO_ONE;
+}
+
+void Drawbotic_Navigation::setupArc(float x_mm, float y_mm) {
+  // The target relative to DB-1, ahead along its heading and off to its left
+  float dx = x_mm - m_pose.x;
+  float dy = y_mm - m_pose.y;
+  float ahead = dx * m_headingCos + dy * m_headingSin;
+  float left = dy * m_headingCos - dx * m_headingSin;
+
+  if (abs(left) < 0.05f) {
+    // straight ahead, there is no arc to follow
+    m_current.type = NAV_FORWARD;
+    m_current.target = ahead > 0 ? roundToInt(ahead * ENC_BITS_P_MM * m_calibration.forwardError) : 0;
+    return;
+  }
+
+  // The circle that touches the current heading and passes through the target, the arc turns twice the angle to the target
+  float radius = (ahead * ahead + left * left) / (2 * abs(left));
+  float angle = 2 * atan2(left, ahead) * 180.0f / M_PI;
+  uint16_t ticks;
+  int16_t ratio;
+  // a target too far away to reach in one turn is clamped, there is nothing to reject once the action has started
+  turnParameters(radius, angle, &ticks, &ratio);
+  setupTurn(ticks, ratio, angle < 0 ? NAV_CLOCKWISE : 0);
+}
+
+void Drawbotic_Navigation::beginPath() {
+  NavigationState *action = &m_current;
+  float x = m_pose.x;
+  float y = m_pose.y;
+  float dx = 0;
+  float dy = 0;
+
+  // The curve starts from wherever DB-1 is now
+  action->pathX[0] = m_pose.x;
+  action->pathY[0] = m_pose.y;
+  action->pathT = 0;
+  action->pathIndex = 0;
+  action->pathCorner = false;
+  if (action->type == NAV_BEZIER) {
+    for (int i = 1; i < 4; i++) {
+      pathPoint(m_queueHead, i - 1, &action->pathX[i], &action->pathY[i]);
+      // the curve leaves in the direction of the first control point that isn't on top of the start
+      if (dx == 0 && dy == 0 && (abs(action->pathX[i] - x) >= 0.05f || abs(action->pathY[i] - y) >= 0.05f)) {
+        dx = action->pathX[i] - x;
+        dy = action->pathY[i] - y;
+      }
+    }
+  }
+  else {
+    pathPoint(m_queueHead, 0, &action->pathX[1], &action->pathY[1]);
+    dx = action->pathX[1] - x;
+    dy = action->pathY[1] - y;
+    action->segmentLength = sqrt(dx * dx + dy * dy);
+  }
+
+  // Face along the curve before steering along it
+  NavigationType type = action->type;
+  setupRelativeRotation(dx != 0 || dy != 0 ? wrapAngle(atan2(dy, dx) * 180.0f / M_PI - m_pose.heading) : 0);
+  action->type = type;
+  action->phase = 0;
+}
+
+void Drawbotic_Navigation::beginAction() {
+  NavigationAction *action = &m_actionPool[m_queueHead];
+
+  // Expand the compact parameters of the head action into the runtime state
+  m_current.type = (NavigationType)action->type;
+  m_current.flags = action->flags;
+  m_current.progress = 0;
+  m_current.target = 0;
+  m_current.ratio = RATIO_ONE;
+  m_current.multiplier = 1;
+  float speed = actionSpeed(m_queueHead, m_speed);
+  m_current.accelSlope = speed * ACCEL_KP;
+  m_current.decelSlope = speed * m_calibration.forwardKp;
+  resetControllers(&m_current);
+  m_current.desiredAngle = 0;
+  m_current.desiredTime = 0;
+  m_current.elapsedTime = 0;
+
+  // Whatever the previous action went past its target by counts towards this one if it carries on the same movement
+  int32_t carry = m_carry;
+  bool credited = carry == 0;
+  m_carry = 0;
+
+  // Only forward, stop and pen actions leave the heading alone. A rotation takes off the overshoot of the last rotation,
+  // anything else turns DB-1 by an amount that isn't known up front, so the overshoot can no longer be put right
+  bool keepsHeading = action->type == NAV_FORWARD || action->type == NAV_STOP || action->type == NAV_PEN_UP || action->type == NAV_PEN_DOWN;
+  if (!keepsHeading) {
+    if (action->type != NAV_ROTATE && m_rotateCarry != 0) {
+      m_encoderResidual += rotationTicks(m_rotateCarry) * (m_rotateCarry > 0 ? 1 : -1);
+      m_rotateCarry = 0;
+    }
+    m_headingValid = false;
+  }
+
+  switch (action->type) {
+  case NAV_FORWARD:
+    m_current.target = action->params.ticks;
+    if (m_carryType == NAV_FORWARD) {
+      m_current.progress = carry;
+      credited = true;
+    }
+    break;
+  case NAV_TURN:
+    setupTurn(action->params.turn.ticks, action->params.turn.ratio, action->flags);
+    if (m_carryType == NAV_TURN && m_carryFlags == action->flags && m_carryRatio == action->params.turn.ratio) {
+      m_current.progress = carry;
+      credited = true;
+    }
+    break;
+  case NAV_ROTATE:
+    m_current.target = action->params.rotate.ticks;
+    m_current.desiredAngle = action->params.rotate.angle / 10.0f;
+    if (m_rotateCarry != 0) {
+      // take off whatever the last rotation went too far by, the rotation is then worked out again from the new angle
+      setupRelativeRotation(m_current.desiredAngle - m_rotateCarry);
+      m_rotateCarry = 0;
+    }
+    else if(m_useIMU)
+      setupRotationAction(&m_current);
+    break;
+  case NAV_ROTATE_TO:
+    // An absolute heading becomes a relative rotation from wherever the robot is facing now
+    setupRelativeRotation(wrapAngle(action->params.rotate.angle / 10.0f - m_pose.heading));
+    break;
+  case NAV_MOVE_TO: {
+    // Face the target first, the distance to drive is worked out once the rotation is complete
+    float dx = action->params.point.x / 10.0f - m_pose.x;
+    float dy = action->params.point.y / 10.0f - m_pose.y;
+    float angle = 0;
+    if (dx != 0 || dy != 0)
+      angle = wrapAngle(atan2(dy, dx) * 180.0f / M_PI - m_pose.heading);
+    setupRelativeRotation(angle);
+    m_current.type = NAV_MOVE_TO;
+    m_current.phase = 0;
+    break;
+  }
+  case NAV_ARC_TO:
+    setupArc(action->params.point.x / 10.0f, action->params.point.y / 10.0f);
+    break;
+  case NAV_BEZIER:
+  case NAV_POLYLINE:
+    beginPath();
+    break;
+  case NAV_STOP:
+    m_current.desiredTime = action->params.time;
+    break;
+  default:
+    break;
+  }
+
+  if (!credited)
+    m_encoderResidual += carry;
+
+  // Plan the speed profile of the action from the speed it's entering at and the actions that follow it
+  m_current.entrySpeed = m_entrySpeed;
+  m_current.exitSpeed = planExitSpeed();
+  m_currentActive = true;
+
+#ifdef NAV_INSTRUMENTATION
+  m_actionStart_ms = millis();
+  m_actionSteps = 0;
+  m_actionPeakCorrection = 0;
+#endif
+}
+
+void Drawbotic_Navigation::carryResidual(NavigationState *action) {
+  m_carryType = action->type;
+  switch (action->type) {
+  case NAV_FORWARD:
+  case NAV_TURN:
+    // only the next action can use a forward or turn overshoot, and only if it carries on in the same way. An action
+    // with nothing to cover, such as a negative distance, finishes without moving and has no overshoot to pass on
+    if (action->target > 0)
+      m_carry = action->progress - action->target;
+    else {
+      m_encoderResidual += action->progress;
+      m_carry = 0;
+    }
+    m_carryFlags = action->flags;
+    m_carryRatio = action->ratio;
+    break;
+  case NAV_ROTATE:
+    // a rotation's overshoot is kept until the next rotation, with anything DB-1 turns in the meantime added on by updatePose()
+    if (m_useIMU)
+      m_rotateCarry = wrapAngle(imuHeading() - action->finalAngle / 100.0f);
+    else if (action->target > 0) {
+      float over = (float)(action->progress - action->target) * abs(action->desiredAngle) / action->target;
+      m_rotateCarry = (action->flags & NAV_CLOCKWISE) ? -over : over;
+    }
+    m_headingValid = true;
+    break;
+  default:
+    break;
+  }
+}
+
+void Drawbotic_Navigation::updatePose() {
+  // millimetres per encoder signal, and radians of heading per signal of difference between the wheels
+  const float mmPerTick = 1.0f / (ENC_BITS_P_MM * m_calibration.forwardError);
+  const float radPerTick = mmPerTick / (2 * BOT_RADIUS);
+
+  // Motor 1 drives the right wheel and motor 2 the left
+  int32_t sum = m_encoderDelta1 + m_encoderDelta2;
+  int32_t difference = m_encoderDelta1 - m_encoderDelta2;
+  float turn_rad = difference * radPerTick;
+
+  if (sum != 0) {
+    // Integrate along the average heading over the step, using the cached heading direction rather than trig functions
+    float distance = sum * (mmPerTick / 2);
+    float halfTurn = turn_rad / 2;
+    m_pose.x += distance * (m_headingCos - m_headingSin * halfTurn);
+    m_pose.y += distance * (m_headingSin + m_headingCos * halfTurn);
+  }
+  if (difference != 0)
+    turnPoseHeading(turn_rad);
+
+  // Carry the IMU heading forward from its last sample until the next one arrives by the turn measured by the encoders.
+  // The signals read just after a sample was taken were mostly counted before it, so they are already part of it
+  // Any turn between one rotation finishing and the next starting is put right by the next rotation, which follows the
+  // IMU heading when there is one
+  bool sampled = m_useIMU && m_imuFresh;
+  if (m_headingValid && !sampled)
+    m_rotateCarry += turn_rad * (180.0f / M_PI);
+
+  if (!m_imuFresh)
+    m_imuExtrapolation += turn_rad * (180.0f / M_PI);
+
+  if (m_useIMU && m_imuFresh) {
+    m_imuFresh = false;
+    if (!m_imuOffsetValid) {
+      // The first reading lines the IMU up with the pose
+      m_imuOffset = wrapAngle(imuHeading() - m_pose.heading);
+      m_imuOffsetValid = true;
+    }
+    else {
+      // Pull the encoder heading towards the IMU heading to stop the heading drifting over long queues. Both have
+      // moved on by the same encoder turn since the sample, so comparing them now is the same as at the sample
+      float correction = IMU_FUSION * wrapAngle(imuHeading() - m_imuOffset - m_pose.heading);
+      turnPoseHeading(correction * M_PI / 180.0f);
+    }
+  }
+}
+
+float Drawbotic_Navigation::filterWeight(float weight) {
+  // the filter weights are for steps of the update rate, a longer step (such as one covering a sleep) is worth more of them
+  if (m_stepTime_ms <= m_updateRate_ms)
+    return weight;
+  weight *= m_stepTime_ms / m_updateRate_ms;
+  return weight < 1 ? weight : 1;
+}
+
+void Drawbotic_Navigation::turnPoseHeading(float angle_rad) {
+  // Rotate the cached heading direction by a small angle, renormalising it so rounding errors don't build up
+  float c = m_headingCos - m_headingSin * angle_rad;
+  float s = m_headingSin + m_headingCos * angle_rad;
+  float scale = 1.5f - 0.5f * (c * c + s * s);
+  m_headingCos = c * scale;
+  m_headingSin = s * scale;
+  m_pose.heading = wrapAngle(m_pose.heading + angle_rad * 180.0f / M_PI);
+}
+
+bool Drawbotic_Navigation::wheelRatios(NavigationIndex action, float *right, float *left) {
+  const NavigationAction *a = &m_actionPool[action];
+
+  // Relative speed of each wheel while the action is performed, scaled so the faster wheel is 1
+  switch (a->type) {
+  case NAV_FORWARD:
+    *right = 1;
+    *left = 1;
+    return a->params.ticks > 0;
+  case NAV_TURN: {
+    float multiplier = (float)a->params.turn.ratio / RATIO_ONE;
+    *right = (a->flags & NAV_CLOCKWISE) ? multiplier : 1;
+    *left = (a->flags & NAV_CLOCKWISE) ? 1 : multiplier;
+    return a->params.turn.ticks != 0;
+  }
+  default:
+    // Rotating, stopping and pen movements all happen with the robot at rest
+    return false;
+  }
+}
+
+float Drawbotic_Navigation::actionLength(NavigationIndex action) {
+  const NavigationAction *a = &m_actionPool[action];
+
+  // Distance travelled by the leading wheel, in encoder signals
+  switch (a->type) {
+  case NAV_FORWARD:
+    return abs(a->params.ticks);
+  case NAV_TURN:
+    return a->params.turn.ticks;
+  default:
+    return 0;
+  }
+}
+
+float Drawbotic_Navigation::junctionSpeed(NavigationIndex from, NavigationIndex to) {
+  float r1, l1, r2, l2;
+  if (!wheelRatios(from, &r1, &l1) || !wheelRatios(to, &r2, &l2))
+    return 0;
+
+  // Neither action can be performed faster than its own speed
+  float speed = actionSpeed(from, m_speed);
+  if (actionSpeed(to, m_speed) < speed)
+    speed = actionSpeed(to, m_speed);
+
+  // Limit the speed so that neither wheel has to change power by more than JUNCTION_DELTA across the junction
+  float change = abs(r1 - r2);
+  if (abs(l1 - l2) > change)
+    change = abs(l1 - l2);
+  if (change * speed <= JUNCTION_DELTA)
+    return speed;
+  return JUNCTION_DELTA / change;
+}
+
+float Drawbotic_Navigation::planExitSpeed() {
+  float limits[NAV_LOOKAHEAD];
+  float reach[NAV_LOOKAHEAD];     // speed each action can lose over its length
+  int count = 0;
+
+  // Rotations always finish at rest
+  if (m_current.type == NAV_ROTATE)
+    return 0;
+
+  // Collect the junction limits and lengths of the actions that follow
+  NavigationIndex from = m_queueHead;
+  NavigationIndex to = m_actionPool[from].next;
+  while (to != NO_ACTION && count < NAV_LOOKAHEAD) {
+    limits[count] = junctionSpeed(from, to);
+    reach[count] = actionSpeed(to, m_speed) * m_calibration.forwardKp * actionLength(to);
+    count++;
+    if (limits[count - 1] == 0)
+      break;
+    from = to;
+    to = m_actionPool[to].next;
+  }
+
+  // Work backwards from a stop at the end of the lookahead window, each action can only enter as fast as it is able to slow down
+  float exitSpeed = 0;
+  for (int i = count - 1; i >= 0; i--) {
+    float entrySpeed = exitSpeed + reach[i];
+    exitSpeed = entrySpeed < limits[i] ? entrySpeed : limits[i];
+  }
+  return exitSpeed;
+}
+
+float Drawbotic_Navigation::profileSpeed(NavigationState *action) {
+  // Trapezoidal profile, accelerate from the entry speed and decelerate to the exit speed
+  float accel = action->entrySpeed + action->accelSlope * action->progress;
+  float decel = action->exitSpeed + action->decelSlope * (action->target - action->progress);
+  float power = accel < decel ? accel : decel;
+  return constrain(power, m_minSpeed, actionSpeed(m_queueHead, m_speed));
+}
+
+void Drawbotic_Navigation::suspendAction() {
+  NavigationAction *action = &m_actionPool[m_queueHead];
+  int32_t remaining = m_current.target - m_current.progress;
+  if (remaining < 0)
+    remaining = 0;
+
+  // Write whatever is left of the current action back into its queue slot so it resumes correctly later.
+  // Actions with absolute targets are simply started again
+  switch (action->type) {
+  case NAV_FORWARD:
+    action->params.ticks = remaining;
+    break;
+  case NAV_TURN:
+    action->params.turn.ticks = remaining;
+    break;
+  case NAV_ROTATE: {
+    float angle = m_current.target > 0 ? m_current.desiredAngle * remaining / m_current.target : 0;
+    if (m_useIMU) {
+      float error = imuHeading() - m_current.finalAngle / 100.0f;
+      angle = -wrapAngle(error);
+    }
+    action->params.rotate.angle = toTenths(angle);
+    action->params.rotate.ticks = rotationTicks(angle);
+    action->flags = angle < 0 ? NAV_CLOCKWISE : 0;
+    break;
+  }
+  case NAV_STOP:
+    action->params.time = m_current.elapsedTime < m_current.desiredTime ? (uint32_t)(m_current.desiredTime - m_current.elapsedTime) : 0;
+    break;
+  case NAV_BEZIER: {
+    // Keep the part of the curve after the steering point, it restarts from wherever DB-1 is when it resumes
+    float t = m_current.pathT;
+    if (t > 0) {
+      const float *x = m_current.pathX;
+      const float *y = m_current.pathY;
+      float x12 = x[1] + (x[2] - x[1]) * t;
+      float y12 = y[1] + (y[2] - y[1]) * t;
+      float x23 = x[2] + (x[3] - x[2]) * t;
+      float y23 = y[2] + (y[3] - y[2]) * t;
+      setPathPoint(m_queueHead, 0, x12 + (x23 - x12) * t, y12 + (y23 - y12) * t);
+      setPathPoint(m_queueHead, 1, x23, y23);
+    }
+    break;
+  }
+  case NAV_POLYLINE:
+    // The points already passed are no longer needed
+    dropPathPoints(m_queueHead, m_current.pathIndex);
+    break;
+  default:
+    break;
+  }
+  m_currentActive = false;
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::allocateAction(NavigationType type) {
+  // Take the first free slot from the pool, if there isn't one the queue is full
+  enterCritical();
+  NavigationIndex action = m_freeList;
+  if (action != NO_ACTION)
+    m_freeList = m_actionPool[action].next;
+  exitCritical();
+  if (action == NO_ACTION)
+    return NO_ACTION;
+
+  m_actionPool[action].type = type;
+  m_actionPool[action].flags = 0;
+  m_actionPool[action].prev = NO_ACTION;
+  m_actionPool[action].next = NO_ACTION;
+  m_actionSpeed[action] = 0;
+  return action;
+}
+
+void Drawbotic_Navigation::releaseAction(NavigationIndex action) {
+  // Curves give back their points as well
+  uint8_t type = m_actionPool[action].type;
+  if (type == NAV_BEZIER || type == NAV_POLYLINE) {
+    releasePathChunks(m_actionPool[action].params.path.chunk);
+    m_actionPool[action].type = NAV_STOP;
+  }
+
+  // Handles to the action stop matching, the generation is never 0 so no handle is ever NAV_NO_HANDLE
+  if (++m_actionGeneration[action] == 0)
+    m_actionGeneration[action] = 1;
+  m_actionState[action] = 0;
+
+  // Push the slot back onto the free list so it can be reused by the next allocation
+  m_actionPool[action].prev = NO_ACTION;
+  m_actionPool[action].next = m_freeList;
+  m_freeList = action;
+}
+
+NavigationHandle Drawbotic_Navigation::enqueueAction(NavigationIndex action, bool front) {
+  if (action == NO_ACTION)
+    return NAV_NO_HANDLE;
+
+  enterCritical();
+  if (front)
+    addActionFront(action);
+  else {
+    addActionBack(action);
+    // the action being performed may have been planned to stop at the end of the queue, and can now carry on into this one
+    if (m_currentActive)
+      m_current.exitSpeed = planExitSpeed();
+  }
+  NavigationHandle handle = actionHandle(action);
+  exitCritical();
+  return handle;
+}
+
+NavigationHandle Drawbotic_Navigation::actionHandle(NavigationIndex action) {
+  // The slot in the low bits and its generation above them
+  return (NavigationHandle)m_actionGeneration[action] << (8 * sizeof(NavigationIndex)) | action;
+}
+
+Drawbotic_Navigation::NavigationIndex Drawbotic_Navigation::handleAction(NavigationHandle handle) {
+  // A handle only matches a slot that is queued, with the generation it had when the action was queued. The
+  // generation moves on each time the slot is released, so a handle to an earlier action in the slot only matches
+  // again once the generation has wrapped all the way round
+  NavigationIndex action = (NavigationIndex)handle;
+  uint8_t generation = (uint8_t)(handle >> (8 * sizeof(NavigationIndex)));
+  if (generation == 0 || action >= NAV_QUEUE_CAPACITY || !(m_actionState[action] & NAV_SLOT_QUEUED) ||
+      m_actionGeneration[action] != generation)
+    return NO_ACTION;
+  return action;
+}
+
+float Drawbotic_Navigation::actionSpeed(NavigationIndex action, float speed) {
+  // The speed set for the action with setActionSpeed(), or the speed given when it has none
+  return m_actionSpeed[action] ? m_actionSpeed[action] * (1.0f / 255.0f) : speed;
+}
+
+void Drawbotic_Navigation::abandonAction() {
+  // The action being performed is dropped part way, DB-1 stops where it is and whatever comes next starts from rest
+  m_currentActive = false;
+  m_entrySpeed = 0;
+  setMotorSpeeds(0, 0);
+}
+
+void Drawbotic_Navigation::pushEvent(NavigationIndex action, bool complete) {
+  // Called from the steps, which may be running in an interrupt. Events that don't fit are counted rather than overwriting older ones
+  if (m_eventCount >= NAV_EVENT_QUEUE) {
+    m_droppedEvents++;
+    return;
+  }
+  NavigationEvent *event = &m_events[(m_eventFirst + m_eventCount) % NAV_EVENT_QUEUE];
+  event->action = actionHandle(action);
+  event->type = m_actionPool[action].type;
+  event->complete = complete;
+  m_eventCount++;
+}
+
+void Drawbotic_Navigation::dispatchEvents() {
+  // Each event is taken off the buffer before its callback runs, so the callback is free to change the queue
+  bool completed = false;
+  for (;;) {
+    enterCritical();
+    bool pending = m_eventCount > 0;
+    NavigationEvent event = m_events[m_eventFirst];
+    if (pending) {
+      m_eventFirst = (m_eventFirst + 1) % NAV_EVENT_QUEUE;
+      m_eventCount--;
+    }
+    exitCritical();
+    if (!pending)
+      break;
+
+    if (!event.complete) {
+      if (m_onStart)
+        m_onStart(event.action, event.type, m_onStartContext);
+    }
+    else {
+      completed = true;
+      if (m_onComplete)
+        m_onComplete(event.action, event.type, m_onCompleteContext);
+    }
+  }
+
+  if (completed && m_onQueueLow) {
+    enterCritical();
+    int size = m_queueSize;
+    exitCritical();
+    if (size <= m_queueLowWater)
+      m_onQueueLow(size, m_onQueueLowContext);
+  }
+}
+
+bool Drawbotic_Navigation::isResting() {
+  // DB-1 is standing still with nothing to control, either with an empty queue or in a stop that has started
+  return m_queueSize == 0 || (m_currentActive && m_current.type == NAV_STOP);
+}
+
+void Drawbotic_Navigation::enterCritical() {
+  // the queue is shared with the interrupt running the navigation steps. Sections can nest, and can be entered from that
+  // interrupt or with interrupts already disabled, so the outermost one puts interrupts back as it found them
+  if (m_interruptDriven) {
+    uint32_t state = disableInterrupts();
+    if (m_criticalDepth++ == 0)
+      m_interruptState = state;
+  }
+}
+
+void Drawbotic_Navigation::exitCritical() {
+  if (m_interruptDriven && m_criticalDepth > 0) {
+    m_criticalDepth--;
+    if (m_criticalDepth == 0)
+      restoreInterrupts(m_interruptState);
+  }
+}
+
+void Drawbotic_Navigation::addActionFront(NavigationIndex action) {
+  // The action being performed is being pushed back, remember how much of it is left
+  if (m_currentActive)
+    suspendAction();
+
+  // The previous node of the current head is the new node
+  if (m_queueHead != NO_ACTION)
+    m_actionPool[m_queueHead].prev = action;
+
+  // The previous node of the new node is nothing (it's at the head of the queue)
+  m_actionPool[action].prev = NO_ACTION;
+  // The next node of the new node is the current head node
+  m_actionPool[action].next = m_queueHead;
+  // Update the head node to point to the new node
+  m_queueHead = action;
+  m_actionState[action] |= NAV_SLOT_QUEUED;
+
+  // If the queue is empty the new node is also the current tail node
+  if (m_queueSize == 0)
+    m_queueTail = action;
+
+  // Update the size of the queue
+  m_queueSize++;
+}
+
+void Drawbotic_Navigation::addActionBack(NavigationIndex action) {
+  // The next node of the current tail is the new node
+  if (m_queueTail != NO_ACTION)
+    m_actionPool[m_queueTail].next = action;
+
+  // The previous node of the new node is the current tail
+  m_actionPool[action].prev = m_queueTail;
+  // The next node of the new node is nothing (it's at the end of the queue)
+  m_actionPool[action].next = NO_ACTION;
+  // Update the tail node to point to the new node
+  m_queueTail = action;
+  m_actionState[action] |= NAV_SLOT_QUEUED;
+
+  // If the queue is empty the new node is also the current head node
+  if (m_queueSize == 0)
+    m_queueHead = action;
+
+  // Update the size of the queue
+  m_queueSize++;
+}
+
+void Drawbotic_Navigation::removeHeadAction() {
+  NavigationIndex action = m_queueHead;
+
+  // The next node becomes the new head of the queue
+  m_queueHead = m_actionPool[action].next;
+  if (m_queueHead != NO_ACTION)
+    m_actionPool[m_queueHead].prev = NO_ACTION;
+  else
+    m_queueTail = NO_ACTION;
+
+  releaseAction(action);
+  m_queueSize--;
+  m_currentActive = false;
+}
+
+void Drawbotic_Navigation::unlinkAction(NavigationIndex action) {
+  detachAction(action);
+  releaseAction(action);
+  m_queueSize--;
+}
+
+void Drawbotic_Navigation::detachAction(NavigationIndex action) {
+  NavigationIndex prev = m_actionPool[action].prev;
+  NavigationIndex next = m_actionPool[action].next;
+
+  // Join the neighbouring nodes together, updating the head and tail if the action was at either end
+  if (prev != NO_ACTION)
+    m_actionPool[prev].next = next;
+  else
+    m_queueHead = next;
+  if (next != NO_ACTION)
+    m_actionPool[next].prev = prev;
+  else
+    m_queueTail = prev;
+}
+
+bool Drawbotic_Navigation::isEmptyAction(NavigationIndex action) {
+  const NavigationAction *a = &m_actionPool[action];
+
+  switch (a->type) {
+  case NAV_FORWARD:
+    // a forward action finishes as soon as it starts unless it has a distance ahead to cover
+    return a->params.ticks <= 0;
+  case NAV_TURN:
+    return a->params.turn.ticks == 0;
+  case NAV_ROTATE:
+    return a->params.rotate.ticks == 0 && a->params.rotate.angle == 0;
+  case NAV_STOP:
+    return a->params.time == 0;
+  default:
+    return false;
+  }
+}
+
+bool Drawbotic_Navigation::mergeActions(NavigationIndex first, NavigationIndex second, const NavigationPose *pose) {
+  NavigationAction *a = &m_actionPool[first];
+  NavigationAction *b = &m_actionPool[second];
+
+  // Returns true if the second action has been folded into the first and can be removed. Moving actions are only
+  // combined at the same speed, see setActionSpeed()
+  bool sameSpeed = m_actionSpeed[first] == m_actionSpeed[second];
+  switch (b->type) {
+  case NAV_FORWARD:
+    if (a->type != NAV_FORWARD || !sameSpeed)
+      return false;
+    // a negative distance isn't driven backwards, so it can't take anything off its neighbour
+    if (a->params.ticks <= 0 || b->params.ticks <= 0 || a->params.ticks > 2147483647 - b->params.ticks)
+      return false;
+    a->params.ticks += b->params.ticks;
+    return true;
+  case NAV_TURN:
+    // only arcs of the same radius and direction can be joined
+    if (a->type != NAV_TURN || a->flags != b->flags || a->params.turn.ratio != b->params.turn.ratio || !sameSpeed)
+      return false;
+    if ((uint32_t)a->params.turn.ticks + b->params.turn.ticks > 65535)
+      return false;
+    a->params.turn.ticks += b->params.turn.ticks;
+    return true;
+  case NAV_ROTATE: {
+    if (a->type != NAV_ROTATE || !sameSpeed)
+      return false;
+    // rotations are combined by angle and wrapped, so rotations that cancel out leave nothing behind
+    int32_t angle = (int32_t)a->params.rotate.angle + b->params.rotate.angle;
+    while (angle > 1800)
+      angle -= 3600;
+    while (angle <= -1800)
+      angle += 3600;
+    a->params.rotate.angle = (int16_t)angle;
+    a->params.rotate.ticks = angle != 0 ? rotationTicks(angle / 10.0f) : 0;
+    a->flags = angle < 0 ? NAV_CLOCKWISE : 0;
+    return true;
+  }
+  case NAV_STOP:
+    if (a->type != NAV_STOP || a->params.time > 4294967295UL - b->params.time)
+      return false;
+    a->params.time += b->params.time;
+    return true;
+  case NAV_PEN_UP:
+  case NAV_PEN_DOWN:
+    // only the last of several pen actions in a row has any effect
+    if (a->type != NAV_PEN_UP && a->type != NAV_PEN_DOWN)
+      return false;
+    break;
+  case NAV_ROTATE_TO:
+    // sets the heading whatever it was before, so any rotation just before it is wasted
+    if (a->type != NAV_ROTATE && a->type != NAV_ROTATE_TO)
+      return false;
+    break;
+  case NAV_MOVE_TO:
+  case NAV_BEZIER:
+  case NAV_POLYLINE:
+    // these actions start by rotating to face where they're going, so a rotation just before them is wasted, but only
+    // if they go somewhere. One that ends where it starts leaves DB-1 facing the way the rotation left it
+    if ((a->type != NAV_ROTATE && a->type != NAV_ROTATE_TO) || !pose || !leavesPose(second, *pose))
+      return false;
+    break;
+  default:
+    return false;
+  }
+
+  // The first action is redundant, replace it with the second. Any curve points now belong to the first
+  a->params = b->params;
+  a->type = b->type;
+  a->flags = b->flags;
+  m_actionSpeed[first] = m_actionSpeed[second];
+  m_actionState[first] &= ~NAV_SLOT_STARTED;
+  b->type = NAV_STOP;
+  return true;
+}
+
+// Whether a move to or curve action takes DB-1 far enough from a pose that it turns to face the way it goes
+bool Drawbotic_Navigation::leavesPose(NavigationIndex action, const NavigationPose &pose) {
+  const NavigationAction *a = &m_actionPool[action];
+  if (a->type == NAV_MOVE_TO)
+    return hypot(a->params.point.x / 10.0f - pose.x, a->params.point.y / 10.0f - pose.y) >= NAV_PATH_TOLERANCE;
+  float x, y;
+  for (uint16_t i = 0; pathPoint(action, i, &x, &y); i++) {
+    if (hypot(x - pose.x, y - pose.y) >= NAV_PATH_TOLERANCE)
+      return true;
+  }
+  return false;
+}
+
+int Drawbotic_Navigation::removeRedundantActions() {
+  int removed = 0;
+  // The action being performed is left alone. Where DB-1 will be is followed along the queue, from where it is now
+  // unless it is part way through an action that moves it
+  NavigationIndex action = m_queueHead;
+  uint8_t penState = NAV_FORWARD; // not known yet
+  NavigationPose pose = m_pose;
+  bool poseKnown = true;
+  if (m_currentActive && action != NO_ACTION) {
+    if (m_current.type == NAV_PEN_UP || m_current.type == NAV_PEN_DOWN)
+      penState = m_current.type;
+    poseKnown = m_current.type == NAV_STOP || m_current.type == NAV_PEN_UP || m_current.type == NAV_PEN_DOWN;
+    action = m_actionPool[action].next;
+  }
+
+  while (action != NO_ACTION) {
+    NavigationIndex next = m_actionPool[action].next;
+    uint8_t type = m_actionPool[action].type;
+
+    if (isEmptyAction(action) || ((type == NAV_PEN_UP || type == NAV_PEN_DOWN) && type == penState)) {
+      // nothing to do, or the pen is already where this action would put it
+      unlinkAction(action);
+      removed++;
+      action = next;
+    }
+    else if (next != NO_ACTION && mergeActions(action, next, poseKnown ? &pose : NULL)) {
+      // stay on this action, it might combine with the one after too
+      unlinkAction(next);
+      removed++;
+    }
+    else {
+      if (type == NAV_PEN_UP || type == NAV_PEN_DOWN)
+        penState = type;
+      advancePose(action, &pose, NULL);
+      action = next;
+    }
+  }
+  return removed;
+}
+
+float Drawbotic_Navigation::reorderStrokes() {
+  // a full queue of strokes is too large for the stack of the smaller boards, so the table is static and shared by every
+  // instance, which is safe as optimize() is only ever called from the main loop
+  static NavigationStroke strokes[NAV_QUEUE_CAPACITY / 3 + 1];
+  int count = 0;
+  int travelActions = 0;
+  float travelBefore = 0;
+  NavigationPose pose = m_pose;
+  bool penDown = false;
+  bool hasSuffix = false;
+
+  // A pen up at the very start of the queue stays there, it makes sure the pen is up for the first travel
+  NavigationIndex start = m_queueHead;
+  if (start != NO_ACTION && m_actionPool[start].type == NAV_PEN_UP)
+    start = m_actionPool[start].next;
+
+  // Follow the queue from the current pose to find where each stroke starts and ends
+  for (NavigationIndex a = start; a != NO_ACTION; a = m_actionPool[a].next) {
+    uint8_t type = m_actionPool[a].type;
+    if (penDown) {
+      advancePose(a, &pose, NULL);
+      if (type == NAV_PEN_UP) {
+        strokes[count].last = a;
+        strokes[count].endX = toTenths(pose.x);
+        strokes[count].endY = toTenths(pose.y);
+        strokes[count].endHeading = toTenths(pose.heading);
+        count++;
+        penDown = false;
+      }
+    }
+    else if (type == NAV_PEN_DOWN) {
+      // strokes must fit in the table and start somewhere a move to can reach
+      if (count > NAV_QUEUE_CAPACITY / 3 || abs(pose.x) > 3000 || abs(pose.y) > 3000)
+        return 0;
+      strokes[count].first = a;
+      strokes[count].startX = toTenths(pose.x);
+      strokes[count].startY = toTenths(pose.y);
+      strokes[count].startHeading = toTenths(pose.heading);
+      penDown = true;
+      hasSuffix = false;
+    }
+    else if (type == NAV_STOP || type == NAV_PEN_UP) {
+      // stops between strokes might be there on purpose
+      return 0;
+    }
+    else {
+      advancePose(a, &pose, &travelBefore);
+      travelActions++;
+      hasSuffix = true;
+    }
+  }
+  if (penDown || count == 0 || abs(pose.x) > 3000 || abs(pose.y) > 3000)
+    return 0;
+  NavigationPose finalPose = pose;
+
+  // Greedily pick the nearest remaining stroke to wherever the previous one finished
+  float travelAfter = 0;
+  float x = m_pose.x;
+  float y = m_pose.y;
+  for (int i = 0; i < count; i++) {
+    int nearest = i;
+    float nearestDistance = 0;
+    for (int j = i; j < count; j++) {
+      float distance = hypot(strokes[j].startX / 10.0f - x, strokes[j].startY / 10.0f - y);
+      if (j == i || distance < nearestDistance) {
+        nearest = j;
+        nearestDistance = distance;
+      }
+    }
+    NavigationStroke swap = strokes[i];
+    strokes[i] = strokes[nearest];
+    strokes[nearest] = swap;
+    travelAfter += nearestDistance;
+    x = strokes[i].endX / 10.0f;
+    y = strokes[i].endY / 10.0f;
+  }
+  if (hasSuffix)
+    travelAfter += hypot(finalPose.x - x, finalPose.y - y);
+
+  // Only rebuild the queue if it helps and there are enough free slots for a move to and rotate to before every stroke
+  int needed = 2 * count + (hasSuffix ? 2 : 0);
+  if (travelAfter >= travelBefore || needed > NAV_QUEUE_CAPACITY - m_queueSize + travelActions)
+    return 0;
+
+  // Return the old travel actions to the pool, skipping over the strokes so they stay linked together
+  NavigationIndex a = start;
+  while (a != NO_ACTION) {
+    NavigationIndex next = m_actionPool[a].next;
+    if (m_actionPool[a].type == NAV_PEN_DOWN) {
+      while (m_actionPool[next].type != NAV_PEN_UP)
+        next = m_actionPool[next].next;
+      next = m_actionPool[next].next;
+    }
+    else {
+      releaseAction(a);
+    }
+    a = next;
+  }
+  if (start == m_queueHead) {
+    m_queueHead = NO_ACTION;
+    m_queueTail = NO_ACTION;
+    m_queueSize = 0;
+  }
+  else {
+    m_queueTail = m_queueHead;
+    m_actionPool[m_queueHead].next = NO_ACTION;
+    m_queueSize = 1;
+  }
+
+  // Link the strokes back up in their new order with direct travel between them
+  pose = m_pose;
+  for (int i = 0; i <= count; i++) {
+    bool last = i == count;
+    if (last && !hasSuffix)
+      break;
+    float targetX = last ? finalPose.x : strokes[i].startX / 10.0f;
+    float targetY = last ? finalPose.y : strokes[i].startY / 10.0f;
+    float targetHeading = last ? finalPose.heading : strokes[i].startHeading / 10.0f;
+
+    if (abs(targetX - pose.x) >= 0.05f || abs(targetY - pose.y) >= 0.05f) {
+      NavigationIndex move = allocateAction(NAV_MOVE_TO);
+      m_actionPool[move].params.point.x = toTenths(targetX);
+      m_actionPool[move].params.point.y = toTenths(targetY);
+      addActionBack(move);
+      advancePose(move, &pose, NULL);
+    }
+    if (abs(wrapAngle(targetHeading - pose.heading)) >= 0.05f) {
+      NavigationIndex rotate = allocateAction(NAV_ROTATE_TO);
+      m_actionPool[rotate].params.rotate.angle = toTenths(targetHeading);
+      addActionBack(rotate);
+    }
+    if (last)
+      break;
+
+    // Append the whole stroke, counting its actions as they are linked in
+    NavigationIndex first = strokes[i].first;
+    if (m_queueTail != NO_ACTION)
+      m_actionPool[m_queueTail].next = first;
+    else
+      m_queueHead = first;
+    m_actionPool[first].prev = m_queueTail;
+    for (NavigationIndex s = first; s != strokes[i].last; s = m_actionPool[s].next)
+      m_queueSize++;
+    m_queueSize++;
+    m_queueTail = strokes[i].last;
+    m_actionPool[m_queueTail].next = NO_ACTION;
+    pose.x = strokes[i].endX / 10.0f;
+    pose.y = strokes[i].endY / 10.0f;
+    pose.heading = strokes[i].endHeading / 10.0f;
+  }
+
+  return travelBefore - travelAfter;
+}
+
+void Drawbotic_Navigation::advancePose(NavigationIndex action, NavigationPose *pose, float *travel_mm) {
+  const NavigationAction *a = &m_actionPool[action];
+  float distance = 0;
+  float heading_rad = pose->heading * M_PI / 180.0f;
+
+  // Where the action would leave DB-1 if it was performed perfectly
+  switch (a->type) {
+  case NAV_FORWARD:
+    distance = a->params.ticks / (ENC_BITS_P_MM * m_calibration.forwardError);
+    pose->x += distance * cos(heading_rad);
+    pose->y += distance * sin(heading_rad);
+    break;
+  case NAV_TURN: {
+    // recover the radius and angle of the arc from the outside wheel signals and the wheel speed ratio
+    bool clockwise = a->flags & NAV_CLOCKWISE;
+    float ratio = (float)a->params.turn.ratio / RATIO_ONE;
+    float outside = 2 * BOT_RADIUS / (1 - ratio);
+    float radius = outside - BOT_RADIUS;
+    float angle_rad = a->params.turn.ticks / (ENC_BITS_P_MM * outside * (clockwise ? m_calibration.turnErrorRight : m_calibration.turnErrorLeft));
+    if (clockwise) {
+      angle_rad = -angle_rad;
+      radius = -radius;
+    }
+    pose->x += radius * (sin(heading_rad + angle_rad) - sin(heading_rad));
+    pose->y -= radius * (cos(heading_rad + angle_rad) - cos(heading_rad));
+    pose->heading = wrapAngle(pose->heading + angle_rad * 180.0f / M_PI);
+    distance = radius * angle_rad;
+    break;
+  }
+  case NAV_ROTATE:
+    pose->heading = wrapAngle(pose->heading + a->params.rotate.angle / 10.0f);
+    break;
+  case NAV_ROTATE_TO:
+    pose->heading = wrapAngle(a->params.rotate.angle / 10.0f);
+    break;
+  case NAV_MOVE_TO: {
+    float dx = a->params.point.x / 10.0f - pose->x;
+    float dy = a->params.point.y / 10.0f - pose->y;
+    distance = hypot(dx, dy);
+    if (distance > 0)
+      pose->heading = atan2(dy, dx) * 180.0f / M_PI;
+    pose->x = a->params.point.x / 10.0f;
+    pose->y = a->params.point.y / 10.0f;
+    break;
+  }
+  case NAV_ARC_TO: {
+    float dx = a->params.point.x / 10.0f - pose->x;
+    float dy = a->params.point.y / 10.0f - pose->y;
+    float ahead = dx * cos(heading_rad) + dy * sin(heading_rad);
+    float left = dy * cos(heading_rad) - dx * sin(heading_rad);
+    float angle_rad = 2 * atan2(left, ahead);
+    distance = abs(left) < 0.05f ? ahead : (ahead * ahead + left * left) / (2 * abs(left)) * angle_rad;
+    pose->heading = wrapAngle(pose->heading + angle_rad * 180.0f / M_PI);
+    pose->x += dx;
+    pose->y += dy;
+    break;
+  }
+  case NAV_BEZIER:
+  case NAV_POLYLINE: {
+    // follow the points, a bezier's control points are close enough for an estimate
+    float x = pose->x;
+    float y = pose->y;
+    float px, py;
+    for (uint16_t i = 0; pathPoint(action, i, &px, &py); i++) {
+      distance += hypot(px - x, py - y);
+      if (px != x || py != y)
+        pose->heading = atan2(py - y, px - x) * 180.0f / M_PI;
+      x = px;
+      y = py;
+    }
+    pose->x = x;
+    pose->y = y;
+    break;
+  }
+  default:
+    break;
+  }
+
+  if (travel_mm)
+    *travel_mm += abs(distance);
+}
+
+bool Drawbotic_Navigation::driveForward(NavigationState *action) {
+  int32_t encError = action->target - action->progress;
+
+  if (encError > 0) {
+    float power = profileSpeed(action);
+    // motor 2 follows motor 1 at the same speed
+    setMotorSpeeds(power, syncFollowPower(NAV_LOOP_FORWARD, action, m_encoderDelta1, m_encoderDelta2, power));
+    action->progress += m_encoderDelta1;
+    return false; // not finished
+  }
+  // the signals counted over the finishing step are part of the overshoot carried on
+  action->progress += m_encoderDelta1;
+  return true; // finished
+}
+
+bool Drawbotic_Navigation::turn(NavigationState *action)
+{
+  if (action->progress < action->target) {
+    // the outside wheel leads, motor 1 on a left turn and motor 2 on a right turn
+    bool clockwise = action->flags & NAV_CLOCKWISE;
+    int32_t lead = clockwise ? m_encoderDelta2 : m_encoderDelta1;
+    int32_t follow = clockwise ? m_encoderDelta1 : m_encoderDelta2;
+
+    float power = profileSpeed(action);
+    float followPower = syncFollowPower(NAV_LOOP_TURN, action, lead, follow, power * action->multiplier);
+
+    setMotorSpeeds(clockwise ? followPower : power, clockwise ? power : followPower);
+    action->progress += lead;
+    return false;
+  }
+  // the signals counted over the finishing step are part of the overshoot carried on
+  action->progress += (action->flags & NAV_CLOCKWISE) ? m_encoderDelta2 : m_encoderDelta1;
+  return true;
+}
+
+bool Drawbotic_Navigation::rotateEnc(NavigationState *action) {
+  if (action->progress < action->target) {
+    // the absolute values are taken as the wheels spin in opposite directions
+    int32_t d1 = abs(m_encoderDelta1);
+    int32_t d2 = abs(m_encoderDelta2);
+
+    // motor 1 leads anti-clockwise rotations, motor 2 leads clockwise rotations
+    bool clockwise = action->flags & NAV_CLOCKWISE;
+    int32_t lead = clockwise ? d2 : d1;
+
+    // the leading wheel slows down as the rotation nears its target, the angle left is worked out from the signals left
+    float remaining = (float)(action->target - action->progress) * abs(action->desiredAngle) / action->target;
+    float power = rotationPower(action, remaining);
+    float followPower = -syncFollowPower(NAV_LOOP_ROTATE, action, lead, clockwise ? d1 : d2, power); // the following motor spins in the opposite direction
+
+    setMotorSpeeds(clockwise ? followPower : power, clockwise ? power : followPower);
+    action->progress += lead;
+    return false;
+  }
+  // rotations finish at rest, otherwise DB-1 keeps turning through whatever action comes next. The signals counted over
+  // the finishing step are part of the overshoot carried on
+  action->progress += abs((action->flags & NAV_CLOCKWISE) ? m_encoderDelta2 : m_encoderDelta1);
+  setMotorSpeeds(0, 0);
+  return true;
+}
+
+bool Drawbotic_Navigation::rotateIMU(NavigationState *action) {
+  // tolerance in hundredths of a degree, from the calibration
+  const int32_t tolerance = (int32_t)(m_calibration.imuTolerance * 100.0f);
+  int32_t currentAngle = (int32_t)(imuHeading() * 100.0f);
+
+  //Calculate amount of hundredths of degrees remaining, wrapped into -180 to 180 degrees
+  int32_t error = currentAngle - action->finalAngle;
+  if (error > 18000)
+    error -= 36000;
+  else if (error <= -18000)
+    error += 36000;
+
+  //If we've reached the IMU tolerance threshold then we are finished
+  if(error > -tolerance && error < tolerance) {
+    setMotorSpeeds(0, 0);
+    return true;
+  }
+
+  //motor power comes from the heading loop, positive power rotates clockwise to reduce a positive error
+  float power = rotationPower(action, error / 100.0f);
+  setMotorSpeeds(-power, power);
+
+  return false;
+}
+
+float Drawbotic_Navigation::imuHeading() {
+  // the last sample moved on by the encoder turn since, kept in 0 to 360 degrees like the IMU itself
+  float heading = m_imuSample + m_imuExtrapolation;
+  if (heading >= 360.0f)
+    heading -= 360.0f;
+  else if (heading < 0)
+    heading += 360.0f;
+  return heading;
+}
+
+void Drawbotic_Navigation::resetControllers(NavigationState *action) {
+  action->syncError = 0;
+  action->followCorrection = 0;
+  action->sync.integral = 0;
+  action->sync.rate = 0;
+  action->sync.primed = false;
+  action->heading.integral = 0;
+  action->heading.rate = 0;
+  action->heading.primed = false;
+}
+
+float Drawbotic_Navigation::runController(NavigationLoop loop, NavigationControl *control, float setpoint, float error) {
+  const NavigationGains *gains = &m_gains[loop];
+  float dt = m_stepTime_ms / 1000.0f;
+
+  // The rate of change is filtered, over a single step the encoder and IMU readings are too coarse to use directly
+  if (control->primed && dt > 0)
+    control->rate += ((error - control->lastError) / dt - control->rate) * PID_FILTER;
+  control->lastError = error;
+  control->primed = true;
+
+  float output = gains->feedforward * setpoint + gains->kp * error + control->integral + gains->kd * control->rate;
+  float clamped = constrain(output, -gains->outputLimit, gains->outputLimit);
+
+  // Only integrate while the output isn't clamped, unless the error would bring it back, so the integral can't wind up
+  if (clamped == output || (error > 0) != (output > 0))
+    control->integral = constrain(control->integral + gains->ki * error * dt, -gains->integralLimit, gains->integralLimit);
+
+  return clamped;
+}
+
+float Drawbotic_Navigation::syncFollowPower(NavigationLoop loop, NavigationState *action, int32_t lead, int32_t follow, float setpoint) {
+  // The error is how far the following wheel has fallen behind the leading wheel, kept in fixed point so it never drifts
+  action->syncError += lead * action->ratio - follow * RATIO_ONE;
+  float power = runController(loop, &action->sync, setpoint, (float)action->syncError / RATIO_ONE);
+  action->followCorrection = power - setpoint;
+  return power;
+}
+
+float Drawbotic_Navigation::rotationPower(NavigationState *action, float error_deg) {
+  // The setpoint is the least power that turns the wheels, in the direction of the error, and the result is kept within the speed.
+  // The error is scaled by the rotation speed so the gains are fractions of it, whatever the speed is set to
+  float speed = actionSpeed(m_queueHead, m_rotateSpeed);
+  float power = runController(NAV_LOOP_HEADING, &action->heading, error_deg > 0 ? m_minSpeed : -m_minSpeed, error_deg * speed);
+  return constrain(power, -speed, speed);
+}
+
+bool Drawbotic_Navigation::moveTo(NavigationState *action) {
+  if (action->phase == 0) {
+    bool facing = m_useIMU ? rotateIMU(action) : rotateEnc(action);
+    if (!facing)
+      return false;
+
+    // Drive the distance to the target from wherever the rotation actually finished
+    NavigationAction *target = &m_actionPool[m_queueHead];
+    float dx = target->params.point.x / 10.0f - m_pose.x;
+    float dy = target->params.point.y / 10.0f - m_pose.y;
+    action->target = roundToInt(sqrt(dx * dx + dy * dy) * ENC_BITS_P_MM * m_calibration.forwardError);
+    action->progress = 0;
+    action->entrySpeed = 0;
+    action->phase = 1;
+    resetControllers(action);
+  }
+  return driveForward(action);
+}
+
+bool Drawbotic_Navigation::followPath(NavigationState *action) {
+  if (action->phase == 0) {
+    bool facing = m_useIMU ? rotateIMU(action) : rotateEnc(action);
+    if (!facing)
+      return false;
+    startPathRun(action);
+  }
+
+  // Move the steering point along the curve until it is far enough ahead, a few small steps at a time
+  float x, y, dx, dy;
+  for (int i = 0; ; i++) {
+    steeringPoint(action, &x, &y);
+    dx = x - m_pose.x;
+    dy = y - m_pose.y;
+    if (i == 4 || action->pathCorner || dx * dx + dy * dy >= NAV_PATH_LOOKAHEAD * NAV_PATH_LOOKAHEAD)
+      break;
+    advancePath(action);
+  }
+
+  // The steering point relative to DB-1, ahead along its heading and off to its left
+  float ahead = dx * m_headingCos + dy * m_headingSin;
+  float left = dy * m_headingCos - dx * m_headingSin;
+  float distanceSq = dx * dx + dy * dy;
+
+  if (action->pathCorner && (distanceSq < NAV_PATH_TOLERANCE * NAV_PATH_TOLERANCE || ahead <= 0)) {
+    // Reached the end of the curve
+    if (action->type != NAV_POLYLINE || !loadNextSegment(action))
+      return true;
+
+    // Reached a sharp corner, rotate to face along the next segment and carry on from there
+    float angle = atan2(action->pathY[1] - action->pathY[0], action->pathX[1] - action->pathX[0]) * 180.0f / M_PI;
+    setupRelativeRotation(wrapAngle(angle - m_pose.heading));
+    action->type = NAV_POLYLINE;
+    action->phase = 0;
+    action->progress = 0;
+    resetControllers(action);
+    return false;
+  }
+
+  if (action->pathCorner) {
+    // Steer past the end along the direction the curve finishes in, so DB-1 arrives lined up with it
+    int from = action->type == NAV_BEZIER ? 2 : 0;
+    float ex = action->pathX[from + 1] - action->pathX[from];
+    float ey = action->pathY[from + 1] - action->pathY[from];
+    if (action->type == NAV_BEZIER && abs(ex) < 0.05f && abs(ey) < 0.05f) {
+      ex = action->pathX[3] - action->pathX[1];
+      ey = action->pathY[3] - action->pathY[1];
+    }
+    float length = sqrt(ex * ex + ey * ey);
+    float extend = NAV_PATH_LOOKAHEAD - sqrt(distanceSq);
+    if (length > 0 && extend > 0) {
+      dx += ex * extend / length;
+      dy += ey * extend / length;
+      ahead = dx * m_headingCos + dy * m_headingSin;
+      left = dy * m_headingCos - dx * m_headingSin;
+      distanceSq = dx * dx + dy * dy;
+    }
+  }
+
+  // Steer along the arc that passes through the steering point, using the same wheel ratio as a turn of that radius
+  float curvature = distanceSq > 0 ? 2 * left / distanceSq : 0;
+  float k = abs(curvature) * BOT_RADIUS;
+  float ratio = (1 - k) / (1 + k);
+  float power = profileSpeed(action);
+
+  setMotorSpeeds(curvature >= 0 ? power : power * ratio, curvature >= 0 ? power * ratio : power);
+  action->progress += m_encoderDelta1 + m_encoderDelta2;
+  return false;
+}
+
+void Drawbotic_Navigation::startPathRun(NavigationState *action) {
+  // Estimate the distance to the next stop, the end of the curve or a sharp corner, so the speed can be profiled over it
+  float length = 0;
+  if (action->type == NAV_BEZIER) {
+    float px = bezier(action->pathX, action->pathT);
+    float py = bezier(action->pathY, action->pathT);
+    for (int i = 1; i <= 8; i++) {
+      float t = action->pathT + (1 - action->pathT) * i / 8;
+      float x = bezier(action->pathX, t);
+      float y = bezier(action->pathY, t);
+      length += sqrt((x - px) * (x - px) + (y - py) * (y - py));
+      px = x;
+      py = y;
+    }
+  }
+  else {
+    length = action->segmentLength - action->pathT;
+    float px = action->pathX[1];
+    float py = action->pathY[1];
+    float dx = px - action->pathX[0];
+    float dy = py - action->pathY[0];
+    float x, y;
+    for (uint16_t i = action->pathIndex + 1; pathPoint(m_queueHead, i, &x, &y); i++) {
+      float nx = x - px;
+      float ny = y - py;
+      float n = sqrt(nx * nx + ny * ny);
+      if (dx * nx + dy * ny < PATH_CORNER_COS * sqrt(dx * dx + dy * dy) * n)
+        break;
+      length += n;
+      px = x;
+      py = y;
+      dx = nx;
+      dy = ny;
+    }
+  }
+
+  // progress is counted on both wheels, so the speed profile ramps at half the rate of a forward action
+  action->target = roundToInt(2 * length * ENC_BITS_P_MM * m_calibration.forwardError);
+  action->progress = 0;
+  action->entrySpeed = 0;
+  action->exitSpeed = 0;
+  action->phase = 1;
+  resetControllers(action);
+}
+
+void Drawbotic_Navigation::advancePath(NavigationState *action) {
+  if (action->type == NAV_BEZIER) {
+    float t = action->pathT;
+    float dx = bezierSlope(action->pathX, t);
+    float dy = bezierSlope(action->pathY, t);
+    float speed = sqrt(dx * dx + dy * dy);
+    if (speed < 0.001f) {
+      // a cusp, step over it
+      t += 0.01f;
+    }
+    else {
+      // Step a fixed distance along the curve, or less where it bends sharply
+      float step = NAV_PATH_STEP;
+      float bend = abs(dx * bezierBend(action->pathY, t) - dy * bezierBend(action->pathX, t)) / (speed * speed * speed);
+      if (bend * step > NAV_PATH_BEND)
+        step = NAV_PATH_BEND / bend;
+      t += step / speed;
+    }
+    if (t >= 1) {
+      t = 1;
+      action->pathCorner = true;
+    }
+    action->pathT = t;
+    return;
+  }
+
+  // Polyline, move along the current segment and round any gentle corners onto the next one
+  action->pathT += NAV_PATH_STEP;
+  while (action->pathT >= action->segmentLength) {
+    float x, y;
+    if (!pathPoint(m_queueHead, action->pathIndex + 1, &x, &y)) {
+      action->pathT = action->segmentLength;
+      action->pathCorner = true;
+      return;
+    }
+    float dx = action->pathX[1] - action->pathX[0];
+    float dy = action->pathY[1] - action->pathY[0];
+    float nx = x - action->pathX[1];
+    float ny = y - action->pathY[1];
+    if (dx * nx + dy * ny < PATH_CORNER_COS * action->segmentLength * sqrt(nx * nx + ny * ny)) {
+      // wait at a sharp corner
+      action->pathT = action->segmentLength;
+      action->pathCorner = true;
+      return;
+    }
+    float carry = action->pathT - action->segmentLength;
+    loadNextSegment(action);
+    action->pathT = carry;
+  }
+}
+
+void Drawbotic_Navigation::steeringPoint(NavigationState *action, float *x, float *y) {
+  if (action->type == NAV_BEZIER) {
+    *x = bezier(action->pathX, action->pathT);
+    *y = bezier(action->pathY, action->pathT);
+  }
+  else {
+    float f = action->segmentLength > 0 ? action->pathT / action->segmentLength : 1;
+    *x = action->pathX[0] + (action->pathX[1] - action->pathX[0]) * f;
+    *y = action->pathY[0] + (action->pathY[1] - action->pathY[0]) * f;
+  }
+}
+
+bool Drawbotic_Navigation::loadNextSegment(NavigationState *action) {
+  float x, y;
+  if (!pathPoint(m_queueHead, action->pathIndex + 1, &x, &y))
+    return false;
+
+  // The end of the current segment is the start of the next
+  action->pathIndex++;
+  action->pathX[0] = action->pathX[1];
+  action->pathY[0] = action->pathY[1];
+  action->pathX[1] = x;
+  action->pathY[1] = y;
+  float dx = x - action->pathX[0];
+  float dy = y - action->pathY[0];
+  action->segmentLength = sqrt(dx * dx + dy * dy);
+  action->pathT = 0;
+  action->pathCorner = false;
+  return true;
+}
+
+bool Drawbotic_Navigation::stop(NavigationState *action, float deltaTime_ms) {
+  float stopDuration = action->desiredTime;
+
+  if (action->elapsedTime < stopDuration) {
+    setMotorSpeeds(0, 0);
+    action->elapsedTime += deltaTime_ms;
+    return false;
+  }
+  return true;
+}
+
+void Drawbotic_Navigation::setMotorSpeeds(float m1, float m2) {
+  // the motors are written once at the end of the step, see writeMotors()
+  m_motorCommand[0] = m1;
+  m_motorCommand[1] = m2;
+}
+
+void Drawbotic_Navigation::writeMotors() {
+  float power[2] = { m_motorCommand[0], m_motorCommand[1] };
+  if (m_velocityControl) {
+    power[0] = wheelPower(0, power[0], m_encoderDelta1);
+    power[1] = wheelPower(1, power[1], m_encoderDelta2);
+  }
+
+  // power jumping up between actions makes the wheels slip, so the rise in the mean power of the two motors is limited.
+  // Steering is left alone, the loops that steer can't cope with the lag, and when both change the steering is scaled
+  // down with the mean so a curve keeps its shape while it speeds up. Slowing down is already planned by the actions and
+  // any lag there would carry DB-1 past its targets
+  const float maxChange = m_motorStage.slewRate * m_stepTime_ms / 1000.0f;
+  float mean = (power[0] + power[1]) / 2;
+  float lastMean = (m_motorPower[0] + m_motorPower[1]) / 2;
+  if (maxChange > 0 && abs(mean) > abs(lastMean)) {
+    float meanChange = abs(mean - lastMean);
+    if (meanChange > maxChange) {
+      float scale = maxChange / meanChange;
+      power[0] = m_motorPower[0] + (power[0] - m_motorPower[0]) * scale;
+      power[1] = m_motorPower[1] + (power[1] - m_motorPower[1]) * scale;
+    }
+  }
+
+  const float deadband = m_motorStage.deadband;
+  for (int i = 0; i < 2; i++) {
+    m_motorPower[i] = power[i];
+
+    float output = power[i];
+    if (deadband > 0 && output != 0)
+      output = output > 0 ? deadband + output * (1 - deadband) : -deadband + output * (1 - deadband);
+
+    // a power that is the same as the one last written is skipped, unless it is due to be refreshed. With a write
+    // threshold small changes are skipped too, but only while the motor keeps turning the same way, so starting,
+    // stopping and reversing are always written
+    m_motorAge_ms[i] += m_stepTime_ms;
+    float change = abs(output - m_motorOutput[i]);
+    bool stale = m_motorStage.refresh_ms > 0 && m_motorAge_ms[i] >= m_motorStage.refresh_ms;
+    if (change == 0 && !stale)
+      continue;
+    if (m_motorStage.writeThreshold > 0 && change <= m_motorStage.writeThreshold && !stale && output != 0 &&
+        m_motorOutput[i] != 0 && (output > 0) == (m_motorOutput[i] > 0))
+      continue;
+    DB1.setMotorSpeed(i + 1, output);
+    m_motorOutput[i] = output;
+    m_motorAge_ms[i] = 0;
+    m_motorWrites++;
+  }
+}
+
+float Drawbotic_Navigation::minimumSpeed() {
+  // with the wheel speeds held there is no need to stay above the power that overcomes friction, and with the
+  // deadband compensated the actions only need to ask for the part of SPEED_MIN above it
+  if (m_velocityControl)
+    return VELOCITY_MIN;
+  if (m_motorStage.deadband > 0) {
+    float speed = (SPEED_MIN - m_motorStage.deadband) / (1 - m_motorStage.deadband);
+    return speed > VELOCITY_MIN ? speed : VELOCITY_MIN;
+  }
+  return SPEED_MIN;
+}
+
+float Drawbotic_Navigation::wheelPower(int wheel, float request, int32_t delta) {
+  // a single encoder signal per step is already hundreds of mm/s, so the measured speed is filtered over many steps
+  const float mmPerTick = 1.0f / ENC_BITS_P_MM;
+  if (m_stepTime_ms > 0)
+    m_wheelRate[wheel] += (delta * mmPerTick * 1000.0f / m_stepTime_ms - m_wheelRate[wheel]) * filterWeight(VELOCITY_FILTER);
+
+  // a stopped wheel is left unpowered rather than held against any drift, and a wheel that changes direction starts
+  // again rather than carrying over an integral that was pushing it the other way
+  NavigationControl *control = &m_wheelControl[wheel];
+  if (request == 0 || (request > 0 && control->integral < 0) || (request < 0 && control->integral > 0)) {
+    control->integral = 0;
+    control->primed = false;
+  }
+  if (request == 0)
+    return 0;
+  float target = request * WHEEL_SPEED;
+  return runController(NAV_LOOP_VELOCITY, control, target, target - m_wheelRate[wheel]);
+}
+
+bool Drawbotic_Navigation::penUp() {
+  DB1.setPen(false);
+  m_stepPen = 1;
+  return true;
+}
+
+bool Drawbotic_Navigation::penDown() {
+  DB1.setPen(true);
+  m_stepPen = 2;
+  return true;
+}
+
+#ifdef NAV_INSTRUMENTATION
+// Saturate a value into a 16 bit signed integer
+static int16_t toInt16(float value) {
+  if (value >= 32767.0f)
+    return 32767;
+  if (value <= -32767.0f)
+    return -32767;
+  return (int16_t)value;
+}
+
+/*!
+ * \brief Get the statistics recorded for a recently completed action. Only available when the library is built with NAV_INSTRUMENTATION defined
+ * 
+ * \param index Which action to get, 0 is the most recently completed action. Up to NAV_STATS_HISTORY actions are kept
+ * \param stats The struct to fill with the statistics
+ * \return true if there is a record for that action, false otherwise
+ */
+bool Drawbotic_Navigation::getActionStats(int index, NavigationActionStats *stats) {
+  if (index < 0 || index >= m_statsCount)
+    return false;
+  *stats = m_stats[(m_statsNext + NAV_STATS_HISTORY - 1 - index) % NAV_STATS_HISTORY];
+  return true;
+}
+
+/*!
+ * \brief The number of navigation steps whose execution time fell into a histogram bucket. Only available when the library is built with NAV_INSTRUMENTATION defined
+ * 
+ * \param bucket The bucket, between 0 and NAV_HISTOGRAM_BUCKETS - 1. Bucket 0 counts steps that took less than 2 microseconds, bucket n counts steps that took from 2^n up to 2^(n+1) microseconds, and the last bucket counts everything slower
+ * \return The number of steps in the bucket
+ */
+uint32_t Drawbotic_Navigation::getStepTimeHistogram(int bucket) {
+  if (bucket < 0 || bucket >= NAV_HISTOGRAM_BUCKETS)
+    return 0;
+  return m_stepHistogram[bucket];
+}
+
+/*!
+ * \brief Write the contents of the trace buffer in a compact binary format, then empty it. Only available when the library is built with NAV_INSTRUMENTATION defined
+ * 
+ * \param out Where to write the trace, for example Serial
+ * 
+ * \note Steps performed from a timer interrupt while the trace is being written out are not traced.
+ * \note The format is the bytes 'N' 'T', a version byte (1), a little endian 16 bit sample count, then each sample oldest first as four little endian 16 bit signed values: the motor 1 and motor 2 encoder deltas, and the motor 1 and motor 2 powers in thousandths
+ */
+void Drawbotic_Navigation::dumpTrace(Print &out) {
+  // writing the trace out takes many steps, which don't add samples while it is being read
+  enterCritical();
+  m_traceDumping = true;
+  uint16_t count = m_traceCount;
+  uint16_t next = m_traceNext;
+  exitCritical();
+  uint8_t header[5] = { 'N', 'T', 1, (uint8_t)(count & 0xFF), (uint8_t)(count >> 8) };
+  out.write(header, sizeof(header));
+
+  uint16_t first = (next + NAV_TRACE_SIZE - count) % NAV_TRACE_SIZE;
+  for (uint16_t i = 0; i < count; i++) {
+    const NavigationTraceSample *sample = &m_trace[(first + i) % NAV_TRACE_SIZE];
+    int16_t values[4] = { sample->encoderDelta1, sample->encoderDelta2, sample->motor1, sample->motor2 };
+    uint8_t bytes[8];
+    for (int v = 0; v < 4; v++) {
+      bytes[v * 2] = (uint8_t)(values[v] & 0xFF);
+      bytes[v * 2 + 1] = (uint8_t)((uint16_t)values[v] >> 8);
+    }
+    out.write(bytes, sizeof(bytes));
+  }
+  enterCritical();
+  m_traceCount = 0;
+  m_traceDumping = false;
+  exitCritical();
+}
+
+/*!
+ * \brief Clears all of the recorded action statistics, the step time histogram and the trace buffer. Only available when the library is built with NAV_INSTRUMENTATION defined
+ */
+void Drawbotic_Navigation::clearInstrumentation() {
+  enterCritical();
+  m_statsCount = 0;
+  m_statsNext = 0;
+  m_traceCount = 0;
+  m_traceNext = 0;
+  for (int i = 0; i < NAV_HISTOGRAM_BUCKETS; i++) {
+    m_stepHistogram[i] = 0;
+  }
+  exitCritical();
+}
+
+void Drawbotic_Navigation::recordActionStats() {
+  NavigationActionStats *stats = &m_stats[m_statsNext];
+  stats->type = m_current.type;
+  stats->duration_ms = millis() - m_actionStart_ms;
+  stats->steps = m_actionSteps;
+  stats->peakCorrection = m_actionPeakCorrection;
+
+  // How far from the target the action finished, negative values are overshoot
+  if (m_current.type == NAV_ROTATE && m_useIMU) {
+    // use the pose estimate rather than reading the IMU again, so recording stats doesn't change what the robot does
+    float error = wrapAngle(m_current.finalAngle / 100.0f - (m_pose.heading + m_imuOffset));
+    stats->finalError = m_current.desiredAngle < 0 ? -error : error;
+  }
+  else if (m_current.type == NAV_STOP) {
+    stats->finalError = m_current.desiredTime - m_current.elapsedTime;
+  }
+  else {
+    stats->finalError = m_current.target - m_current.progress;
+  }
+
+  m_statsNext = (m_statsNext + 1) % NAV_STATS_HISTORY;
+  if (m_statsCount < NAV_STATS_HISTORY)
+    m_statsCount++;
+}
+
+void Drawbotic_Navigation::recordStepTime(unsigned long elapsed_us) {
+  // Power of two buckets, found by counting how many times the time can be halved
+  int bucket = 0;
+  while (elapsed_us > 1 && bucket < NAV_HISTOGRAM_BUCKETS - 1) {
+    elapsed_us >>= 1;
+    bucket++;
+  }
+  m_stepHistogram[bucket]++;
+}
+
+void Drawbotic_Navigation::recordTraceSample() {
+  if (m_traceDumping)
+    return;
+  NavigationTraceSample *sample = &m_trace[m_traceNext];
+  sample->encoderDelta1 = toInt16(m_encoderDelta1);
+  sample->encoderDelta2 = toInt16(m_encoderDelta2);
+  sample->motor1 = toInt16(m_motorCommand[0] * 1000.0f);
+  sample->motor2 = toInt16(m_motorCommand[1] * 1000.0f);
+
+  m_traceNext = (m_traceNext + 1) % NAV_TRACE_SIZE;
+  if (m_traceCount < NAV_TRACE_SIZE)
+    m_traceCount++;
+}
+#endif
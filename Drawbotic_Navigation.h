@@ -12,81 +12,747 @@
 #define BOT_RADIUS      60
 #define IMU_TOLERANCE   0.2f
 #define SPEED_MIN       0.045f
-#define ROTATE_KP       0.03f
+#define ROTATE_KP       0.06f      // default heading loop gain, the fraction of the rotation speed applied per degree left to rotate
+#define ROTATE_KI       0.0f       // default heading loop integral gain, per degree second
+#define ROTATE_KD       0.0f       // default heading loop derivative gain, per degree per second
+#define SYNC_LIMIT      0.05f      // default limit on the wheel sync integral term
+#define PID_FILTER      0.1f       // weight given to each new reading of the rate of change of a control loop's error
+#define WHEEL_SPEED     600.0f     // wheel speed at full motor power in mm/s, with velocity control speeds are fractions of this
+#define VELOCITY_KP     0.002f     // default wheel velocity loop gain, motor power per mm/s of speed error
+#define VELOCITY_KI     0.05f      // default wheel velocity loop integral gain, motor power per mm the wheel has fallen behind
+#define VELOCITY_LIMIT  0.3f       // default limit on the wheel velocity integral term
+#define VELOCITY_FILTER 0.05f      // weight given to each step's encoder signals when measuring the speed of a wheel
+#define VELOCITY_MIN    0.015f     // slowest speed, as a fraction of WHEEL_SPEED, used at the end of actions with velocity control
 #define FORWARD_KP      0.01f
+#define IMU_FUSION      0.02f      // weight given to the IMU heading each time a new sample is fused into the estimated pose
+#define IMU_PERIOD_MS   10.0f      // default time between IMU samples, in milliseconds
+#define IMU_STALE_MS    100        // age in milliseconds after which the last IMU sample is treated as stale
+#define ACCEL_KP        0.2f       // fraction of the speed gained per encoder signal while accelerating at the start of an action
+#define JUNCTION_DELTA  0.05f      // largest step in wheel power allowed when blending from one action into the next
+#define MOTOR_DEADBAND  0.0f       // default motor power lost to friction that the output stage adds back, 0 leaves it to SPEED_MIN
+#define MOTOR_SLEW_RATE 0.0f       // default limit on how fast the output stage lets a motor's power change, per second, 0 for no limit
+#define MOTOR_THRESHOLD 0.0f       // default change in a motor's power that the output stage leaves unwritten, 0 writes every change
+#define MOTOR_REFRESH_MS 100.0f    // default longest time the output stage leaves a motor's power without writing it again
+#define NAV_LOOKAHEAD   8          // number of queued actions considered when planning the speed at the end of an action
+#define NAV_IDLE_FOREVER 1e30f     // returned by getIdleTime() when there is nothing to do until another action is queued
+
+// The settings below change the layout of Drawbotic_Navigation, so they must be defined the same way for the whole
+// build (for example with a compiler flag) rather than just in a sketch before including this header
+
+#ifndef NAV_QUEUE_CAPACITY
+#define NAV_QUEUE_CAPACITY 64     // maximum number of queued actions
+#endif
+#if NAV_QUEUE_CAPACITY < 1 || NAV_QUEUE_CAPACITY > 65534
+#error "NAV_QUEUE_CAPACITY must be between 1 and 65534, the largest index below the one that marks no action"
+#endif
+
+#ifndef NAV_PATH_POINTS
+#define NAV_PATH_POINTS    64     // number of points shared by all of the queued bezier and polyline actions
+#endif
+
+#ifndef NAV_STREAM_LINE
+#define NAV_STREAM_LINE    64     // longest command line accepted by streaming mode, including the newline, room for a bezier of six -3276.70 coordinates
+#endif
+
+#ifndef NAV_PROGRAM_DEPTH
+#define NAV_PROGRAM_DEPTH  4      // deepest nesting of repeat blocks in a program run with runProgram()
+#endif
+
+#ifndef NAV_EVENT_QUEUE
+#define NAV_EVENT_QUEUE    8      // action starts and completions kept between calls to update() for the callbacks
+#endif
+
+#define NAV_STREAM_BUDGET  64     // most bytes read from the stream by a single call to update()
+#define NAV_PROGRAM_BUDGET 16     // most program instructions performed by a single call to update()
+
+#define NAV_PATH_LOOKAHEAD 8.0f   // distance ahead of DB-1 along a curve that it steers towards, in millimetres
+#define NAV_PATH_STEP      2.0f   // longest step taken along a curve when moving the steering point, in millimetres
+#define NAV_PATH_BEND      0.1f   // largest change in direction, in radians, allowed within one step along a curve
+#define NAV_PATH_CORNER    30.0f  // polyline corners sharper than this many degrees are taken by stopping and rotating
+#define NAV_PATH_TOLERANCE 1.0f   // how close DB-1 has to get to the end of a curve or a sharp corner, in millimetres
+
+// Define NAV_INSTRUMENTATION to record per action statistics, a step time histogram and a trace of the encoder and motor values
+#ifndef NAV_STATS_HISTORY
+#define NAV_STATS_HISTORY  8      // number of completed actions to keep statistics for
+#endif
+#ifndef NAV_TRACE_SIZE
+#define NAV_TRACE_SIZE     128    // number of steps kept in the trace buffer, each uses 8 bytes
+#endif
+#define NAV_HISTOGRAM_BUCKETS 16  // number of power of two buckets in the step time histogram
+
+// Instructions of the programs run by Drawbotic_Navigation::runProgram(). A program is a byte array, usually kept in flash with
+// PROGMEM, written with the NAV_PROG_ macros and finished with NAV_PROG_END. For example a square is
+//   const uint8_t square[] PROGMEM = { NAV_PROG_REPEAT(4), NAV_PROG_FORWARD(100), NAV_PROG_ROTATE(90), NAV_PROG_LOOP, NAV_PROG_END };
+// Distances and angles are stored in tenths of a millimetre and tenths of a degree, so they must be between -3276.7 and 3276.7
+#define NAV_OP_END       0x00
+#define NAV_OP_FORWARD   0x01     // distance
+#define NAV_OP_TURN      0x02     // radius, angle
+#define NAV_OP_ROTATE    0x03     // angle
+#define NAV_OP_STOP      0x04     // time in milliseconds, 0 to 65535
+#define NAV_OP_PEN_UP    0x05
+#define NAV_OP_PEN_DOWN  0x06
+#define NAV_OP_ROTATE_TO 0x07     // heading
+#define NAV_OP_MOVE_TO   0x08     // x, y
+#define NAV_OP_ARC_TO    0x09     // x, y
+#define NAV_OP_BEZIER    0x0A     // c1x, c1y, c2x, c2y, x, y
+#define NAV_OP_REPEAT    0x0B     // count, 1 to 255, the instructions up to the matching NAV_OP_LOOP are performed count times
+#define NAV_OP_LOOP      0x0C
+
+#define NAV_PROG_WORD(value)      (uint8_t)((uint16_t)(value) & 0xFF), (uint8_t)((uint16_t)(value) >> 8)
+#define NAV_PROG_TENTHS(value)    NAV_PROG_WORD((int16_t)((value) * 10 + ((value) < 0 ? -0.5f : 0.5f)))
+#define NAV_PROG_FORWARD(distance_mm)           NAV_OP_FORWARD, NAV_PROG_TENTHS(distance_mm)
+#define NAV_PROG_TURN(radius_mm, angle_deg)     NAV_OP_TURN, NAV_PROG_TENTHS(radius_mm), NAV_PROG_TENTHS(angle_deg)
+#define NAV_PROG_ROTATE(angle_deg)              NAV_OP_ROTATE, NAV_PROG_TENTHS(angle_deg)
+#define NAV_PROG_STOP(time_ms)                  NAV_OP_STOP, NAV_PROG_WORD(time_ms)
+#define NAV_PROG_PEN_UP                         NAV_OP_PEN_UP
+#define NAV_PROG_PEN_DOWN                       NAV_OP_PEN_DOWN
+#define NAV_PROG_ROTATE_TO(heading_deg)         NAV_OP_ROTATE_TO, NAV_PROG_TENTHS(heading_deg)
+#define NAV_PROG_MOVE_TO(x_mm, y_mm)            NAV_OP_MOVE_TO, NAV_PROG_TENTHS(x_mm), NAV_PROG_TENTHS(y_mm)
+#define NAV_PROG_ARC_TO(x_mm, y_mm)             NAV_OP_ARC_TO, NAV_PROG_TENTHS(x_mm), NAV_PROG_TENTHS(y_mm)
+#define NAV_PROG_BEZIER(c1x_mm, c1y_mm, c2x_mm, c2y_mm, x_mm, y_mm) \
+  NAV_OP_BEZIER, NAV_PROG_TENTHS(c1x_mm), NAV_PROG_TENTHS(c1y_mm), NAV_PROG_TENTHS(c2x_mm), NAV_PROG_TENTHS(c2y_mm), NAV_PROG_TENTHS(x_mm), NAV_PROG_TENTHS(y_mm)
+#define NAV_PROG_REPEAT(count)                  NAV_OP_REPEAT, (uint8_t)(count)
+#define NAV_PROG_LOOP                           NAV_OP_LOOP
+#define NAV_PROG_END                            NAV_OP_END
+
+// Records of a recording made by Drawbotic_Navigation::beginRecording(). A recording starts with 'N', 'R', NAV_RECORD_VERSION,
+// whether the IMU is used, the update rate and NAV_LOOP_COUNT, then each record is one of these tags followed by its fields.
+// Numbers are little-endian and floats are IEEE 754 singles. extras/simulator/nav_replay plays a recording back
+#define NAV_RECORD_VERSION 4
+#define NAV_REC_SETTINGS   'S'    // speed, rotate speed, fixed timestep, catch up steps, IMU period, the gains of each loop, the calibration, the motor output stage
+#define NAV_REC_VELOCITY   'V'    // setVelocityControl(), enabled
+#define NAV_REC_POSE       'P'    // setPose(), x, y, heading
+#define NAV_REC_ACTION     'A'    // an add action call, type, front, number of values, values
+#define NAV_REC_CLEAR      'C'    // clearAllActions()
+#define NAV_REC_OPTIMIZE   'O'    // optimize(), reorder strokes
+#define NAV_REC_CANCEL     'X'    // cancelAction(), handle as 32 bits
+#define NAV_REC_REPLACE    'R'    // replaceAction(), handle, replacement handle, both as 32 bits
+#define NAV_REC_SPEED      'Q'    // setActionSpeed(), handle as 32 bits, speed
+#define NAV_REC_HEADING    'H'    // setIMUHeading(), heading
+#define NAV_REC_IMU        'I'    // a heading read from the IMU
+#define NAV_REC_STEP       'N'    // a navigation step, both encoder deltas read, both motor powers last written, pen (1 up, 2 down, 0 unchanged)
+#define NAV_REC_UPDATE     'U'    // the end of a call to update(), millis() when it was called, delta time
+#define NAV_REC_END        'E'    // endRecording()
+
+/*!
+ * \brief The estimated position and heading of DB-1
+ * 
+ * \note The pose starts at the origin facing along the x axis. Positive headings are counter-clockwise, matching the direction of positive turn and rotate angles.
+ */
+struct NavigationPose {
+  float x;        //!< x position in millimetres
+  float y;        //!< y position in millimetres
+  float heading;  //!< heading in degrees counter-clockwise from the x axis, between -180 and 180
+};
+
+/*!
+ * \brief The result of optimising a navigation queue, see Drawbotic_Navigation::optimize()
+ */
+struct NavigationOptimizeResult {
+  int   actionsRemoved;   //!< How many fewer actions the queue holds afterwards, negative if reordering strokes added more travel actions than it removed
+  float travelSaved_mm;   //!< Estimated reduction in the distance travelled with the pen up, in millimetres
+};
+
+/*!
+ * \brief The gains of one of the navigation control loops, see Drawbotic_Navigation::setGains()
+ * 
+ * \note Each loop's output is feedforward * setpoint + kp * error + ki * integral of error + kd * rate of change of error, clamped to +/- outputLimit. The integral stops growing while the output is clamped and never contributes more than +/- integralLimit, so it can't wind up.
+ */
+struct NavigationGains {
+  float feedforward;    //!< Output per unit of the setpoint
+  float kp;             //!< Proportional gain
+  float ki;             //!< Integral gain, per second
+  float kd;             //!< Derivative gain, in seconds
+  float integralLimit;  //!< Largest output the integral term can contribute
+  float outputLimit;    //!< Largest output of the loop
+};
+
+/*!
+ * \brief The calibration constants that differ from one DB-1 to the next, see Drawbotic_Navigation::setCalibration()
+ * 
+ * \note The defaults are L_TURN_ERROR, R_TURN_ERROR, L_ROTATE_ERROR, R_ROTATE_ERROR, FORWARD_ERROR, FORWARD_KP, ROTATE_KP and IMU_TOLERANCE. The struct holds nothing but floats, so it can be stored and loaded as it is, for example with EEPROM.put() and EEPROM.get()
+ */
+struct NavigationCalibration {
+  float turnErrorLeft;      //!< Scalar multiplier on the distance of left (anti-clockwise) turns
+  float turnErrorRight;     //!< Scalar multiplier on the distance of right (clockwise) turns
+  float rotateErrorLeft;    //!< Scalar multiplier on the distance of left (anti-clockwise) rotations without the IMU
+  float rotateErrorRight;   //!< Scalar multiplier on the distance of right (clockwise) rotations without the IMU
+  float forwardError;       //!< Scalar multiplier on the distance of forward actions
+  float forwardKp;          //!< Fraction of the speed lost per encoder signal while slowing down at the end of an action
+  float rotateKp;           //!< Heading loop gain, the fraction of the rotation speed applied per degree left to rotate. Not applied once the heading loop's gains have been set with Drawbotic_Navigation::setGains()
+  float imuTolerance;       //!< How close to its target heading, in degrees, a rotation with the IMU has to finish
+};
+
+/*!
+ * \brief The settings of the motor output stage that the motor powers of every action pass through, see Drawbotic_Navigation::setMotorOutput()
+ * 
+ * \note The defaults are MOTOR_DEADBAND, MOTOR_SLEW_RATE, MOTOR_THRESHOLD and MOTOR_REFRESH_MS
+ */
+struct NavigationMotorOutput {
+  float deadband;         //!< Motor power below which the wheels don't turn, non-zero powers are scaled into the range above it. 0 turns the compensation off
+  float slewRate;         //!< Largest change in a motor's power per second, 0 for no limit. Stopping a motor is never limited
+  float writeThreshold;   //!< Largest change in a motor's power that is left unwritten, 0 (the default) writes every change and only skips powers identical to the last one written. Changes to and from 0, and changes of direction, are always written
+  float refresh_ms;       //!< Longest time a motor's power is left without being written again even though it hasn't changed, 0 to never repeat it
+};
+
+/*!
+ * \brief Identifies a queued action, returned by the add methods of Drawbotic_Navigation, see Drawbotic_Navigation::cancelAction()
+ * 
+ * \note A handle holds the action's slot in the pool and a count of how many times that slot has been reused, and only matches while its action is queued, so it stops matching once the action has completed or been removed. The count wraps after 255 reuses of a slot, so a handle kept for that long can match a later action queued in the same slot. It is NAV_NO_HANDLE (which tests as false) when nothing was queued
+ */
+#if NAV_QUEUE_CAPACITY < 255
+typedef uint16_t NavigationHandle;
+#else
+typedef uint32_t NavigationHandle;
+#endif
+#define NAV_NO_HANDLE 0
+
+/*!
+ * \brief Called by Drawbotic_Navigation::update() when an action starts or completes, see Drawbotic_Navigation::onActionStart()
+ * 
+ * \param action The handle the action was queued with
+ * \param type The type of the action, see Drawbotic_Navigation::NavigationType
+ * \param context The pointer given when the callback was set
+ */
+typedef void (*NavigationActionCallback)(NavigationHandle action, uint8_t type, void *context);
+
+/*!
+ * \brief Called by Drawbotic_Navigation::update() when the queue runs low, see Drawbotic_Navigation::onQueueLow()
+ * 
+ * \param queueSize The number of actions left in the queue
+ * \param context The pointer given when the callback was set
+ */
+typedef void (*NavigationQueueCallback)(int queueSize, void *context);
+
+#ifdef NAV_INSTRUMENTATION
+/*!
+ * \brief Statistics recorded for a completed action when the library is built with NAV_INSTRUMENTATION defined
+ */
+struct NavigationActionStats {
+  uint8_t  type;            //!< The type of the action, see Drawbotic_Navigation::NavigationType
+  uint32_t duration_ms;     //!< Time from the action starting to it finishing
+  uint32_t steps;           //!< Number of navigation steps the action took
+  float    finalError;      //!< How far from its target the action finished, negative if it overshot. Encoder signals for movements, degrees for IMU rotations, milliseconds for stops
+  float    peakCorrection;  //!< Largest wheel sync correction applied to the following motor
+};
+
+/*!
+ * \brief A single navigation step in the trace buffer
+ */
+struct NavigationTraceSample {
+  int16_t encoderDelta1;    //!< Motor 1 encoder signals since the previous step
+  int16_t encoderDelta2;    //!< Motor 2 encoder signals since the previous step
+  int16_t motor1;           //!< Motor 1 power in thousandths
+  int16_t motor2;           //!< Motor 2 power in thousandths
+};
+#endif
 
 /*!
  * \brief The Drawbotic_Navigation class contains all of the functionality needed to create a queue of navigation actions that can be performed sequentially.
  * 
  * \note Multiple instances of Drawbotic_Navigation can be created to implement multiple queues to be run at different times.
+ * \note Actions are stored in a fixed pool of NAV_QUEUE_CAPACITY slots inside each instance, so queueing never allocates memory. Once the pool is full the add methods return NAV_NO_HANDLE until actions are completed or cleared. NAV_QUEUE_CAPACITY (1 to 65534) must be defined the same way for the whole build, for example with a compiler flag, as the library and the sketch would otherwise disagree on the size of the class.
+ * \note Queued actions only store the parameters their type needs, converted to encoder signal targets when they are queued. The runtime state of the action being performed is held once by the instance.
  */
 class Drawbotic_Navigation {
 public:
+  /*!
+   * \brief The types of navigation action
+   */
+  enum NavigationType {
+    NAV_FORWARD,
+    NAV_TURN,
+    NAV_ROTATE,
+    NAV_STOP,
+    NAV_PEN_UP,
+    NAV_PEN_DOWN,
+    NAV_ROTATE_TO,
+    NAV_MOVE_TO,
+    NAV_ARC_TO,
+    NAV_BEZIER,
+    NAV_POLYLINE,
+  };
+
+  /*!
+   * \brief The control loops whose gains can be changed with setGains()
+   */
+  enum NavigationLoop {
+    NAV_LOOP_FORWARD,   //!< Keeps the wheels in step during forward actions, the error is the difference in encoder signals
+    NAV_LOOP_TURN,      //!< Keeps the wheels at the right ratio during turn actions, the error is in encoder signals of the inside wheel
+    NAV_LOOP_ROTATE,    //!< Keeps the wheels in step during encoder rotations, the error is the difference in encoder signals
+    NAV_LOOP_HEADING,   //!< Sets the rotation power from the degrees left to rotate, with the minimum power that moves DB-1 as its setpoint. The error is scaled by the rotation speed, so the gains are fractions of it per degree
+    NAV_LOOP_VELOCITY,  //!< Holds each wheel at the speed the actions ask for when velocity control is enabled, the error is in mm/s
+    NAV_LOOP_COUNT,
+  };
+
   Drawbotic_Navigation(bool useIMU = true, float updateRate_ms = 1.0f, float speed = 0.1f, float correctionPower = 0.015f);
   void clearAllActions();
-  void addForwardAction(float distance_mm, bool front=false);
-  void addTurnAction(float radius_mm, float angle_deg, bool front=false);
-  void addRotateAction(float angle_deg, bool front=false);
-  void addStopAction(float time_ms, bool front=false);
-  void addPenAction(bool down, bool front=false);
+  NavigationHandle addForwardAction(float distance_mm, bool front=false);
+  NavigationHandle addTurnAction(float radius_mm, float angle_deg, bool front=false);
+  NavigationHandle addRotateAction(float angle_deg, bool front=false);
+  NavigationHandle addStopAction(float time_ms, bool front=false);
+  NavigationHandle addPenAction(bool down, bool front=false);
+  NavigationHandle addRotateToAction(float heading_deg, bool front=false);
+  NavigationHandle addMoveToAction(float x_mm, float y_mm, bool front=false);
+  NavigationHandle addArcToAction(float x_mm, float y_mm, bool front=false);
+  NavigationHandle addBezierAction(float c1x_mm, float c1y_mm, float c2x_mm, float c2y_mm, float x_mm, float y_mm, bool front=false);
+  NavigationHandle addPolylineAction(const float *points_mm, int count, bool front=false);
+  bool cancelAction(NavigationHandle action);
+  bool replaceAction(NavigationHandle action, NavigationHandle replacement);
+  bool setActionSpeed(NavigationHandle action, float speed);
+  bool isActionQueued(NavigationHandle action);
+  NavigationHandle getCurrentAction();
+  void onActionStart(NavigationActionCallback callback, void *context = NULL);
+  void onActionComplete(NavigationActionCallback callback, void *context = NULL);
+  void onQueueLow(NavigationQueueCallback callback, int lowWater = NAV_QUEUE_CAPACITY / 4, void *context = NULL);
+  /*!
+   * \brief The number of action starts and completions that were never passed to the callbacks because more than NAV_EVENT_QUEUE of them happened between two calls to update()
+   * \return The number of dropped events since the counters were last reset
+   */
+  uint32_t getDroppedEvents() { return m_droppedEvents; }
+  NavigationOptimizeResult optimize(bool reorderStrokes = false);
   /*!
    * \brief The current size of the navigation queue
    * \return The current size of the navigation queue 
    */
   int  getQueueSize() { return m_queueSize; }
+  /*!
+   * \brief The maximum number of actions that can be queued at once, set at compile time by NAV_QUEUE_CAPACITY
+   * \return The capacity of the navigation queue
+   * \note NAV_QUEUE_CAPACITY changes the layout of the class, so it must be defined for the whole build, for example with a compiler flag, not just in a sketch before including this header
+   */
+  int  getQueueCapacity() { return NAV_QUEUE_CAPACITY; }
   void update(float deltaTime_ms);
-  void setSpeed(float speed);
+  void tick();
+  float getIdleTime();
+  void idleUntilNeeded(float maxTime_ms = NAV_IDLE_FOREVER);
+  void setFixedTimestep(bool enabled, uint8_t maxCatchUp = 4);
+  void setInterruptDriven(bool enabled);
+  /*!
+   * \brief The number of times update() was called more than a whole step late
+   * \return The number of late steps since the counters were last reset
+   */
+  uint32_t getLateTicks() { return m_lateTicks; }
+  /*!
+   * \brief The number of whole steps that were not performed. Without a fixed timestep these are the steps merged into a single late step, with a fixed timestep they are the steps dropped because they couldn't be caught up on
+   * \return The number of missed steps since the counters were last reset
+   */
+  uint32_t getMissedTicks() { return m_missedTicks; }
+  void resetTickCounters();
+  void setSpeed(float speed, float rotateSpeed = 0);
+  void setVelocity(float speed_mm_s, float rotation_deg_s);
+  void setVelocityControl(bool enabled);
+  /*!
+   * \brief Check whether the wheel speeds are held by the velocity loops, see setVelocityControl()
+   * \return true if velocity control is enabled
+   */
+  bool getVelocityControl() { return m_velocityControl; }
+  void setIMUPeriod(float period_ms);
+  void sampleIMU();
+  void setIMUHeading(float heading_deg);
+  float getIMUHeading();
+  bool isIMUStale();
+  void setGains(NavigationLoop loop, const NavigationGains &gains);
+  NavigationGains getGains(NavigationLoop loop);
+  bool setCalibration(const NavigationCalibration &calibration);
+  /*!
+   * \brief The calibration constants in use, see setCalibration()
+   * \return The current calibration
+   */
+  NavigationCalibration getCalibration() { return m_calibration; }
+  static NavigationCalibration defaultCalibration();
+  bool setMotorOutput(const NavigationMotorOutput &output);
+  /*!
+   * \brief The settings of the motor output stage, see setMotorOutput()
+   * \return The current settings
+   */
+  NavigationMotorOutput getMotorOutput() { return m_motorStage; }
+  static NavigationMotorOutput defaultMotorOutput();
+  /*!
+   * \brief The number of motor powers written to DB1 by the output stage, see setMotorOutput()
+   * \return The number of writes since the counters were last reset
+   */
+  uint32_t getMotorWrites() { return m_motorWrites; }
+  /*!
+   * \brief The estimated pose of DB-1, updated every navigation step from the wheel encoders (and the IMU heading if it's enabled)
+   * \return The current estimated pose
+   */
+  NavigationPose getPose() { return m_pose; }
+  void setPose(float x_mm, float y_mm, float heading_deg);
+  /*!
+   * \brief The encoder signals that completed actions went past (or fell short of) their targets by and that couldn't be credited to the action that followed, see docs/performance.rst
+   * \return The signed total in encoder signals, positive when actions went too far
+   */
+  int32_t getEncoderResidual() { return m_encoderResidual; }
+  /*!
+   * \brief Clear the total returned by getEncoderResidual()
+   */
+  void resetEncoderResidual() { m_encoderResidual = 0; }
+  void beginStream(Stream &stream, int lowWater = NAV_QUEUE_CAPACITY / 4);
+  void endStream();
+  /*!
+   * \brief The number of actions queued from the stream since beginStream() was called
+   * \return The number of streamed actions
+   */
+  uint32_t getStreamedActions() { return m_streamActions; }
+  /*!
+   * \brief The number of stream lines that couldn't be queued since beginStream() was called, each one was answered with an E line
+   * \return The number of rejected lines
+   */
+  uint32_t getStreamErrors() { return m_streamErrors; }
+  void runProgram(const uint8_t *program);
+  void stopProgram();
+  /*!
+   * \brief Check whether a program started with runProgram() still has instructions left to queue
+   * \return true if the program is running
+   */
+  bool isProgramRunning() { return m_programNext != NULL; }
+  /*!
+   * \brief Where the last program run with runProgram() was stopped because of an instruction that isn't valid
+   * \return The offset in bytes of that instruction from the start of the program, or -1 if the program had no errors
+   */
+  long getProgramError() { return m_programError; }
+  bool beginRecording(Print &out);
+  void endRecording();
+  /*!
+   * \brief Check whether the navigation is being recorded, see beginRecording()
+   * \return true if a recording is in progress
+   */
+  bool isRecording() { return m_recorder != NULL; }
+#ifdef NAV_INSTRUMENTATION
+  bool getActionStats(int index, NavigationActionStats *stats);
+  uint32_t getStepTimeHistogram(int bucket);
+  void dumpTrace(Print &out);
+  void clearInstrumentation();
+#endif
 
 private:
-  //Internal enum outlining the possible nav actions
-  enum NavigationType {
-    NAV_FORWARD,
-    NAV_TURN,
-    NAV_ROTATE,
-    NAV_STOP,
-    NAV_PEN_UP,
-    NAV_PEN_DOWN,
+#if NAV_QUEUE_CAPACITY < 255
+  typedef uint8_t  NavigationIndex;
+#else
+  typedef uint16_t NavigationIndex;
+#endif
+  static const NavigationIndex NO_ACTION = (NavigationIndex)~0;
+
+  //Curve points are kept in fixed size chunks, linked together when a curve needs more than one
+  static const int NAV_PATH_CHUNK = 4;
+  static const int NAV_PATH_CHUNKS = (NAV_PATH_POINTS + NAV_PATH_CHUNK - 1) / NAV_PATH_CHUNK;
+  typedef uint8_t NavigationChunkIndex;
+#if NAV_STREAM_LINE < 256
+  typedef uint8_t  NavigationLineLength;
+#else
+  typedef uint16_t NavigationLineLength;
+#endif
+  static const NavigationChunkIndex NO_CHUNK = (NavigationChunkIndex)~0;
+#if (NAV_PATH_POINTS + 3) / 4 >= 255
+#error NAV_PATH_POINTS is too large
+#endif
+
+  struct NavigationPathChunk {
+    int16_t x[NAV_PATH_CHUNK];    // tenths of a millimetre
+    int16_t y[NAV_PATH_CHUNK];
+    NavigationChunkIndex next;
+  };
+
+  //Internal flags stored with each action
+  enum NavigationFlags {
+    NAV_CLOCKWISE = 0x01,
   };
 
-  //Internal private struct to represent a nav action
+  //Internal state of each slot of the pool, kept apart from the action so it survives the action being rewritten
+  enum NavigationSlotState {
+    NAV_SLOT_QUEUED = 0x01,   // the slot holds an action linked into the queue
+    NAV_SLOT_STARTED = 0x02,  // the action's start has been reported, so it isn't reported again when it resumes after being suspended
+  };
+
+  //Internal private struct to represent a queued nav action, only the parameters its type needs are stored.
+  //Distances and angles are converted to encoder signal targets when the action is queued
   struct NavigationAction {
+    union {
+      int32_t  ticks;       // NAV_FORWARD, encoder signals
+      struct {
+        uint16_t ticks;     // NAV_TURN, encoder signals travelled by the outside wheel
+        int16_t  ratio;     // NAV_TURN, inside wheel speed relative to the outside wheel, RATIO_ONE is 1.0
+      } turn;
+      struct {
+        uint16_t ticks;     // NAV_ROTATE, encoder signals travelled by each wheel
+        int16_t  angle;     // NAV_ROTATE and NAV_ROTATE_TO, tenths of a degree
+      } rotate;
+      uint32_t time;        // NAV_STOP, milliseconds
+      struct {
+        int16_t x;          // NAV_MOVE_TO and NAV_ARC_TO, tenths of a millimetre
+        int16_t y;
+      } point;
+      struct {
+        NavigationChunkIndex chunk; // NAV_BEZIER and NAV_POLYLINE, the first chunk of points
+        uint8_t  first;     // index of the first point within that chunk
+        uint16_t count;     // number of points, a bezier has its two control points then its end point
+      } path;
+    } params;
+    NavigationIndex prev;
+    NavigationIndex next;
+    uint8_t type;
+    uint8_t flags;
+  };
+  static const int32_t RATIO_ONE = 16384;
+
+  //Internal private struct describing a pen down stroke while the optimiser reorders them, positions are in tenths
+  struct NavigationStroke {
+    NavigationIndex first;    // the pen down action that starts the stroke
+    NavigationIndex last;     // the pen up action that ends it
+    int16_t startX;
+    int16_t startY;
+    int16_t startHeading;
+    int16_t endX;
+    int16_t endY;
+    int16_t endHeading;
+  };
+
+  //Internal private struct holding the state of one control loop
+  struct NavigationControl {
+    float integral;           // output contributed by the integral term
+    float rate;               // filtered rate of change of the error, per second
+    float lastError;
+    bool  primed;             // lastError holds a reading
+  };
+
+  //Internal private struct holding the runtime state of the action currently being performed
+  struct NavigationState {
     NavigationType type;
-    float followSpeed;
-    float progress;
-    float desiredAngle;
-    float finalAngle;
-    float desiredDistance;
-    float desiredRadius;
-    float desiredTime;
-    NavigationAction* prev;
-    NavigationAction* next;
+    uint8_t flags;
+    uint8_t phase;
+    int16_t ratio;            // inside wheel speed relative to the leading wheel, RATIO_ONE is 1.0
+    int32_t progress;         // encoder signals travelled by the leading wheel
+    int32_t target;           // encoder signals the leading wheel needs to travel
+    int32_t finalAngle;       // IMU heading to finish at, hundredths of a degree
+    float   multiplier;       // ratio as a float, applied to the inside wheel power
+    int32_t syncError;        // how far the following wheel is behind where it should be, in encoder signals scaled by RATIO_ONE
+    float   followCorrection; // wheel sync correction last applied to the following wheel
+    NavigationControl sync;
+    NavigationControl heading;
+    float   entrySpeed;
+    float   exitSpeed;
+    float   accelSlope;       // power gained per encoder signal while accelerating
+    float   decelSlope;       // power lost per encoder signal while decelerating
+    float   desiredAngle;
+    float   desiredTime;
+    float   elapsedTime;
+    float   pathX[4];         // NAV_BEZIER control points from where DB-1 started, NAV_POLYLINE start and end of the current segment
+    float   pathY[4];
+    float   pathT;            // how far along the curve the steering point is, 0 to 1 for a bezier, millimetres along the current segment for a polyline
+    float   segmentLength;    // NAV_POLYLINE, length of the current segment in millimetres
+    uint16_t pathIndex;       // NAV_POLYLINE, the point at the end of the current segment
+    bool    pathCorner;       // the steering point is waiting at a sharp corner or the end of the curve
+  };
+
+  //Internal private struct holding an action start or completion until update() passes it to the callbacks
+  struct NavigationEvent {
+    NavigationHandle action;
+    uint8_t type;
+    bool    complete;
   };
 
-  NavigationAction* m_queueHead;
-  NavigationAction* m_queueTail;
-  NavigationAction* makeForwardAction(float distance_mm);
-  NavigationAction* makeTurnAction(float radius_mm, float angle_deg);
-  NavigationAction* makeRotateAction(float angle_deg);
-  NavigationAction* makeStopAction(float time_ms);
-  NavigationAction* makePenAction(bool down);
-  void setupRotationAction(NavigationAction *action);
-  void addActionFront(NavigationAction *action);
-  void addActionBack(NavigationAction *action);
-  bool driveForward(NavigationAction* action);
-  bool turn(NavigationAction* action);
-  bool rotateEnc(NavigationAction* action);
-  bool rotateIMU(NavigationAction* action);
-  bool stop(NavigationAction* action, float deltaTime_ms);
+  NavigationAction m_actionPool[NAV_QUEUE_CAPACITY];
+  uint8_t m_actionGeneration[NAV_QUEUE_CAPACITY]; // moved on each time a slot is released, so handles to the action it held stop matching
+  uint8_t m_actionSpeed[NAV_QUEUE_CAPACITY];      // speed of each queued action in 255ths, 0 for the speed given to setSpeed()
+  uint8_t m_actionState[NAV_QUEUE_CAPACITY];      // NavigationSlotState of each slot
+  NavigationPathChunk  m_pathPool[NAV_PATH_CHUNKS];
+  NavigationChunkIndex m_pathFreeList;
+  NavigationIndex  m_freeList;
+  NavigationIndex  m_queueHead;
+  NavigationIndex  m_queueTail;
+  NavigationState  m_current;
+  bool             m_currentActive;
+  NavigationIndex makeForwardAction(float distance_mm);
+  NavigationIndex makeTurnAction(float radius_mm, float angle_deg);
+  NavigationIndex makeRotateAction(float angle_deg);
+  NavigationIndex makeStopAction(float time_ms);
+  NavigationIndex makePenAction(bool down);
+  NavigationIndex allocateAction(NavigationType type);
+  void releaseAction(NavigationIndex action);
+  NavigationIndex makePathAction(NavigationType type, const float *points_mm, int count);
+  void releasePathChunks(NavigationChunkIndex chunk);
+  bool pathPoint(NavigationIndex action, uint16_t index, float *x, float *y);
+  void setPathPoint(NavigationIndex action, uint16_t index, float x, float y);
+  void dropPathPoints(NavigationIndex action, uint16_t count);
+  NavigationHandle enqueueAction(NavigationIndex action, bool front);
+  NavigationHandle actionHandle(NavigationIndex action);
+  NavigationIndex handleAction(NavigationHandle handle);
+  float actionSpeed(NavigationIndex action, float speed);
+  void detachAction(NavigationIndex action);
+  void abandonAction();
+  void pushEvent(NavigationIndex action, bool complete);
+  void dispatchEvents();
+  void addActionFront(NavigationIndex action);
+  void addActionBack(NavigationIndex action);
+  void removeHeadAction();
+  void unlinkAction(NavigationIndex action);
+  bool isEmptyAction(NavigationIndex action);
+  bool leavesPose(NavigationIndex action, const NavigationPose &pose);
+  bool mergeActions(NavigationIndex first, NavigationIndex second, const NavigationPose *pose);
+  int  removeRedundantActions();
+  float reorderStrokes();
+  void advancePose(NavigationIndex action, NavigationPose *pose, float *travel_mm);
+  void enterCritical();
+  bool isResting();
+  void exitCritical();
+  void step(float stepTime_ms);
+  void beginAction();
+  void suspendAction();
+  void setupRotationAction(NavigationState *action);
+  void setupRelativeRotation(float angle_deg);
+  uint16_t rotationTicks(float angle_deg);
+  bool turnParameters(float radius_mm, float angle_deg, uint16_t *ticks, int16_t *ratio);
+  void setupTurn(uint16_t ticks, int16_t ratio, uint8_t flags);
+  void setupArc(float x_mm, float y_mm);
+  void beginPath();
+  void startPathRun(NavigationState *action);
+  void advancePath(NavigationState *action);
+  void steeringPoint(NavigationState *action, float *x, float *y);
+  bool loadNextSegment(NavigationState *action);
+  void updatePose();
+  void turnPoseHeading(float angle_rad);
+  bool  wheelRatios(NavigationIndex action, float *right, float *left);
+  float actionLength(NavigationIndex action);
+  float junctionSpeed(NavigationIndex from, NavigationIndex to);
+  float planExitSpeed();
+  float profileSpeed(NavigationState *action);
+  bool driveForward(NavigationState* action);
+  bool turn(NavigationState* action);
+  bool rotateEnc(NavigationState* action);
+  bool rotateIMU(NavigationState* action);
+  bool moveTo(NavigationState* action);
+  bool followPath(NavigationState* action);
+  float imuHeading();
+  void serviceStream();
+  bool parseStreamLine();
+  void serviceProgram();
+  bool programInstruction();
+  void carryResidual(NavigationState *action);
+  void resetControllers(NavigationState* action);
+  float runController(NavigationLoop loop, NavigationControl *control, float setpoint, float error);
+  float syncFollowPower(NavigationLoop loop, NavigationState *action, int32_t lead, int32_t follow, float setpoint);
+  float rotationPower(NavigationState *action, float error_deg);
+  bool stop(NavigationState* action, float deltaTime_ms);
+  void setMotorSpeeds(float m1, float m2);
+  void writeMotors();
+  float wheelPower(int wheel, float request, int32_t delta);
+  float minimumSpeed();
+  float filterWeight(float weight);
   bool penUp();
   bool penDown();
+  void storeIMUSample(float heading_deg);
+  void recordFloat(float value);
+  void recordSettings();
+  void recordAction(NavigationType type, bool front, const float *values, int count);
+  void recordStep(int encoderDelta1, int encoderDelta2);
+  void recordHandle(NavigationHandle handle);
 
   int   m_queueSize;
+  int   m_encoderDelta1;
+  int   m_encoderDelta2;
+  float m_motorCommand[2];
+  float m_motorPower[2];        // motor powers after the velocity loops and the slew limit, before deadband compensation
+  float m_motorOutput[2];       // motor powers last written to DB1
+  float m_motorAge_ms[2];       // time since each motor power was last written
+  uint32_t m_motorWrites;
+  NavigationMotorOutput m_motorStage;
+  uint8_t m_stepPen;            // pen written during this step, 1 up, 2 down, 0 unchanged
+  float m_entrySpeed;
+  int32_t m_carry;              // encoder signals the last forward or turn action went past its target by
+  NavigationType m_carryType;
+  uint8_t m_carryFlags;
+  int16_t m_carryRatio;
+  bool    m_headingValid;       // only forward, stop and pen actions have happened since the last rotation finished
+  float   m_rotateCarry;        // degrees DB-1 has turned past the target of the last rotation, anti-clockwise positive
+  int32_t m_encoderResidual;
+
+  Stream *m_stream;
+  char    m_streamLine[NAV_STREAM_LINE];
+  NavigationLineLength m_streamLength;
+  bool    m_streamOverflow;     // the line being received is too long and is being skipped
+  int     m_streamLowWater;
+  int     m_streamCredit;       // actions the sender has been allowed to send but hasn't yet
+  int     m_streamCurveCredit;  // bezier lines the sender has been allowed to send but hasn't yet, one per free chunk of curve points
+  uint32_t m_streamActions;
+  uint32_t m_streamErrors;
+
+  Print  *m_recorder;
+
+  NavigationEvent m_events[NAV_EVENT_QUEUE];
+  uint8_t  m_eventFirst;
+  uint8_t  m_eventCount;
+  uint32_t m_droppedEvents;
+  NavigationActionCallback m_onStart;
+  void    *m_onStartContext;
+  NavigationActionCallback m_onComplete;
+  void    *m_onCompleteContext;
+  NavigationQueueCallback m_onQueueLow;
+  void    *m_onQueueLowContext;
+  int      m_queueLowWater;
+
+  //Internal private struct holding a repeat block of the running program
+  struct NavigationRepeat {
+    const uint8_t *start;       // first instruction of the block
+    uint8_t remaining;          // times the block is still to be performed after the current one
+  };
+  const uint8_t *m_program;
+  const uint8_t *m_programNext; // next instruction to perform, NULL once the program has finished
+  NavigationRepeat m_programRepeats[NAV_PROGRAM_DEPTH];
+  uint8_t m_programDepth;
+  long    m_programError;
+  bool    m_outOfRange;       // the last action asked for had a value too large to store, so it was rejected
   float m_timeBank;
   float m_updateRate_ms;
+  bool  m_fixedTimestep;
+  bool  m_interruptDriven;
+  uint8_t m_criticalDepth;
+  uint32_t m_interruptState;    // whether interrupts were enabled when the outermost critical section was entered
+  uint8_t  m_maxCatchUp;
+  uint32_t m_lateTicks;
+  uint32_t m_missedTicks;
   float m_speed;
-  float m_cp;
+  float m_rotateSpeed;
+  float m_minSpeed;             // slowest speed the actions ask for, SPEED_MIN or VELOCITY_MIN
+  bool  m_velocityControl;
+  NavigationControl m_wheelControl[2];
+  float m_wheelRate[2];         // filtered speed of each wheel measured by its encoder, in mm/s
+  NavigationGains m_gains[NAV_LOOP_COUNT];
+  bool  m_headingGainsSet;      // setGains() has set the heading loop, so setCalibration() leaves its kp alone
+  NavigationCalibration m_calibration;
+  float m_stepTime_ms;
 
   bool  m_useIMU;
+  bool  m_imuOffsetValid;
+  float m_imuOffset;
+  bool  m_imuValid;             // at least one IMU sample has been taken
+  bool  m_imuFresh;             // a sample has arrived since the last one was fused into the pose
+  float m_imuSample;            // heading of the last IMU sample
+  float m_imuExtrapolation;     // degrees turned according to the encoders since the last IMU sample
+  float m_imuPeriod_ms;
+  float m_imuTimer_ms;          // time since the last sample was scheduled
+  unsigned long m_imuSampleTime_ms;
+  float m_headingCos;
+  float m_headingSin;
+  NavigationPose m_pose;
+
+#ifdef NAV_INSTRUMENTATION
+  void recordActionStats();
+  void recordStepTime(unsigned long elapsed_us);
+  void recordTraceSample();
+
+  unsigned long m_actionStart_ms;
+  uint32_t m_actionSteps;
+  float    m_actionPeakCorrection;
+  NavigationActionStats m_stats[NAV_STATS_HISTORY];
+  uint8_t  m_statsNext;
+  uint8_t  m_statsCount;
+  uint32_t m_stepHistogram[NAV_HISTOGRAM_BUCKETS];
+  NavigationTraceSample m_trace[NAV_TRACE_SIZE];
+  uint16_t m_traceNext;
+  uint16_t m_traceCount;
+  bool     m_traceDumping;      // dumpTrace() is reading the buffer, samples aren't added to it
+#endif
 };
 
 #endif
@@ -40,13 +40,15 @@ void loop() {
     //Lift the pen up...
     DB1.setPen(false);
     while(1) {
-      //... and sleep forever
-      delay(10000);
+      //... and sleep forever, with nothing queued idleUntilNeeded never returns
+      nav.idleUntilNeeded();
     }
   }
   else {
     //If there are still actions in the queue then we need to update the Navigation system to process them
     nav.update(deltaTime_ms);
+    //Then sleep until it needs updating again, between steps and through stop actions, to save the battery
+    nav.idleUntilNeeded();
   }
 
   //Remember the current time as the last time for the next cycle
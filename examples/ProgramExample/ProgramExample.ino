@@ -0,0 +1,49 @@
+#include <Drawbotic_DB1.h>
+#include <Drawbotic_Navigation.h>
+
+//Create the navigation system
+Drawbotic_Navigation nav;
+
+//The same octagon as the navigation example, written as a program that is kept in flash
+//Each side is a forward action followed by a rotate action of 360 / 8 degrees, repeated 8 times
+const uint8_t octagon[] PROGMEM = {
+  NAV_PROG_PEN_DOWN,
+  NAV_PROG_REPEAT(8),
+    NAV_PROG_FORWARD(50),
+    NAV_PROG_ROTATE(45),
+  NAV_PROG_LOOP,
+  NAV_PROG_PEN_UP,
+  NAV_PROG_END
+};
+
+//Previous timestamp, used to calculate the time delta
+int last_ms = 0;
+
+void setup() {
+  //Initalise the DB1
+  DB1.init();
+
+  //Start the program, its actions are queued a few at a time as DB-1 needs them
+  nav.runProgram(octagon);
+}
+
+void loop() {
+  //Calculate the delta time (i.e. the elapsed since the last time loop ran)
+  int current_ms = millis();
+  int deltaTime_ms = current_ms - last_ms;
+
+  //Once the program has queued all of its actions and they have been performed the octagon is finished
+  if(!nav.isProgramRunning() && nav.getQueueSize() == 0) {
+    while(1) {
+      //... so sleep forever
+      delay(10000);
+    }
+  }
+  else {
+    //update performs the queued actions and queues more of the program when it runs low
+    nav.update(deltaTime_ms);
+  }
+
+  //Remember the current time as the last time for the next cycle
+  last_ms = current_ms;
+}
@@ -0,0 +1,59 @@
+#include <Drawbotic_DB1.h>
+#include <Drawbotic_Navigation.h>
+
+//Measures how long a single navigation update takes for each type of action.
+//DB-1 will move while this runs, so lift it off the table or give it some room!
+
+Drawbotic_Navigation nav;
+
+//The number of updates to time for each action type
+const int UPDATE_COUNT = 2000;
+
+void setup() {
+  Serial.begin(115200);
+  while(!Serial) {
+    delay(10);
+  }
+
+  //Initalise the DB1 and make sure the pen is up
+  DB1.init();
+  DB1.setPen(false);
+  delay(1000);
+
+  Serial.println("action,us_per_update");
+
+  //Each action is long enough that it won't finish during the measurement
+  nav.addForwardAction(10000);
+  measure("forward");
+
+  nav.addTurnAction(200, 3600);
+  measure("turn");
+
+  nav.addRotateAction(170);
+  measure("rotate");
+
+  nav.addStopAction(1000000);
+  measure("stop");
+}
+
+void measure(const char* name) {
+  unsigned long start = micros();
+  for (int i = 0; i < UPDATE_COUNT; i++) {
+    //A delta time of at least the update rate means every call performs a full navigation step
+    nav.update(1.0f);
+  }
+  unsigned long elapsed = micros() - start;
+
+  //Stop the robot before measuring the next action type
+  nav.clearAllActions();
+  DB1.setMotorSpeed(1, 0);
+  DB1.setMotorSpeed(2, 0);
+  delay(500);
+
+  Serial.print(name);
+  Serial.print(",");
+  Serial.println((float)elapsed / UPDATE_COUNT);
+}
+
+void loop() {
+}
@@ -0,0 +1,387 @@
+// Microbenchmarks of the navigation queue operations and of update() for each action type, timed on the host against
+// the simulator's DB1 stand-in with its model replaced by fixed inputs. Results are written as JSON. See README.md
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+
+struct BenchOptions {
+  long   ops;             // actions queued by the queue benchmarks, at most the queue capacity
+  long   ticks;           // calls to update() timed by the update benchmarks
+  int    reps;
+  bool   text;
+  const char *out;        // file the JSON is written to, or NULL for standard output
+  const char *baseline;   // JSON from an earlier run to compare against, or NULL
+  double threshold;       // percentage slowdown against the baseline that counts as a regression
+  std::vector<const char *> only;
+};
+
+struct BenchResult {
+  const char *name;
+  long   ops;
+  double median_ns;       // per operation
+  double best_ns;
+  bool   valid;           // an update benchmark's action was still running when the timing finished
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsedNs(Clock::time_point start) {
+  return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+// Deterministic shuffle, so every run cancels the actions in the same order
+static void shuffle(std::vector<NavigationHandle> &handles) {
+  uint32_t rng = 2463534242u;
+  for (size_t i = handles.size(); i > 1; i--) {
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    std::swap(handles[i - 1], handles[rng % i]);
+  }
+}
+
+static long queueOps(Drawbotic_Navigation &nav, const BenchOptions &options) {
+  long capacity = nav.getQueueCapacity();
+  return options.ops < capacity ? options.ops : capacity;
+}
+
+static void fill(Drawbotic_Navigation &nav, long count, std::vector<NavigationHandle> *handles) {
+  for (long i = 0; i < count; i++) {
+    NavigationHandle handle = nav.addForwardAction(100);
+    if (handles)
+      handles->push_back(handle);
+  }
+}
+
+// Each queue benchmark is given a fresh instance, does its setup untimed, and returns the time taken by *ops operations
+typedef double (*QueueBench)(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops);
+
+static double benchEnqueueBack(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops) {
+  *ops = queueOps(nav, options);
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < *ops; i++)
+    nav.addForwardAction(100);
+  return elapsedNs(start);
+}
+
+static double benchEnqueueFront(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops) {
+  *ops = queueOps(nav, options);
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < *ops; i++)
+    nav.addForwardAction(100, true);
+  return elapsedNs(start);
+}
+
+static double benchDequeue(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops) {
+  *ops = queueOps(nav, options);
+  fill(nav, *ops, NULL);
+  Clock::time_point start = Clock::now();
+  while (nav.cancelAction(nav.getCurrentAction())) {
+  }
+  return elapsedNs(start);
+}
+
+static double benchCancelRandom(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops) {
+  *ops = queueOps(nav, options);
+  std::vector<NavigationHandle> handles;
+  fill(nav, *ops, &handles);
+  shuffle(handles);
+  Clock::time_point start = Clock::now();
+  for (size_t i = 0; i < handles.size(); i++)
+    nav.cancelAction(handles[i]);
+  return elapsedNs(start);
+}
+
+static double benchClear(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops) {
+  *ops = queueOps(nav, options);
+  fill(nav, *ops, NULL);
+  Clock::time_point start = Clock::now();
+  nav.clearAllActions();
+  return elapsedNs(start);
+}
+
+static double benchComplete(Drawbotic_Navigation &nav, const BenchOptions &options, long *ops) {
+  // zero length stops finish on their first step, so each update starts, performs and removes one action
+  *ops = queueOps(nav, options);
+  for (long i = 0; i < *ops; i++)
+    nav.addStopAction(0);
+  Clock::time_point start = Clock::now();
+  for (long i = 0; i < *ops; i++)
+    nav.update(1.0f);
+  return elapsedNs(start);
+}
+
+struct QueueBenchmark {
+  const char *name;
+  QueueBench run;
+};
+
+static const QueueBenchmark queueBenchmarks[] = {
+  { "enqueue_back", benchEnqueueBack },
+  { "enqueue_front", benchEnqueueFront },
+  { "dequeue", benchDequeue },
+  { "cancel_random", benchCancelRandom },
+  { "clear", benchClear },
+  { "update_complete", benchComplete },
+};
+
+// Each update benchmark queues one action too long to finish while it is timed, and reads the same encoder deltas every step
+struct UpdateBenchmark {
+  const char *name;
+  bool useIMU;
+  bool velocity;
+  int  m1Delta;
+  int  m2Delta;
+  void (*queue)(Drawbotic_Navigation &nav);
+};
+
+static void queueForward(Drawbotic_Navigation &nav) { nav.addForwardAction(10000); }
+static void queueTurn(Drawbotic_Navigation &nav) { nav.addTurnAction(200, 3000); }
+static void queueRotate(Drawbotic_Navigation &nav) { nav.addRotateAction(3000); }
+static void queueStop(Drawbotic_Navigation &nav) { nav.addStopAction(1e9f); }
+static void queueMoveTo(Drawbotic_Navigation &nav) { nav.addMoveToAction(3000, 0); }
+static void queueBezier(Drawbotic_Navigation &nav) { nav.addBezierAction(1000, 0, 2000, 0, 3000, 0); }
+static void queuePolyline(Drawbotic_Navigation &nav) {
+  const float points[] = { 1000, 0, 2000, 0, 3000, 0 };
+  nav.addPolylineAction(points, 3);
+}
+static void queueNothing(Drawbotic_Navigation &) {}
+
+static const UpdateBenchmark updateBenchmarks[] = {
+  { "update_forward", false, false, 1, 1, queueForward },
+  { "update_forward_velocity", false, true, 1, 1, queueForward },
+  { "update_turn", false, false, 1, 1, queueTurn },
+  { "update_rotate_enc", false, false, 1, -1, queueRotate },
+  { "update_rotate_imu", true, false, 1, -1, queueRotate },
+  { "update_stop", false, false, 0, 0, queueStop },
+  { "update_move_to", false, false, 1, 1, queueMoveTo },
+  { "update_bezier", false, false, 1, 1, queueBezier },
+  { "update_polyline", false, false, 1, 1, queuePolyline },
+  { "update_empty", false, false, 0, 0, queueNothing },
+};
+
+static bool selected(const BenchOptions &options, const char *name) {
+  if (options.only.empty())
+    return true;
+  for (size_t i = 0; i < options.only.size(); i++) {
+    if (strcmp(options.only[i], name) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Keep the median and best time per operation over the repetitions, after one run to warm the caches
+static void summarise(std::vector<double> &times, long ops, BenchResult *result) {
+  std::sort(times.begin(), times.end());
+  result->ops = ops;
+  result->best_ns = ops > 0 ? times.front() / ops : 0;
+  result->median_ns = ops > 0 ? times[times.size() / 2] / ops : 0;
+}
+
+static BenchResult runQueueBenchmark(const QueueBenchmark &bench, const BenchOptions &options) {
+  BenchResult result;
+  result.name = bench.name;
+  result.valid = true;
+  std::vector<double> times;
+  long ops = 0;
+  for (int rep = 0; rep <= options.reps; rep++) {
+    DB1.simReset();
+    DB1.simStub(true);
+    // the pool is part of the instance, large enough at 10,000 actions not to belong on the stack
+    Drawbotic_Navigation *nav = new Drawbotic_Navigation(false);
+    double time = bench.run(*nav, options, &ops);
+    if (rep > 0)
+      times.push_back(time);
+    delete nav;
+  }
+  summarise(times, ops, &result);
+  return result;
+}
+
+static BenchResult runUpdateBenchmark(const UpdateBenchmark &bench, const BenchOptions &options) {
+  BenchResult result;
+  result.name = bench.name;
+  result.valid = true;
+  std::vector<double> times;
+  for (int rep = 0; rep <= options.reps; rep++) {
+    DB1.simReset();
+    DB1.simStub(true, bench.m1Delta, bench.m2Delta);
+    Drawbotic_Navigation *nav = new Drawbotic_Navigation(bench.useIMU);
+    nav->setVelocityControl(bench.velocity);
+    bench.queue(*nav);
+    int queued = nav->getQueueSize();
+    // the first step unpacks the action, after that every step performs it
+    nav->update(1.0f);
+
+    Clock::time_point start = Clock::now();
+    for (long i = 0; i < options.ticks; i++)
+      nav->update(1.0f);
+    double time = elapsedNs(start);
+    if (rep > 0)
+      times.push_back(time);
+    result.valid &= nav->getQueueSize() == queued;
+    delete nav;
+  }
+  summarise(times, options.ticks, &result);
+  return result;
+}
+
+static void writeJson(FILE *out, const std::vector<BenchResult> &results, const BenchOptions &options) {
+  Drawbotic_Navigation *nav = new Drawbotic_Navigation();
+  fprintf(out, "{\n");
+  fprintf(out, "  \"tool\": \"nav_bench\",\n");
+  fprintf(out, "  \"format\": 1,\n");
+  fprintf(out, "  \"record_version\": %d,\n", NAV_RECORD_VERSION);
+  fprintf(out, "  \"queue_capacity\": %d,\n", nav->getQueueCapacity());
+  fprintf(out, "  \"ops\": %ld,\n", options.ops);
+  fprintf(out, "  \"ticks\": %ld,\n", options.ticks);
+  fprintf(out, "  \"repetitions\": %d,\n", options.reps);
+#ifdef NAV_INSTRUMENTATION
+  fprintf(out, "  \"instrumentation\": true,\n");
+#else
+  fprintf(out, "  \"instrumentation\": false,\n");
+#endif
+#ifdef __VERSION__
+  fprintf(out, "  \"compiler\": \"%s\",\n", __VERSION__);
+#endif
+  fprintf(out, "  \"results\": [\n");
+  // one result per line, which is all --baseline needs to read them back
+  for (size_t i = 0; i < results.size(); i++) {
+    const BenchResult &r = results[i];
+    fprintf(out, "    {\"name\": \"%s\", \"ops\": %ld, \"ns_per_op\": %.3f, \"best_ns_per_op\": %.3f, \"valid\": %s}%s\n", r.name, r.ops,
+            r.median_ns, r.best_ns, r.valid ? "true" : "false", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(out, "  ]\n}\n");
+  delete nav;
+}
+
+// Read the best times per operation back from a file written by writeJson()
+static bool readBaseline(const char *path, std::vector<std::string> *names, std::vector<double> *times) {
+  FILE *in = fopen(path, "r");
+  if (!in)
+    return false;
+  char line[512];
+  while (fgets(line, sizeof(line), in)) {
+    const char *name = strstr(line, "\"name\": \"");
+    const char *time = strstr(line, "\"best_ns_per_op\": ");
+    if (!name || !time)
+      continue;
+    name += strlen("\"name\": \"");
+    const char *end = strchr(name, '"');
+    if (!end)
+      continue;
+    names->push_back(std::string(name, end - name));
+    times->push_back(atof(time + strlen("\"best_ns_per_op\": ")));
+  }
+  fclose(in);
+  return true;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [--ops n] [--ticks n] [--reps n] [--text] [--out file] [--baseline file] [--threshold percent] [benchmark...]\n", name);
+}
+
+int main(int argc, char **argv) {
+  BenchOptions options;
+  options.ops = 10000;
+  options.ticks = 5000;
+  options.reps = 15;
+  options.text = false;
+  options.out = NULL;
+  options.baseline = NULL;
+  options.threshold = 10;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+      options.ops = atol(argv[++i]);
+    else if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc)
+      options.ticks = atol(argv[++i]);
+    else if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc)
+      options.reps = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--text") == 0)
+      options.text = true;
+    else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+      options.out = argv[++i];
+    else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc)
+      options.baseline = argv[++i];
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      options.threshold = atof(argv[++i]);
+    else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    }
+    else
+      options.only.push_back(argv[i]);
+  }
+  if (options.ops < 1)
+    options.ops = 1;
+  if (options.ticks < 1)
+    options.ticks = 1;
+  if (options.reps < 1)
+    options.reps = 1;
+
+  std::vector<BenchResult> results;
+  for (size_t i = 0; i < sizeof(queueBenchmarks) / sizeof(queueBenchmarks[0]); i++) {
+    if (selected(options, queueBenchmarks[i].name))
+      results.push_back(runQueueBenchmark(queueBenchmarks[i], options));
+  }
+  for (size_t i = 0; i < sizeof(updateBenchmarks) / sizeof(updateBenchmarks[0]); i++) {
+    if (selected(options, updateBenchmarks[i].name))
+      results.push_back(runUpdateBenchmark(updateBenchmarks[i], options));
+  }
+
+  if (options.text) {
+    printf("%-26s %8s %12s %12s\n", "benchmark", "ops", "ns/op", "best_ns/op");
+    for (size_t i = 0; i < results.size(); i++)
+      printf("%-26s %8ld %12.2f %12.2f%s\n", results[i].name, results[i].ops, results[i].median_ns, results[i].best_ns,
+             results[i].valid ? "" : "  FINISHED EARLY");
+  }
+  if (options.out || !options.text) {
+    FILE *out = options.out ? fopen(options.out, "w") : stdout;
+    if (!out) {
+      fprintf(stderr, "can't write %s\n", options.out);
+      return 2;
+    }
+    writeJson(out, results, options);
+    if (options.out)
+      fclose(out);
+  }
+
+  int status = 0;
+  for (size_t i = 0; i < results.size(); i++) {
+    if (!results[i].valid) {
+      fprintf(stderr, "%s: the action finished while it was being timed, increase its length or reduce --ticks\n", results[i].name);
+      status = 1;
+    }
+  }
+
+  // Compare the best times with an earlier run, anything slower by more than the threshold is a regression. The best
+  // time is used because the median moves with whatever else the machine is doing
+  if (options.baseline) {
+    std::vector<std::string> names;
+    std::vector<double> times;
+    if (!readBaseline(options.baseline, &names, &times)) {
+      fprintf(stderr, "can't read %s\n", options.baseline);
+      return 2;
+    }
+    for (size_t i = 0; i < results.size(); i++) {
+      for (size_t j = 0; j < names.size(); j++) {
+        if (names[j] != results[i].name || times[j] <= 0)
+          continue;
+        double change = (results[i].best_ns / times[j] - 1) * 100;
+        bool regressed = change > options.threshold;
+        fprintf(stderr, "%-26s %10.2f -> %10.2f ns/op %+7.1f%%%s\n", results[i].name, times[j], results[i].best_ns, change,
+                regressed ? "  REGRESSION" : "");
+        if (regressed)
+          status = 1;
+      }
+    }
+  }
+  return status;
+}
@@ -0,0 +1,1121 @@
+// Host command line tool that compiles SVG paths or polyline files into programs for
+// Drawbotic_Navigation::runProgram(), as a C++ header or as the raw program bytes. See README.md
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+
+struct Point {
+  double x;
+  double y;
+};
+typedef std::vector<Point> Stroke;
+
+struct Pose {
+  double x;
+  double y;
+  double heading;   // radians anti-clockwise from the x axis
+};
+
+struct CompileOptions {
+  double      scale;        // millimetres per unit of the input
+  double      offsetX;      // added to every point after scaling, in millimetres
+  double      offsetY;
+  double      flatness;     // largest distance between a curve and the lines it is drawn with, in millimetres
+  double      minRadius;    // tightest turn used to round off a corner, in millimetres
+  double      maxBend;      // sharpest corner rounded off with a turn rather than taken with a rotation, in radians
+  double      tolerance;    // largest distance a rounded off corner may cut inside the corner point, in millimetres
+  int         jobs;
+  bool        binary;
+  const char *name;
+};
+
+// One program instruction with its numbers as they are stored, in tenths
+struct Instruction {
+  uint8_t op;
+  int16_t a;
+  int16_t b;
+
+  bool operator==(const Instruction &o) const { return op == o.op && a == o.a && b == o.b; }
+};
+
+// The pen down part of a drawing, converted on its own so strokes can be converted in parallel
+struct StrokeProgram {
+  std::vector<Instruction> instructions;
+  Pose    start;          // where the stroke's actions expect DB-1 to be when they start
+  Pose    end;            // where they leave it
+  size_t  points;
+  size_t  actions;
+  bool    empty;
+};
+
+static const double TENTH = 0.1;
+static const double DEG = M_PI / 180.0;
+
+static double wrapRadians(double angle) {
+  while (angle > M_PI)
+    angle -= 2 * M_PI;
+  while (angle <= -M_PI)
+    angle += 2 * M_PI;
+  return angle;
+}
+
+static int16_t tenths(double value) {
+  double t = value * 10.0;
+  if (t >= 32767.0)
+    return 32767;
+  if (t <= -32767.0)
+    return -32767;
+  return (int16_t)(t < 0 ? t - 0.5 : t + 0.5);
+}
+
+// Move a pose the way the robot moves for each action, using the values as they are stored in the program
+static void moveForward(Pose *pose, int16_t distance) {
+  pose->x += distance * TENTH * cos(pose->heading);
+  pose->y += distance * TENTH * sin(pose->heading);
+}
+
+static void moveTurn(Pose *pose, int16_t radius, int16_t angle) {
+  // the centre of the turn is radius to the left of DB-1 for an anti-clockwise turn, and to the right for a clockwise one
+  double r = radius * TENTH * (angle < 0 ? -1 : 1);
+  double a = angle * TENTH * DEG;
+  double cx = pose->x - r * sin(pose->heading);
+  double cy = pose->y + r * cos(pose->heading);
+  pose->heading = wrapRadians(pose->heading + a);
+  pose->x = cx + r * sin(pose->heading);
+  pose->y = cy - r * cos(pose->heading);
+}
+
+static void moveRotate(Pose *pose, int16_t angle) {
+  pose->heading = wrapRadians(pose->heading + angle * TENTH * DEG);
+}
+
+// Append a forward instruction, joined onto the forward before it if nothing has turned DB-1 in between, and split into
+// pieces that fit in the 16 bit distance
+static void emitForward(std::vector<Instruction> &out, Pose *pose, double distance, size_t *actions) {
+  while (distance >= 0.05) {
+    bool join = !out.empty() && out.back().op == NAV_OP_FORWARD && out.back().a < 30000;
+    double room = join ? 3000.0 - out.back().a * TENTH : 3000.0;
+    Instruction in = { NAV_OP_FORWARD, tenths(distance < room ? distance : room), 0 };
+    if (in.a == 0)
+      break;
+    if (join)
+      out.back().a += in.a;
+    else {
+      out.push_back(in);
+      (*actions)++;
+    }
+    moveForward(pose, in.a);
+    distance -= in.a * TENTH;
+  }
+}
+
+static void emitRotate(std::vector<Instruction> &out, Pose *pose, double angle, size_t *actions) {
+  Instruction in = { NAV_OP_ROTATE, tenths(wrapRadians(angle) / DEG), 0 };
+  if (in.a == 0)
+    return;
+  out.push_back(in);
+  moveRotate(pose, in.a);
+  (*actions)++;
+}
+
+// The turn() geometry: the outside wheel, BOT_RADIUS from the centre line, travels at most 65535 encoder signals
+static double largestTurnRadius(double angle) {
+  double radius = 65535.0 / (ENC_BITS_P_MM * fabs(angle) * L_TURN_ERROR) - BOT_RADIUS;
+  return radius < 3000.0 ? radius : 3000.0;
+}
+
+// The single forward or turn action that takes DB-1 from its pose through points first to last, as they would be stored.
+// Returns false if there isn't one that passes within the tolerance of every point and never strays further than that
+// from the lines between them
+static bool fitAction(const Pose &pose, const Point *p, size_t first, size_t last, const CompileOptions &options,
+                      Instruction *in, Pose *end) {
+  double c = cos(pose.heading);
+  double s = sin(pose.heading);
+  double ahead = (p[last].x - pose.x) * c + (p[last].y - pose.y) * s;
+  double left = (p[last].y - pose.y) * c - (p[last].x - pose.x) * s;
+  if (ahead <= 0)
+    return false;
+
+  // the circle that touches the current heading and passes through the last point, the turn is twice the angle to it
+  double angle = 2 * atan2(left, ahead);
+  double radius = left != 0 ? (ahead * ahead + left * left) / (2 * fabs(left)) : 1e9;
+  *end = pose;
+  if (radius > largestTurnRadius(angle)) {
+    // too gentle to store as a turn, so it has to be close enough to a straight line
+    in->op = NAV_OP_FORWARD;
+    in->a = tenths(ahead);
+    in->b = 0;
+    if (ahead > 3000.0)
+      return false;
+    moveForward(end, in->a);
+    for (size_t k = first + 1; k < last; k++) {
+      double along = (p[k].x - pose.x) * c + (p[k].y - pose.y) * s;
+      double across = (p[k].y - pose.y) * c - (p[k].x - pose.x) * s;
+      if (along < 0 || along > ahead || fabs(across) > options.tolerance)
+        return false;
+    }
+  }
+  else {
+    in->op = NAV_OP_TURN;
+    in->a = tenths(radius);
+    in->b = tenths(angle / DEG);
+    if (radius < options.minRadius || in->b == 0)
+      return false;
+    // a turn can't start off with a corner sharper than a rotation would be used for
+    double bearing = atan2((p[first + 1].y - pose.y) * c - (p[first + 1].x - pose.x) * s, (p[first + 1].x - pose.x) * c + (p[first + 1].y - pose.y) * s);
+    if (fabs(bearing) > options.maxBend / 2)
+      return false;
+    moveTurn(end, in->a, in->b);
+
+    // every point on the circle in order along the turn, and no line between them further from the turn than the tolerance
+    double r = in->a * TENTH;
+    double side = in->b < 0 ? -1 : 1;
+    double cx = pose.x - side * r * s;
+    double cy = pose.y + side * r * c;
+    double start = atan2(pose.y - cy, pose.x - cx);
+    double swept = 0;
+    double lastX = pose.x, lastY = pose.y;
+    for (size_t k = first + 1; k <= last; k++) {
+      if (fabs(hypot(p[k].x - cx, p[k].y - cy) - r) > options.tolerance)
+        return false;
+      double around = side * wrapRadians(atan2(p[k].y - cy, p[k].x - cx) - start);
+      if (around < 0)
+        around += 2 * M_PI;
+      double chord = hypot(p[k].x - lastX, p[k].y - lastY);
+      if (around < swept || chord * chord / (8 * r) > options.tolerance)
+        return false;
+      swept = around;
+      lastX = p[k].x;
+      lastY = p[k].y;
+    }
+  }
+  // the next action starts from wherever this one really finishes, so it has to finish much closer to the last point than the
+  // tolerance for the errors not to add up
+  return hypot(end->x - p[last].x, end->y - p[last].y) <= options.tolerance / 4;
+}
+
+// Fold runs of up to eight instructions that repeat straight after themselves into repeat blocks
+static std::vector<Instruction> foldRepeats(const std::vector<Instruction> &in) {
+  std::vector<Instruction> out;
+  size_t i = 0;
+  while (i < in.size()) {
+    size_t bestLength = 1;
+    size_t bestCount = 1;
+    for (size_t length = 1; length <= 8 && i + length * 2 <= in.size(); length++) {
+      size_t count = 1;
+      while (count < 255 && i + length * (count + 1) <= in.size() &&
+             std::equal(in.begin() + i, in.begin() + i + length, in.begin() + i + length * count))
+        count++;
+      if (count > 1 && length * (count - 1) > bestLength * (bestCount - 1)) {
+        bestLength = length;
+        bestCount = count;
+      }
+    }
+
+    // a repeat block costs two bytes and a loop byte, only worth it if it saves more than that
+    if (bestCount > 1 && bestLength * (bestCount - 1) >= 2) {
+      Instruction repeat = { NAV_OP_REPEAT, (int16_t)bestCount, 0 };
+      Instruction loop = { NAV_OP_LOOP, 0, 0 };
+      out.push_back(repeat);
+      out.insert(out.end(), in.begin() + i, in.begin() + i + bestLength);
+      out.push_back(loop);
+      i += bestLength * bestCount;
+    }
+    else
+      out.push_back(in[i++]);
+  }
+  return out;
+}
+
+// Convert the points of a stroke into forward, turn and rotate actions. Each action covers as many points as it can, so
+// curves become a few turns, and corners that can't be followed with a turn are taken with a rotation
+static StrokeProgram convertStroke(const Stroke &stroke, const CompileOptions &options) {
+  StrokeProgram result;
+  result.points = stroke.size();
+  result.actions = 0;
+  result.empty = true;
+
+  // drop repeated points
+  Stroke p;
+  for (size_t i = 0; i < stroke.size(); i++) {
+    if (p.empty() || hypot(stroke[i].x - p.back().x, stroke[i].y - p.back().y) >= 0.05)
+      p.push_back(stroke[i]);
+  }
+  if (p.size() < 2)
+    return result;
+
+  // start off along the line to the second point, or along the curve if the first corner is a gentle one
+  size_t n = p.size();
+  Pose pose = { p[0].x, p[0].y, atan2(p[1].y - p[0].y, p[1].x - p[0].x) };
+  if (n > 2) {
+    double bend = wrapRadians(atan2(p[2].y - p[1].y, p[2].x - p[1].x) - pose.heading);
+    if (fabs(bend) <= options.maxBend)
+      pose.heading = wrapRadians(pose.heading - bend / 2);
+  }
+  // every rotation and turn is a whole number of tenths of a degree, so DB-1 can only face this way exactly if it is one too
+  pose.heading = tenths(pose.heading / DEG) * TENTH * DEG;
+  result.start = pose;
+
+  std::vector<Instruction> &out = result.instructions;
+  bool faced = false;
+  size_t i = 0;
+  while (i + 1 < n) {
+    // the action from here that covers the most points, looking at most 256 points ahead
+    Instruction best;
+    Pose bestEnd;
+    size_t bestLast = i;
+    for (size_t j = i + 1; j < n && j <= i + 256; j++) {
+      Instruction in;
+      Pose end;
+      if (!fitAction(pose, &p[0], i, j, options, &in, &end))
+        break;
+      best = in;
+      bestEnd = end;
+      bestLast = j;
+    }
+
+    if (bestLast > i) {
+      if (best.op == NAV_OP_FORWARD && !out.empty() && out.back().op == NAV_OP_FORWARD && out.back().a + best.a <= 30000)
+        out.back().a += best.a;   // a straight line carrying on after a rounded corner point
+      else {
+        out.push_back(best);
+        result.actions++;
+      }
+      pose = bestEnd;
+      i = bestLast;
+      faced = false;
+    }
+    else if (!faced) {
+      // a corner, face the next point and try again
+      emitRotate(out, &pose, atan2(p[i + 1].y - pose.y, p[i + 1].x - pose.x) - pose.heading, &result.actions);
+      faced = true;
+    }
+    else {
+      // even facing it the next point can't be reached within the tolerance, usually because it's too close to round off to
+      emitForward(out, &pose, hypot(p[i + 1].x - pose.x, p[i + 1].y - pose.y), &result.actions);
+      i++;
+      faced = false;
+    }
+  }
+  result.end = pose;
+  result.instructions = foldRepeats(result.instructions);
+  result.empty = false;
+  return result;
+}
+
+// Converts strokes on a pool of worker threads, a batch at a time, and hands the results back in the order they were read
+class StrokePipeline {
+public:
+  struct Batch {
+    std::vector<Stroke> strokes;
+    std::vector<StrokeProgram> programs;
+    bool done;
+  };
+
+  StrokePipeline(const CompileOptions &options) : m_options(options), m_finished(false) {
+    for (int i = 0; i < options.jobs; i++)
+      m_workers.push_back(std::thread(&StrokePipeline::work, this));
+  }
+
+  ~StrokePipeline() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_finished = true;
+    }
+    m_ready.notify_all();
+    for (size_t i = 0; i < m_workers.size(); i++)
+      m_workers[i].join();
+    for (size_t i = 0; i < m_batches.size(); i++)
+      delete m_batches[i];
+  }
+
+  // Queue a batch for conversion
+  void push(std::vector<Stroke> &strokes) {
+    Batch *batch = new Batch();
+    batch->strokes.swap(strokes);
+    batch->done = false;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_batches.push_back(batch);
+    m_pending.push_back(batch);
+    m_ready.notify_one();
+  }
+
+  // Enough batches are in flight to keep every worker busy
+  bool full() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_batches.size() >= m_workers.size() * 4;
+  }
+
+  // The oldest batch, if it has been converted or after waiting for it to be, or NULL if none are in flight. Delete it once done with it
+  Batch *pop(bool wait) {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (wait)
+      m_done.wait(lock, [this] { return m_batches.empty() || m_batches.front()->done; });
+    if (m_batches.empty() || !m_batches.front()->done)
+      return NULL;
+    Batch *batch = m_batches.front();
+    m_batches.pop_front();
+    return batch;
+  }
+
+private:
+  void work() {
+    for (;;) {
+      Batch *batch;
+      {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_ready.wait(lock, [this] { return m_finished || !m_pending.empty(); });
+        if (m_pending.empty())
+          return;
+        batch = m_pending.front();
+        m_pending.pop_front();
+      }
+      batch->programs.resize(batch->strokes.size());
+      for (size_t i = 0; i < batch->strokes.size(); i++)
+        batch->programs[i] = convertStroke(batch->strokes[i], m_options);
+      {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        batch->done = true;
+      }
+      m_done.notify_all();
+    }
+  }
+
+  const CompileOptions &m_options;
+  std::vector<std::thread> m_workers;
+  std::deque<Batch *> m_batches;    // every batch in flight, oldest first
+  std::deque<Batch *> m_pending;    // batches waiting for a worker
+  std::mutex m_mutex;
+  std::condition_variable m_ready;
+  std::condition_variable m_done;
+  bool m_finished;
+};
+
+// Writes the program as it is produced, joining the strokes together with pen up travel
+class ProgramWriter {
+public:
+  ProgramWriter(FILE *out, const CompileOptions &options) : m_out(out), m_options(options), m_penDown(true), m_bytes(0),
+                                                            m_actions(0), m_strokes(0), m_points(0), m_depth(0) {
+    m_pose.x = 0;
+    m_pose.y = 0;
+    m_pose.heading = 0;
+    if (!m_options.binary)
+      fprintf(m_out, "// Generated by nav_compile, run with Drawbotic_Navigation::runProgram()\n#include <Drawbotic_Navigation.h>\n\n"
+                     "const uint8_t %s[] PROGMEM = {\n", m_options.name);
+    // the pen might be down when the program starts
+    pen(false);
+  }
+
+  void stroke(const StrokeProgram &stroke) {
+    m_points += stroke.points;
+    if (stroke.empty)
+      return;
+    m_strokes++;
+
+    std::vector<Instruction> travel;
+    size_t actions = 0;
+    if (hypot(stroke.start.x - m_pose.x, stroke.start.y - m_pose.y) >= 0.05)
+      pen(false);
+    // rounding the direction of a long move leaves DB-1 to one side of where it was going, so long moves stop short, lined
+    // up with the start of the stroke, and finish with a short move that puts it back on target
+    if (hypot(stroke.start.x - m_pose.x, stroke.start.y - m_pose.y) > 50.0)
+      travelTo(travel, stroke.start.x - 20.0 * cos(stroke.start.heading), stroke.start.y - 20.0 * sin(stroke.start.heading), &actions);
+    travelTo(travel, stroke.start.x, stroke.start.y, &actions);
+    emitRotate(travel, &m_pose, stroke.start.heading - m_pose.heading, &actions);
+    write(travel);
+    pen(true);
+    write(stroke.instructions);
+    m_actions += actions + stroke.actions;
+
+    // the stroke was converted as if it started exactly where it should, carry on from wherever the travel really left DB-1
+    double turned = m_pose.heading - stroke.start.heading;
+    double ex = stroke.end.x - stroke.start.x;
+    double ey = stroke.end.y - stroke.start.y;
+    m_pose.x += ex * cos(turned) - ey * sin(turned);
+    m_pose.y += ex * sin(turned) + ey * cos(turned);
+    m_pose.heading = wrapRadians(stroke.end.heading + turned);
+  }
+
+  void finish() {
+    pen(false);
+    emit(NAV_OP_END, 0, 0);
+    if (!m_options.binary)
+      fprintf(m_out, "};\n");
+    fprintf(stderr, "%lu points in %lu strokes, %lu actions in a program of %lu bytes, finishing at %.1f, %.1f facing %.1f degrees\n",
+            (unsigned long)m_points, (unsigned long)m_strokes, (unsigned long)m_actions, (unsigned long)m_bytes,
+            m_pose.x, m_pose.y, m_pose.heading / DEG);
+  }
+
+private:
+  void travelTo(std::vector<Instruction> &travel, double x, double y, size_t *actions) {
+    double dx = x - m_pose.x;
+    double dy = y - m_pose.y;
+    if (hypot(dx, dy) < 0.05)
+      return;
+    emitRotate(travel, &m_pose, atan2(dy, dx) - m_pose.heading, actions);
+    emitForward(travel, &m_pose, dx * cos(m_pose.heading) + dy * sin(m_pose.heading), actions);
+  }
+
+  void pen(bool down) {
+    if (m_penDown == down)
+      return;
+    emit(down ? NAV_OP_PEN_DOWN : NAV_OP_PEN_UP, 0, 0);
+    m_penDown = down;
+    m_actions++;
+  }
+
+  void write(const std::vector<Instruction> &instructions) {
+    for (size_t i = 0; i < instructions.size(); i++)
+      emit(instructions[i].op, instructions[i].a, instructions[i].b);
+  }
+
+  void emit(uint8_t op, int16_t a, int16_t b) {
+    int words = 0;
+    const char *text = NULL;
+    switch (op) {
+    case NAV_OP_FORWARD:  words = 1; text = "NAV_PROG_FORWARD"; break;
+    case NAV_OP_TURN:     words = 2; text = "NAV_PROG_TURN"; break;
+    case NAV_OP_ROTATE:   words = 1; text = "NAV_PROG_ROTATE"; break;
+    case NAV_OP_PEN_UP:   text = "NAV_PROG_PEN_UP"; break;
+    case NAV_OP_PEN_DOWN: text = "NAV_PROG_PEN_DOWN"; break;
+    case NAV_OP_REPEAT:   text = "NAV_PROG_REPEAT"; break;
+    case NAV_OP_LOOP:     text = "NAV_PROG_LOOP"; break;
+    case NAV_OP_END:      text = "NAV_PROG_END"; break;
+    }
+
+    if (op == NAV_OP_LOOP && m_depth > 0)
+      m_depth--;
+    // a repeat count is a single byte, every other number is two
+    size_t size = op == NAV_OP_REPEAT ? 2 : 1 + words * 2;
+    if (m_options.binary) {
+      uint8_t bytes[5] = { op, (uint8_t)((uint16_t)a & 0xFF), (uint8_t)((uint16_t)a >> 8), (uint8_t)((uint16_t)b & 0xFF), (uint8_t)((uint16_t)b >> 8) };
+      fwrite(bytes, 1, size, m_out);
+    }
+    else {
+      fprintf(m_out, "  %*s%s", m_depth * 2, "", text);
+      if (op == NAV_OP_REPEAT)
+        fprintf(m_out, "(%d)", a);
+      else if (words == 1)
+        fprintf(m_out, "(%.1f)", a * TENTH);
+      else if (words == 2)
+        fprintf(m_out, "(%.1f, %.1f)", a * TENTH, b * TENTH);
+      fprintf(m_out, op == NAV_OP_END ? "\n" : ",\n");
+    }
+    m_bytes += size;
+    if (op == NAV_OP_REPEAT)
+      m_depth++;
+  }
+
+  FILE *m_out;
+  const CompileOptions &m_options;
+  Pose   m_pose;
+  bool   m_penDown;
+  size_t m_bytes;
+  size_t m_actions;
+  size_t m_strokes;
+  size_t m_points;
+  int    m_depth;
+};
+
+// Collects strokes from the input into batches for the pipeline, writing out finished batches as it goes
+class StrokeCollector {
+public:
+  StrokeCollector(StrokePipeline &pipeline, ProgramWriter &writer, const CompileOptions &options)
+    : m_pipeline(pipeline), m_writer(writer), m_options(options), m_batchPoints(0) {}
+
+  // Add a point to the current stroke, in input units with y pointing up
+  void point(double x, double y) {
+    Point p = { x * m_options.scale + m_options.offsetX, y * m_options.scale + m_options.offsetY };
+    m_stroke.push_back(p);
+  }
+
+  void endStroke() {
+    if (m_stroke.size() >= 2) {
+      m_batchPoints += m_stroke.size();
+      m_batch.push_back(Stroke());
+      m_batch.back().swap(m_stroke);
+      if (m_batchPoints >= 4096)
+        flush();
+    }
+    m_stroke.clear();
+  }
+
+  void finish() {
+    endStroke();
+    flush();
+    drain(true);
+  }
+
+private:
+  void flush() {
+    // write out what has been converted, and wait for the oldest batch rather than reading too far ahead of the workers
+    drain(false);
+    while (m_pipeline.full())
+      write(m_pipeline.pop(true));
+    if (!m_batch.empty())
+      m_pipeline.push(m_batch);
+    m_batch.clear();
+    m_batchPoints = 0;
+  }
+
+  void drain(bool wait) {
+    while (StrokePipeline::Batch *batch = m_pipeline.pop(wait))
+      write(batch);
+  }
+
+  void write(StrokePipeline::Batch *batch) {
+    for (size_t i = 0; i < batch->programs.size(); i++)
+      m_writer.stroke(batch->programs[i]);
+    delete batch;
+  }
+
+  StrokePipeline &m_pipeline;
+  ProgramWriter &m_writer;
+  const CompileOptions &m_options;
+  Stroke m_stroke;
+  std::vector<Stroke> m_batch;
+  size_t m_batchPoints;
+};
+
+// Reads numbers from SVG attribute values, where they can be separated by spaces, commas or nothing but a sign
+class NumberReader {
+public:
+  NumberReader(const char *text) : m_p(text) {}
+
+  void skip() {
+    while (*m_p == ' ' || *m_p == ',' || *m_p == '\t' || *m_p == '\n' || *m_p == '\r')
+      m_p++;
+  }
+  bool number(double *value) {
+    skip();
+    char *end;
+    *value = strtod(m_p, &end);
+    if (end == m_p)
+      return false;
+    m_p = end;
+    return true;
+  }
+  // arc flags are a single 0 or 1 and may be written without a separator
+  bool flag(bool *value) {
+    skip();
+    if (*m_p != '0' && *m_p != '1')
+      return false;
+    *value = *m_p++ == '1';
+    return true;
+  }
+  char command() {
+    skip();
+    return *m_p;
+  }
+  void next() { m_p++; }
+  bool done() {
+    skip();
+    return *m_p == '\0';
+  }
+
+private:
+  const char *m_p;
+};
+
+// Turns SVG shapes into strokes, flattening curves into lines no further than the flatness from the curve
+class SvgShapes {
+public:
+  SvgShapes(StrokeCollector &strokes, const CompileOptions &options) : m_strokes(strokes), m_flatness(options.flatness / options.scale) {}
+
+  void path(const char *d) {
+    NumberReader r(d);
+    double x = 0, y = 0, startX = 0, startY = 0;
+    double controlX = 0, controlY = 0;    // last control point, for the smooth curve commands
+    char previous = 0;
+    char command = 0;
+    while (!r.done()) {
+      char c = r.command();
+      if ((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')) {
+        command = c;
+        r.next();
+      }
+      else if (command == 'M')
+        command = 'L';    // numbers after a move to are line tos
+      else if (command == 'm')
+        command = 'l';
+      bool relative = command >= 'a';
+      double ox = relative ? x : 0;
+      double oy = relative ? y : 0;
+      double v[7];
+      bool f[2];
+
+      switch (command) {
+      case 'M': case 'm':
+        if (!r.number(&v[0]) || !r.number(&v[1]))
+          return;
+        m_strokes.endStroke();
+        x = startX = v[0] + ox;
+        y = startY = v[1] + oy;
+        point(x, y);
+        break;
+      case 'L': case 'l':
+        if (!r.number(&v[0]) || !r.number(&v[1]))
+          return;
+        lineTo(&x, &y, v[0] + ox, v[1] + oy);
+        break;
+      case 'H': case 'h':
+        if (!r.number(&v[0]))
+          return;
+        lineTo(&x, &y, v[0] + ox, y);
+        break;
+      case 'V': case 'v':
+        if (!r.number(&v[0]))
+          return;
+        lineTo(&x, &y, x, v[0] + oy);
+        break;
+      case 'C': case 'c':
+        if (!r.number(&v[0]) || !r.number(&v[1]) || !r.number(&v[2]) || !r.number(&v[3]) || !r.number(&v[4]) || !r.number(&v[5]))
+          return;
+        cubic(&x, &y, v[0] + ox, v[1] + oy, v[2] + ox, v[3] + oy, v[4] + ox, v[5] + oy, &controlX, &controlY);
+        break;
+      case 'S': case 's': {
+        if (!r.number(&v[2]) || !r.number(&v[3]) || !r.number(&v[4]) || !r.number(&v[5]))
+          return;
+        bool smooth = previous == 'C' || previous == 'c' || previous == 'S' || previous == 's';
+        cubic(&x, &y, smooth ? 2 * x - controlX : x, smooth ? 2 * y - controlY : y, v[2] + ox, v[3] + oy, v[4] + ox, v[5] + oy, &controlX, &controlY);
+        break;
+      }
+      case 'Q': case 'q':
+        if (!r.number(&v[0]) || !r.number(&v[1]) || !r.number(&v[2]) || !r.number(&v[3]))
+          return;
+        quadratic(&x, &y, v[0] + ox, v[1] + oy, v[2] + ox, v[3] + oy, &controlX, &controlY);
+        break;
+      case 'T': case 't': {
+        if (!r.number(&v[2]) || !r.number(&v[3]))
+          return;
+        bool smooth = previous == 'Q' || previous == 'q' || previous == 'T' || previous == 't';
+        quadratic(&x, &y, smooth ? 2 * x - controlX : x, smooth ? 2 * y - controlY : y, v[2] + ox, v[3] + oy, &controlX, &controlY);
+        break;
+      }
+      case 'A': case 'a':
+        if (!r.number(&v[0]) || !r.number(&v[1]) || !r.number(&v[2]) || !r.flag(&f[0]) || !r.flag(&f[1]) || !r.number(&v[5]) || !r.number(&v[6]))
+          return;
+        arc(&x, &y, v[0], v[1], v[2], f[0], f[1], v[5] + ox, v[6] + oy);
+        break;
+      case 'Z': case 'z':
+        lineTo(&x, &y, startX, startY);
+        m_strokes.endStroke();
+        point(x, y);
+        break;
+      default:
+        return;
+      }
+      previous = command;
+    }
+    m_strokes.endStroke();
+  }
+
+  void polyline(const char *points, bool closed) {
+    NumberReader r(points);
+    double x, y, firstX = 0, firstY = 0;
+    bool first = true;
+    m_strokes.endStroke();
+    while (r.number(&x) && r.number(&y)) {
+      if (first) {
+        firstX = x;
+        firstY = y;
+        first = false;
+      }
+      point(x, y);
+    }
+    if (closed && !first)
+      point(firstX, firstY);
+    m_strokes.endStroke();
+  }
+
+  void ellipse(double cx, double cy, double rx, double ry) {
+    if (rx <= 0 || ry <= 0)
+      return;
+    int n = segments(std::max(rx, ry), 2 * M_PI);
+    m_strokes.endStroke();
+    for (int i = 0; i <= n; i++)
+      point(cx + rx * cos(2 * M_PI * i / n), cy + ry * sin(2 * M_PI * i / n));
+    m_strokes.endStroke();
+  }
+
+private:
+  // SVG y coordinates point down the page, flip them to match DB-1's anti-clockwise headings
+  void point(double x, double y) {
+    m_strokes.point(x, -y);
+  }
+
+  void lineTo(double *x, double *y, double tx, double ty) {
+    point(tx, ty);
+    *x = tx;
+    *y = ty;
+  }
+
+  // Number of lines needed to stay within the flatness of an arc of a radius
+  int segments(double radius, double sweep) {
+    double step = radius > m_flatness ? 2 * acos(1 - m_flatness / radius) : M_PI / 2;
+    return std::max(1, std::min(100000, (int)ceil(fabs(sweep) / step)));
+  }
+
+  void cubic(double *x, double *y, double c1x, double c1y, double c2x, double c2y, double ex, double ey, double *cx, double *cy) {
+    // the lines are within the flatness when there are enough of them for the curve's largest second derivative
+    double bend = std::max(hypot(*x - 2 * c1x + c2x, *y - 2 * c1y + c2y), hypot(c1x - 2 * c2x + ex, c1y - 2 * c2y + ey));
+    int n = std::max(1, std::min(100000, (int)ceil(sqrt(0.75 * bend / m_flatness))));
+    double sx = *x, sy = *y;
+    for (int i = 1; i <= n; i++) {
+      double t = (double)i / n;
+      double u = 1 - t;
+      point(u * u * u * sx + 3 * u * u * t * c1x + 3 * u * t * t * c2x + t * t * t * ex,
+                      u * u * u * sy + 3 * u * u * t * c1y + 3 * u * t * t * c2y + t * t * t * ey);
+    }
+    *x = ex;
+    *y = ey;
+    *cx = c2x;
+    *cy = c2y;
+  }
+
+  void quadratic(double *x, double *y, double qx, double qy, double ex, double ey, double *cx, double *cy) {
+    double bend = hypot(*x - 2 * qx + ex, *y - 2 * qy + ey);
+    int n = std::max(1, std::min(100000, (int)ceil(sqrt(0.25 * bend / m_flatness))));
+    double sx = *x, sy = *y;
+    for (int i = 1; i <= n; i++) {
+      double t = (double)i / n;
+      double u = 1 - t;
+      point(u * u * sx + 2 * u * t * qx + t * t * ex, u * u * sy + 2 * u * t * qy + t * t * ey);
+    }
+    *x = ex;
+    *y = ey;
+    *cx = qx;
+    *cy = qy;
+  }
+
+  // An elliptical arc from its end points, converted to its centre and angles as described in the SVG specification
+  void arc(double *x, double *y, double rx, double ry, double rotation, bool large, bool sweep, double ex, double ey) {
+    rx = fabs(rx);
+    ry = fabs(ry);
+    if (rx == 0 || ry == 0 || (*x == ex && *y == ey)) {
+      lineTo(x, y, ex, ey);
+      return;
+    }
+    double phi = rotation * DEG;
+    double cp = cos(phi), sp = sin(phi);
+    double dx = (*x - ex) / 2, dy = (*y - ey) / 2;
+    double x1 = cp * dx + sp * dy;
+    double y1 = -sp * dx + cp * dy;
+    double scale = x1 * x1 / (rx * rx) + y1 * y1 / (ry * ry);
+    if (scale > 1) {
+      rx *= sqrt(scale);
+      ry *= sqrt(scale);
+    }
+    double num = rx * rx * ry * ry - rx * rx * y1 * y1 - ry * ry * x1 * x1;
+    double den = rx * rx * y1 * y1 + ry * ry * x1 * x1;
+    double k = sqrt(std::max(0.0, num / den)) * (large == sweep ? -1 : 1);
+    double cx1 = k * rx * y1 / ry;
+    double cy1 = -k * ry * x1 / rx;
+    double cx = cp * cx1 - sp * cy1 + (*x + ex) / 2;
+    double cy = sp * cx1 + cp * cy1 + (*y + ey) / 2;
+    double start = atan2((y1 - cy1) / ry, (x1 - cx1) / rx);
+    double delta = atan2((-y1 - cy1) / ry, (-x1 - cx1) / rx) - start;
+    if (sweep && delta < 0)
+      delta += 2 * M_PI;
+    else if (!sweep && delta > 0)
+      delta -= 2 * M_PI;
+
+    int n = segments(std::max(rx, ry), delta);
+    for (int i = 1; i < n; i++) {
+      double a = start + delta * i / n;
+      point(cx + rx * cos(a) * cp - ry * sin(a) * sp, cy + rx * cos(a) * sp + ry * sin(a) * cp);
+    }
+    lineTo(x, y, ex, ey);
+  }
+
+  StrokeCollector &m_strokes;
+  double m_flatness;
+};
+
+// The value of an attribute in an SVG tag, or an empty string
+static std::string attribute(const std::string &tag, const char *name) {
+  size_t length = strlen(name);
+  for (size_t at = tag.find(name); at != std::string::npos; at = tag.find(name, at + 1)) {
+    if (at == 0 || !isspace((unsigned char)tag[at - 1]))
+      continue;
+    size_t p = at + length;
+    while (p < tag.size() && isspace((unsigned char)tag[p]))
+      p++;
+    if (p >= tag.size() || tag[p] != '=')
+      continue;
+    p++;
+    while (p < tag.size() && isspace((unsigned char)tag[p]))
+      p++;
+    if (p >= tag.size() || (tag[p] != '"' && tag[p] != '\''))
+      continue;
+    size_t end = tag.find(tag[p], p + 1);
+    if (end == std::string::npos)
+      return std::string();
+    return tag.substr(p + 1, end - p - 1);
+  }
+  return std::string();
+}
+
+static double numberAttribute(const std::string &tag, const char *name) {
+  return atof(attribute(tag, name).c_str());
+}
+
+// Read an SVG a tag at a time, so the whole file never has to be held in memory
+static void readSvg(FILE *in, SvgShapes &shapes) {
+  std::string tag;
+  bool warned = false;
+  int c;
+  while ((c = getc(in)) != EOF) {
+    if (c != '<')
+      continue;
+    tag.clear();
+    char quote = 0;
+    while ((c = getc(in)) != EOF && (quote || c != '>')) {
+      if (quote && c == quote)
+        quote = 0;
+      else if (!quote && (c == '"' || c == '\''))
+        quote = (char)c;
+      tag.push_back((char)c);
+    }
+
+    size_t nameEnd = 0;
+    while (nameEnd < tag.size() && !isspace((unsigned char)tag[nameEnd]) && tag[nameEnd] != '/')
+      nameEnd++;
+    std::string name = tag.substr(0, nameEnd);
+    if (!warned && attribute(tag, "transform").size() > 0) {
+      fprintf(stderr, "warning: transform attributes are ignored\n");
+      warned = true;
+    }
+
+    if (name == "path")
+      shapes.path(attribute(tag, "d").c_str());
+    else if (name == "polyline" || name == "polygon")
+      shapes.polyline(attribute(tag, "points").c_str(), name == "polygon");
+    else if (name == "line") {
+      std::string points = attribute(tag, "x1") + " " + attribute(tag, "y1") + " " + attribute(tag, "x2") + " " + attribute(tag, "y2");
+      shapes.polyline(points.c_str(), false);
+    }
+    else if (name == "rect") {
+      double x = numberAttribute(tag, "x"), y = numberAttribute(tag, "y");
+      double w = numberAttribute(tag, "width"), h = numberAttribute(tag, "height");
+      char points[256];
+      snprintf(points, sizeof(points), "%.10g %.10g %.10g %.10g %.10g %.10g %.10g %.10g", x, y, x + w, y, x + w, y + h, x, y + h);
+      shapes.polyline(points, true);
+    }
+    else if (name == "circle")
+      shapes.ellipse(numberAttribute(tag, "cx"), numberAttribute(tag, "cy"), numberAttribute(tag, "r"), numberAttribute(tag, "r"));
+    else if (name == "ellipse")
+      shapes.ellipse(numberAttribute(tag, "cx"), numberAttribute(tag, "cy"), numberAttribute(tag, "rx"), numberAttribute(tag, "ry"));
+  }
+}
+
+// Read a polyline file a line at a time: an x y point per line, with a blank line between strokes and # starting a comment
+static void readPolylines(FILE *in, StrokeCollector &strokes) {
+  char line[256];
+  while (fgets(line, sizeof(line), in)) {
+    char *hash = strchr(line, '#');
+    if (hash)
+      *hash = '\0';
+    NumberReader r(line);
+    double x, y;
+    if (r.number(&x) && r.number(&y))
+      strokes.point(x, y);
+    else if (r.done() && !hash)
+      strokes.endStroke();
+  }
+}
+
+static void compile(FILE *in, FILE *out, const CompileOptions &options) {
+  ProgramWriter writer(out, options);
+  StrokePipeline pipeline(options);
+  StrokeCollector strokes(pipeline, writer, options);
+
+  // SVG files start with a tag, anything else is read as a polyline file
+  int first;
+  while ((first = getc(in)) != EOF && isspace(first))
+    ;
+  if (first != EOF)
+    ungetc(first, in);
+  if (first == '<') {
+    SvgShapes shapes(strokes, options);
+    readSvg(in, shapes);
+  }
+  else
+    readPolylines(in, strokes);
+  strokes.finish();
+  writer.finish();
+}
+
+// The angle DB-1 turns through with the pen down over a program, in degrees, following its repeat blocks
+static double penDownTurn(const std::vector<uint8_t> &program) {
+  std::vector<std::pair<size_t, int> > repeats;    // where each open repeat block starts and how many times it is left to run
+  bool down = false;
+  double turn = 0;
+  size_t p = 0;
+  while (p < program.size() && program[p] != NAV_OP_END) {
+    uint8_t op = program[p++];
+    int16_t a = p + 1 < program.size() ? (int16_t)(program[p] | program[p + 1] << 8) : 0;
+    int16_t b = p + 3 < program.size() ? (int16_t)(program[p + 2] | program[p + 3] << 8) : 0;
+    switch (op) {
+    case NAV_OP_FORWARD:  p += 2; break;
+    case NAV_OP_TURN:     turn += down ? b * TENTH : 0; p += 4; break;
+    case NAV_OP_ROTATE:   turn += down ? a * TENTH : 0; p += 2; break;
+    case NAV_OP_PEN_UP:   down = false; break;
+    case NAV_OP_PEN_DOWN: down = true; break;
+    case NAV_OP_REPEAT:   repeats.push_back(std::make_pair(p + 1, (int)program[p])); p++; break;
+    case NAV_OP_LOOP:
+      if (!repeats.empty() && --repeats.back().second > 0)
+        p = repeats.back().first;
+      else if (!repeats.empty())
+        repeats.pop_back();
+      break;
+    default:
+      return NAN;
+    }
+  }
+  return turn;
+}
+
+// Compile an input held in memory and return the angle turned with the pen down
+static double compileTurn(const char *input, const CompileOptions &options) {
+  FILE *in = tmpfile();
+  FILE *out = tmpfile();
+  if (!in || !out)
+    return NAN;
+  fputs(input, in);
+  rewind(in);
+  compile(in, out, options);
+  rewind(out);
+  std::vector<uint8_t> program;
+  int c;
+  while ((c = getc(out)) != EOF)
+    program.push_back((uint8_t)c);
+  fclose(in);
+  fclose(out);
+  return penDownTurn(program);
+}
+
+// Check the readers hand strokes on with the orientation they were drawn in: an anti-clockwise polyline circle turns
+// DB-1 anti-clockwise, and a circle in an SVG, which SVG draws clockwise down the page, turns it clockwise
+static int selfTest(CompileOptions options) {
+  options.binary = true;
+  std::string polyline;
+  char line[64];
+  for (int i = 0; i <= 64; i++) {
+    snprintf(line, sizeof(line), "%.4f %.4f\n", 50 * sin(2 * M_PI * i / 64), 50 - 50 * cos(2 * M_PI * i / 64));
+    polyline += line;
+  }
+  struct {
+    const char *name;
+    std::string input;
+    double turn;
+  } checks[] = {
+    { "polyline-circle", polyline, 360 },
+    { "svg-circle", "<svg><circle cx=\"0\" cy=\"50\" r=\"50\"/></svg>\n", -360 },
+  };
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    double turn = compileTurn(checks[i].input.c_str(), options);
+    bool passed = fabs(turn - checks[i].turn) < 10;
+    printf("%s\n    turned %.1f degrees, expected %.0f\n    %s\n", checks[i].name, turn, checks[i].turn, passed ? "ok" : "FAILED");
+    failed += !passed;
+  }
+  printf("%d of %d checks passed\n", (int)(sizeof(checks) / sizeof(checks[0])) - failed, (int)(sizeof(checks) / sizeof(checks[0])));
+  return failed > 0 ? 1 : 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "usage: %s [--binary] [--name array] [--scale mm] [--offset x y] [--flatness mm] [--min-radius mm] [--max-bend deg] "
+                  "[--tolerance mm] [--jobs n] [-o output] input\n       %s --self-test\n", name, name);
+}
+
+int main(int argc, char **argv) {
+  CompileOptions options;
+  options.scale = 1.0;
+  options.offsetX = 0;
+  options.offsetY = 0;
+  options.flatness = 0.2;
+  options.minRadius = BOT_RADIUS;
+  options.maxBend = NAV_PATH_CORNER * DEG;
+  options.tolerance = NAV_PATH_TOLERANCE;
+  options.jobs = std::max(1u, std::thread::hardware_concurrency());
+  options.binary = false;
+  options.name = "drawing";
+  const char *input = NULL;
+  const char *output = NULL;
+  bool test = false;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--binary") == 0)
+      options.binary = true;
+    else if (strcmp(argv[i], "--name") == 0 && i + 1 < argc)
+      options.name = argv[++i];
+    else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+      options.scale = atof(argv[++i]);
+    else if (strcmp(argv[i], "--offset") == 0 && i + 2 < argc) {
+      options.offsetX = atof(argv[++i]);
+      options.offsetY = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--flatness") == 0 && i + 1 < argc)
+      options.flatness = atof(argv[++i]);
+    else if (strcmp(argv[i], "--min-radius") == 0 && i + 1 < argc)
+      options.minRadius = atof(argv[++i]);
+    else if (strcmp(argv[i], "--max-bend") == 0 && i + 1 < argc)
+      options.maxBend = atof(argv[++i]) * DEG;
+    else if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+      options.tolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+      options.jobs = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--self-test") == 0)
+      test = true;
+    else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc)
+      output = argv[++i];
+    else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+      usage(argv[0]);
+      return 1;
+    }
+    else
+      input = argv[i];
+  }
+  if (test)
+    return selfTest(options);
+  if (!input || options.scale <= 0 || options.flatness <= 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  FILE *in = strcmp(input, "-") == 0 ? stdin : fopen(input, "rb");
+  if (!in) {
+    fprintf(stderr, "can't open %s\n", input);
+    return 1;
+  }
+  FILE *out = output ? fopen(output, options.binary ? "wb" : "w") : stdout;
+  if (!out) {
+    fprintf(stderr, "can't create %s\n", output);
+    return 1;
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  compile(in, out, options);
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  fprintf(stderr, "compiled in %.0f ms on %d threads\n", std::chrono::duration<double, std::milli>(end - start).count(), options.jobs);
+
+  if (in != stdin)
+    fclose(in);
+  if (out != stdout)
+    fclose(out);
+  return 0;
+}
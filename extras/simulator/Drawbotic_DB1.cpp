@@ -0,0 +1,282 @@
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+
+thread_local Drawbotic_DB1 DB1;
+
+unsigned long millis() {
+  return (unsigned long)(DB1.simTime_us() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long)DB1.simTime_us();
+}
+
+Drawbotic_DB1::Drawbotic_DB1() {
+  simReset();
+}
+
+/*!
+ * \brief The default robot model, geometry matches the constants used by Drawbotic_Navigation
+ */
+DB1_SimParams Drawbotic_DB1::defaultParams() {
+  DB1_SimParams params;
+  params.maxSpeed_mm_s = 600.0f;
+  params.deadband = 0.03f;
+  params.motorLag_ms = 25.0f;
+  params.m1Gain = 1.0f;
+  params.m2Gain = 0.97f;
+  params.m1Wheel = 1.0f;
+  params.m2Wheel = 1.0f;
+  params.encBitsPerMM = ENC_BITS_P_MM;
+  params.trackWidth_mm = 2 * BOT_RADIUS;
+  params.traction_mm_s2 = 0;
+  params.imuNoise_deg = 0.05f;
+  params.imuDrift_deg_s = 0.01f;
+  params.seed = 1;
+  return params;
+}
+
+void Drawbotic_DB1::simReset(const DB1_SimParams &params) {
+  m_params = params;
+  m_pose.x = 0;
+  m_pose.y = 0;
+  m_pose.heading = 0;
+  m_time_us = 0;
+  m_rng = params.seed ? params.seed : 1;
+  m_drift = 0;
+  m_penDown = false;
+  m_motorWrites = 0;
+  m_encoderReads = 0;
+  m_sleep_us = 0;
+  simStub(false);
+  simPlayback(false);
+  for (int i = 0; i < 2; i++) {
+    m_command[i] = 0;
+    m_wheelSpeed[i] = 0;
+    m_groundSpeed[i] = 0;
+    m_encoder[i] = 0;
+    m_encoderRead[i] = 0;
+  }
+}
+
+/*!
+ * \brief Advance the simulation
+ *
+ * \param deltaTime_ms The amount of simulated time to advance by
+ */
+void Drawbotic_DB1::simStep(float deltaTime_ms) {
+  const float gains[2] = { m_params.m1Gain, m_params.m2Gain };
+  const float wheels[2] = { m_params.m1Wheel, m_params.m2Wheel };
+  float alpha = m_params.motorLag_ms > 0 ? 1.0f - expf(-deltaTime_ms / m_params.motorLag_ms) : 1.0f;
+  double dist[2];
+
+  for (int i = 0; i < 2; i++) {
+    // Motor power below the deadband doesn't overcome friction, above it speed is roughly linear
+    float power = constrain(m_command[i], -1.0f, 1.0f);
+    float magnitude = fabsf(power) - m_params.deadband;
+    float target = 0;
+    if (magnitude > 0)
+      target = (power > 0 ? 1 : -1) * magnitude / (1.0f - m_params.deadband) * m_params.maxSpeed_mm_s * gains[i];
+
+    // First order lag between the commanded and actual wheel speed. The encoder counts turns of the wheel, so a wheel
+    // that is larger than assumed covers more ground than its encoder signals say
+    m_wheelSpeed[i] += (target - m_wheelSpeed[i]) * alpha;
+    double turned = m_wheelSpeed[i] * deltaTime_ms / 1000.0;
+    m_encoder[i] += turned * m_params.encBitsPerMM;
+
+    // A wheel whose speed changes faster than the traction allows slips, turning without the ground following
+    float rolling = m_wheelSpeed[i];
+    if (m_params.traction_mm_s2 > 0) {
+      float maxChange = m_params.traction_mm_s2 * deltaTime_ms / 1000.0f;
+      m_groundSpeed[i] = constrain(m_wheelSpeed[i], m_groundSpeed[i] - maxChange, m_groundSpeed[i] + maxChange);
+      rolling = m_groundSpeed[i];
+    }
+    dist[i] = rolling * deltaTime_ms / 1000.0 * wheels[i];
+  }
+
+  // Motor 1 drives the right wheel, motor 2 the left wheel
+  double centre = (dist[0] + dist[1]) / 2.0;
+  double dTheta = (dist[0] - dist[1]) / m_params.trackWidth_mm;
+  double midHeading = m_pose.heading * M_PI / 180.0 + dTheta / 2.0;
+  m_pose.x += centre * cos(midHeading);
+  m_pose.y += centre * sin(midHeading);
+  m_pose.heading += dTheta * 180.0 / M_PI;
+
+  m_drift += m_params.imuDrift_deg_s * deltaTime_ms / 1000.0;
+  m_time_us += (uint64_t)(deltaTime_ms * 1000.0f + 0.5f);
+}
+
+/*!
+ * \brief Sleep until the next interrupt, the timer behind millis() which fires every millisecond, running the model meanwhile
+ */
+void Drawbotic_DB1::simWaitForInterrupt() {
+  simStep(1.0f);
+  m_sleep_us += 1000;
+}
+
+void Drawbotic_DB1::setMotorSpeed(int motor, float speed) {
+  if (motor == 1)
+    m_command[0] = speed;
+  else if (motor == 2)
+    m_command[1] = speed;
+  m_motorWrites++;
+}
+
+int Drawbotic_DB1::getM1EncoderDelta() {
+  if (m_stub)
+    return m_stubDeltas[0];
+  if (m_playback)
+    return m_playbackDeltaCount > 0 ? m_playbackDeltas[m_playbackDeltaHead][0] : 0;
+  // Only whole encoder signals are ever reported, the fraction carries over to the next read
+  long count = (long)floor(m_encoder[0]);
+  int delta = (int)(count - m_encoderRead[0]);
+  m_encoderRead[0] = count;
+  return delta;
+}
+
+int Drawbotic_DB1::getM2EncoderDelta() {
+  m_encoderReads++;
+  if (m_stub)
+    return m_stubDeltas[1];
+  if (m_playback) {
+    // motor 2 is read second, so it moves the queue on to the next step. The output stage only writes the motor powers
+    // that change, so a step's outputs are whatever powers are in place when the next step starts
+    if (m_playbackStepping)
+      keepPlaybackOutput();
+    m_playbackStepping = true;
+    if (m_playbackDeltaCount == 0)
+      return 0;
+    int delta = m_playbackDeltas[m_playbackDeltaHead][1];
+    m_playbackDeltaHead = (m_playbackDeltaHead + 1) % PLAYBACK_SIZE;
+    m_playbackDeltaCount--;
+    return delta;
+  }
+  long count = (long)floor(m_encoder[1]);
+  int delta = (int)(count - m_encoderRead[1]);
+  m_encoderRead[1] = count;
+  return delta;
+}
+
+void Drawbotic_DB1::resetEncoderDeltas() {
+  m_encoderRead[0] = (long)floor(m_encoder[0]);
+  m_encoderRead[1] = (long)floor(m_encoder[1]);
+}
+
+DB1_Orientation Drawbotic_DB1::getOrientation() {
+  DB1_Orientation orientation;
+  orientation.pitch = 0;
+  orientation.roll = 0;
+  if (m_stub) {
+    orientation.heading = 0;
+    return orientation;
+  }
+  if (m_playback) {
+    if (m_playbackHeadingCount > 0) {
+      m_playbackHeading = m_playbackHeadings[m_playbackHeadingHead];
+      m_playbackHeadingHead = (m_playbackHeadingHead + 1) % PLAYBACK_SIZE;
+      m_playbackHeadingCount--;
+    }
+    orientation.heading = m_playbackHeading;
+    return orientation;
+  }
+  double heading = fmod(m_pose.heading + m_drift + gaussian() * m_params.imuNoise_deg, 360.0);
+  if (heading < 0)
+    heading += 360.0;
+  orientation.heading = (float)heading;
+  return orientation;
+}
+
+void Drawbotic_DB1::setPen(bool down) {
+  m_penDown = down;
+  m_playbackPen = down ? 2 : 1;
+}
+
+/*!
+ * \brief Replace the model with encoder reads that return the same deltas every time and an IMU that always reads a heading of 0, or go back to the model
+ */
+void Drawbotic_DB1::simStub(bool enabled, int m1Delta, int m2Delta) {
+  m_stub = enabled;
+  m_stubDeltas[0] = m1Delta;
+  m_stubDeltas[1] = m2Delta;
+}
+
+/*!
+ * \brief Replace the model with recorded inputs, or go back to the model. Either way the playback queues are emptied
+ */
+void Drawbotic_DB1::simPlayback(bool enabled) {
+  m_playback = enabled;
+  m_playbackDeltaHead = 0;
+  m_playbackDeltaCount = 0;
+  m_playbackHeadingHead = 0;
+  m_playbackHeadingCount = 0;
+  m_playbackHeading = 0;
+  m_playbackOutputHead = 0;
+  m_playbackOutputCount = 0;
+  m_playbackPen = 0;
+  m_playbackStepping = false;
+}
+
+/*!
+ * \brief Queue the encoder deltas the next navigation step will read
+ * \return false if the queue is full
+ */
+bool Drawbotic_DB1::simPlaybackStep(int m1Delta, int m2Delta) {
+  if (m_playbackDeltaCount == PLAYBACK_SIZE)
+    return false;
+  int i = (m_playbackDeltaHead + m_playbackDeltaCount++) % PLAYBACK_SIZE;
+  m_playbackDeltas[i][0] = m1Delta;
+  m_playbackDeltas[i][1] = m2Delta;
+  return true;
+}
+
+/*!
+ * \brief Queue the heading the next IMU read will return
+ * \return false if the queue is full
+ */
+bool Drawbotic_DB1::simPlaybackHeading(float heading) {
+  if (m_playbackHeadingCount == PLAYBACK_SIZE)
+    return false;
+  m_playbackHeadings[(m_playbackHeadingHead + m_playbackHeadingCount++) % PLAYBACK_SIZE] = heading;
+  return true;
+}
+
+/*!
+ * \brief Take the motor powers, and any pen movement, left by the oldest navigation step not yet taken. Call it between steps
+ * \return false if there are none
+ */
+bool Drawbotic_DB1::simPlaybackOutput(float *m1, float *m2, uint8_t *pen) {
+  if (m_playbackStepping) {
+    keepPlaybackOutput();
+    m_playbackStepping = false;
+  }
+  if (m_playbackOutputCount == 0)
+    return false;
+  *m1 = m_playbackOutputs[m_playbackOutputHead][0];
+  *m2 = m_playbackOutputs[m_playbackOutputHead][1];
+  *pen = m_playbackPens[m_playbackOutputHead];
+  m_playbackOutputHead = (m_playbackOutputHead + 1) % PLAYBACK_SIZE;
+  m_playbackOutputCount--;
+  return true;
+}
+
+void Drawbotic_DB1::keepPlaybackOutput() {
+  if (m_playbackOutputCount == PLAYBACK_SIZE)
+    return;
+  int i = (m_playbackOutputHead + m_playbackOutputCount++) % PLAYBACK_SIZE;
+  m_playbackOutputs[i][0] = m_command[0];
+  m_playbackOutputs[i][1] = m_command[1];
+  m_playbackPens[i] = m_playbackPen;
+  m_playbackPen = 0;
+}
+
+float Drawbotic_DB1::gaussian() {
+  // xorshift32 feeding a Box-Muller transform, deterministic for a given seed
+  float u[2];
+  for (int i = 0; i < 2; i++) {
+    m_rng ^= m_rng << 13;
+    m_rng ^= m_rng >> 17;
+    m_rng ^= m_rng << 5;
+    u[i] = ((m_rng >> 8) + 1.0f) / 16777217.0f;
+  }
+  return sqrtf(-2.0f * logf(u[0])) * cosf(2.0f * (float)M_PI * u[1]);
+}
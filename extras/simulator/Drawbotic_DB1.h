@@ -0,0 +1,184 @@
+#ifndef DRAWBOTIC_DB1_H
+#define DRAWBOTIC_DB1_H
+
+// Host stand-in for the Drawbotic-Arduino DB1 driver. It provides the small part of the DB1 API
+// used by Drawbotic_Navigation, backed by a differential drive model, so the navigation library
+// can be built and run on a desktop machine. See extras/simulator/README.md
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+
+#ifndef constrain
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+#endif
+#ifndef abs
+#define abs(x) ((x) > 0 ? (x) : -(x))
+#endif
+
+unsigned long millis();
+unsigned long micros();
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+// Drawbotic_Navigation::idleUntilNeeded() sleeps until the next interrupt, on the host the next millisecond of simulation
+#define NAV_WAIT_FOR_INTERRUPT() DB1.simWaitForInterrupt()
+
+// Programs for Drawbotic_Navigation::runProgram() are kept in flash on the robot, on the host they are ordinary memory
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+
+// Minimal versions of the Arduino Print and Stream interfaces, just enough for Drawbotic_Navigation::dumpTrace and beginStream
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t value) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size) {
+    size_t written = 0;
+    while (size--)
+      written += write(*buffer++);
+    return written;
+  }
+  size_t print(const char *text) {
+    size_t written = 0;
+    while (*text)
+      written += write((uint8_t)*text++);
+    return written;
+  }
+  size_t print(int value) {
+    char digits[12];
+    int length = 0;
+    unsigned int magnitude = value < 0 ? -(unsigned int)value : (unsigned int)value;
+    do {
+      digits[length++] = (char)('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude > 0);
+    size_t written = value < 0 ? write((uint8_t)'-') : 0;
+    while (length > 0)
+      written += write((uint8_t)digits[--length]);
+    return written;
+  }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+};
+
+struct DB1_Orientation {
+  float heading;
+  float pitch;
+  float roll;
+};
+
+/*!
+ * \brief Physical parameters of the simulated robot
+ */
+struct DB1_SimParams {
+  float    maxSpeed_mm_s;   // wheel speed at full power
+  float    deadband;        // motor power below which the wheels don't turn
+  float    motorLag_ms;     // first order time constant of the motor response
+  float    m1Gain;          // efficiency of motor 1 (right wheel)
+  float    m2Gain;          // efficiency of motor 2 (left wheel)
+  float    m1Wheel;         // diameter of the right wheel as a fraction of the one ENC_BITS_P_MM assumes
+  float    m2Wheel;         // diameter of the left wheel as a fraction of the one ENC_BITS_P_MM assumes
+  float    encBitsPerMM;    // encoder signals per millimetre of wheel travel
+  float    trackWidth_mm;   // distance between the two wheels
+  float    traction_mm_s2;  // fastest the wheels can speed up or slow down without slipping, 0 if they never slip
+  float    imuNoise_deg;    // standard deviation of the heading noise
+  float    imuDrift_deg_s;  // heading drift rate
+  uint32_t seed;            // random seed, runs with the same seed are identical
+};
+
+/*!
+ * \brief Simulated pose of the robot, heading is in degrees counter-clockwise
+ */
+struct DB1_SimPose {
+  double x;
+  double y;
+  double heading;
+};
+
+class Drawbotic_DB1 {
+public:
+  Drawbotic_DB1();
+  void init() {}
+  void setMotorSpeed(int motor, float speed);
+  int  getM1EncoderDelta();
+  int  getM2EncoderDelta();
+  void resetEncoderDeltas();
+  DB1_Orientation getOrientation();
+  void setPen(bool down);
+
+  static DB1_SimParams defaultParams();
+  void simReset(const DB1_SimParams &params);
+  void simReset() { simReset(defaultParams()); }
+  void simStep(float deltaTime_ms);
+  DB1_SimPose simPose() const { return m_pose; }
+  double simTime_ms() const { return m_time_us / 1000.0; }
+  uint64_t simTime_us() const { return m_time_us; }
+  bool simPenDown() const { return m_penDown; }
+  float simMotorCommand(int motor) const { return motor == 1 ? m_command[0] : m_command[1]; }
+  unsigned long simMotorWrites() const { return m_motorWrites; }
+  unsigned long simEncoderReads() const { return m_encoderReads; }
+  void simWaitForInterrupt();
+  double simSleepTime_ms() const { return m_sleep_us / 1000.0; }
+
+  // Inputs that never change in place of the model, for timing the library on its own, see extras/benchmark
+  void simStub(bool enabled, int m1Delta = 0, int m2Delta = 0);
+
+  // Playback of recorded inputs in place of the model, see nav_replay. The encoder deltas and IMU headings are queued
+  // ahead of the navigation steps that read them, and the motor powers and pen each step leaves behind are kept until taken
+  static const int PLAYBACK_SIZE = 512;
+  void simPlayback(bool enabled);
+  bool simPlaybackStep(int m1Delta, int m2Delta);
+  bool simPlaybackHeading(float heading);
+  bool simPlaybackOutput(float *m1, float *m2, uint8_t *pen);
+  void simSetTime_us(uint64_t time_us) { m_time_us = time_us; }
+
+private:
+  float gaussian();
+
+  DB1_SimParams m_params;
+  DB1_SimPose   m_pose;
+  uint64_t      m_time_us;
+  uint32_t      m_rng;
+  float         m_command[2];
+  float         m_wheelSpeed[2];
+  float         m_groundSpeed[2];
+  double        m_encoder[2];
+  long          m_encoderRead[2];
+  double        m_drift;
+  bool          m_penDown;
+  unsigned long m_motorWrites;
+  unsigned long m_encoderReads;
+  uint64_t      m_sleep_us;
+
+  bool          m_stub;
+  int           m_stubDeltas[2];
+
+  bool          m_playback;
+  int           m_playbackDeltas[PLAYBACK_SIZE][2];
+  int           m_playbackDeltaHead;
+  int           m_playbackDeltaCount;
+  float         m_playbackHeadings[PLAYBACK_SIZE];
+  int           m_playbackHeadingHead;
+  int           m_playbackHeadingCount;
+  float         m_playbackHeading;    // the last heading read, repeated if the queue runs dry
+  float         m_playbackOutputs[PLAYBACK_SIZE][2];
+  uint8_t       m_playbackPens[PLAYBACK_SIZE];
+  int           m_playbackOutputHead;
+  int           m_playbackOutputCount;
+  uint8_t       m_playbackPen;        // pen written since the last motor powers, 1 up, 2 down, 0 unchanged
+  bool          m_playbackStepping;   // a step has read its encoder deltas and its outputs haven't been kept yet
+
+  void keepPlaybackOutput();
+};
+
+// One robot per thread, so host tools can simulate several at once
+extern thread_local Drawbotic_DB1 DB1;
+
+#endif
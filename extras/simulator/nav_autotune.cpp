@@ -0,0 +1,407 @@
+// Calibration autotuner for Drawbotic_Navigation. Simulates a DB-1 whose wheels and track don't quite match the
+// constants the library assumes, runs the standard queues on many simulated robots in parallel and searches for the
+// NavigationCalibration that draws them most accurately without slowing them down. See README.md
+
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+#include "sim_scenarios.h"
+
+struct TuneOptions {
+  DB1_SimParams robot;
+  bool     imu;             // evaluate runs with IMU rotations
+  bool     encoders;        // evaluate runs with encoder rotations
+  int      seeds;
+  int      threads;
+  int      rounds;
+  float    timeWeight;      // cost in mm of each second a run takes
+  float    headingWeight;   // cost in mm of each degree of heading error
+  float    timeout_s;
+  const char *output;
+};
+
+// The calibration constants, in the order of NavigationCalibration
+struct TuneField {
+  const char *name;
+  float NavigationCalibration::*field;
+  float minimum;          // kept inside the range setCalibration() accepts
+  float maximum;
+};
+
+static const TuneField FIELDS[] = {
+  { "turnErrorLeft",    &NavigationCalibration::turnErrorLeft,    0.6f,   1.9f },
+  { "turnErrorRight",   &NavigationCalibration::turnErrorRight,   0.6f,   1.9f },
+  { "rotateErrorLeft",  &NavigationCalibration::rotateErrorLeft,  0.6f,   1.9f },
+  { "rotateErrorRight", &NavigationCalibration::rotateErrorRight, 0.6f,   1.9f },
+  { "forwardError",     &NavigationCalibration::forwardError,     0.6f,   1.9f },
+  { "forwardKp",        &NavigationCalibration::forwardKp,        0.001f, 1.0f },
+  { "rotateKp",         &NavigationCalibration::rotateKp,         0.005f, 1.0f },
+  { "imuTolerance",     &NavigationCalibration::imuTolerance,     0.02f,  5.0f },
+};
+static const int FIELD_COUNT = sizeof(FIELDS) / sizeof(FIELDS[0]);
+
+// A direction the search moves in, by step (a fraction of the value if relative). The left and right multipliers are
+// also moved together, as a robot whose track is wider than assumed needs both to change at once and moving either
+// one alone unbalances it
+struct TuneDirection {
+  int   field;
+  int   partner;          // a second field moved by the same step, or -1
+  float step;
+  bool  relative;
+};
+
+static const TuneDirection DIRECTIONS[] = {
+  { 0, 1,  0.02f, false },
+  { 0, -1, 0.02f, false },
+  { 1, -1, 0.02f, false },
+  { 2, 3,  0.02f, false },
+  { 2, -1, 0.02f, false },
+  { 3, -1, 0.02f, false },
+  { 4, -1, 0.02f, false },
+  { 5, -1, 0.25f, true },
+  { 6, -1, 0.25f, true },
+  { 7, -1, 0.1f,  false },
+};
+static const int DIRECTION_COUNT = sizeof(DIRECTIONS) / sizeof(DIRECTIONS[0]);
+
+// The smallest step, relative to the first one, before the search gives up on a direction
+static const float MIN_STEP_FRACTION = 1.0f / 64;
+
+// Scenarios used when none are named: straight lines, turns both ways and rotations both ways
+static const char *DEFAULT_SCENARIOS[] = { "square-100", "octagon-50", "s-curves", "rounded-square", "rotations", "circle-36gon" };
+
+// A scenario with the pose a perfect robot would be at as each of its steps finishes
+struct TuneScenario {
+  const Scenario *scenario;
+  std::vector<DB1_SimPose> checkpoints;
+};
+
+// One simulated run: a scenario, with or without the IMU, on one seed
+struct TuneRun {
+  const TuneScenario *scenario;
+  bool     useIMU;
+  uint32_t seed;
+};
+
+struct TuneCost {
+  double total;
+  double error_mm;      // mean distance from each checkpoint
+  double heading_deg;   // mean heading error at each checkpoint
+  double time_s;        // total time of all the runs
+  int    timeouts;
+};
+
+static double headingDifference(double a, double b) {
+  double difference = fmod(a - b, 360.0);
+  if (difference > 180.0) difference -= 360.0;
+  if (difference < -180.0) difference += 360.0;
+  return difference;
+}
+
+// Run a scenario to completion, comparing the true pose with the ideal one every time an action finishes
+static void simulate(const TuneRun &run, const NavigationCalibration &calibration, const TuneOptions &options,
+                     double *error_mm, double *heading_deg, double *time_s, bool *timedOut) {
+  DB1_SimParams params = options.robot;
+  params.seed = run.seed;
+  DB1.simReset(params);
+
+  Drawbotic_Navigation nav(run.useIMU);
+  nav.setCalibration(calibration);
+
+  const std::vector<SimStep> &steps = run.scenario->scenario->steps;
+  size_t queued = 0;
+  size_t checked = 0;
+  *error_mm = 0;
+  *heading_deg = 0;
+  *timedOut = false;
+  for (;;) {
+    while (queued < steps.size() && nav.getQueueSize() < nav.getQueueCapacity()) {
+      enqueue(nav, steps[queued]);
+      queued++;
+    }
+    // actions leave the queue as they finish
+    size_t finished = queued - nav.getQueueSize();
+    while (checked < finished) {
+      DB1_SimPose actual = DB1.simPose();
+      const DB1_SimPose &ideal = run.scenario->checkpoints[checked];
+      *error_mm += hypot(actual.x - ideal.x, actual.y - ideal.y);
+      *heading_deg += fabs(headingDifference(actual.heading, ideal.heading));
+      checked++;
+    }
+    if (checked == steps.size())
+      break;
+    if (DB1.simTime_ms() > options.timeout_s * 1000.0) {
+      *timedOut = true;
+      break;
+    }
+    DB1.simStep(1.0f);
+    nav.update(1.0f);
+  }
+  *time_s = DB1.simTime_ms() / 1000.0;
+}
+
+// Work out the cost of each candidate calibration, sharing every run of every candidate between the threads. Each
+// thread has its own simulated robot, so they don't need to coordinate beyond taking the next run
+static std::vector<TuneCost> evaluate(const std::vector<NavigationCalibration> &candidates, const std::vector<TuneRun> &runs,
+                                      const TuneOptions &options) {
+  size_t jobs = candidates.size() * runs.size();
+  std::vector<double> errors(jobs), headings(jobs), times(jobs);
+  std::vector<char> timeouts(jobs);
+  std::atomic<size_t> next(0);
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < options.threads; t++) {
+    threads.push_back(std::thread([&]() {
+      for (size_t job = next++; job < jobs; job = next++) {
+        bool timedOut;
+        simulate(runs[job % runs.size()], candidates[job / runs.size()], options, &errors[job], &headings[job], &times[job], &timedOut);
+        timeouts[job] = timedOut;
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); t++)
+    threads[t].join();
+
+  size_t checkpoints = 0;
+  for (size_t r = 0; r < runs.size(); r++)
+    checkpoints += runs[r].scenario->checkpoints.size();
+
+  std::vector<TuneCost> costs(candidates.size());
+  for (size_t c = 0; c < candidates.size(); c++) {
+    TuneCost &cost = costs[c];
+    cost.error_mm = 0;
+    cost.heading_deg = 0;
+    cost.time_s = 0;
+    cost.timeouts = 0;
+    for (size_t r = 0; r < runs.size(); r++) {
+      size_t job = c * runs.size() + r;
+      cost.error_mm += errors[job];
+      cost.heading_deg += headings[job];
+      cost.time_s += times[job];
+      cost.timeouts += timeouts[job];
+    }
+    cost.error_mm /= checkpoints;
+    cost.heading_deg /= checkpoints;
+    // a run that never finished can't be the best, however close it got
+    cost.total = cost.error_mm + options.headingWeight * cost.heading_deg + options.timeWeight * cost.time_s +
+                 cost.timeouts * 1e6;
+  }
+  return costs;
+}
+
+// Move a calibration along a direction
+static void step(NavigationCalibration *calibration, const TuneDirection &direction, float amount) {
+  for (int n = 0; n < 2; n++) {
+    int i = n == 0 ? direction.field : direction.partner;
+    if (i < 0)
+      continue;
+    float value = calibration->*FIELDS[i].field;
+    value = direction.relative ? value * (1 + amount) : value + amount;
+    calibration->*FIELDS[i].field = constrain(value, FIELDS[i].minimum, FIELDS[i].maximum);
+  }
+}
+
+static void printCost(const char *label, const TuneCost &cost) {
+  printf("%-10s cost %9.3f  error %7.3f mm  heading %6.3f deg  time %8.2f s%s\n", label, cost.total, cost.error_mm,
+         cost.heading_deg, cost.time_s, cost.timeouts ? "  TIMEOUT" : "");
+}
+
+static void writeProfile(FILE *out, const NavigationCalibration &calibration, const TuneOptions &options) {
+  fprintf(out, "// Calibration profile from nav_autotune for a robot with a %.2f mm track, wheels %.4f/%.4f and motors %.3f/%.3f\n",
+          options.robot.trackWidth_mm, options.robot.m1Wheel, options.robot.m2Wheel, options.robot.m1Gain, options.robot.m2Gain);
+  fprintf(out, "// Apply it with setCalibration(calibration), or store it with EEPROM.put() and load it with EEPROM.get()\n");
+  fprintf(out, "const NavigationCalibration calibration = {\n");
+  for (int i = 0; i < FIELD_COUNT; i++)
+    fprintf(out, "  %.6ff,    // %s\n", calibration.*FIELDS[i].field, FIELDS[i].name);
+  fprintf(out, "};\n");
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [--track mm] [--wheels right left] [--motors right left] [--imu | --no-imu] [--seeds n] [--threads n] [--rounds n] [--time-weight mm] [--heading-weight mm] [--timeout s] [--out file] [scenario...]\n", name);
+}
+
+int main(int argc, char **argv) {
+  TuneOptions options;
+  options.robot = Drawbotic_DB1::defaultParams();
+  options.imu = true;
+  options.encoders = true;
+  options.seeds = 1;
+  options.threads = (int)std::thread::hardware_concurrency();
+  options.rounds = 40;
+  options.timeWeight = 0.005f;
+  options.headingWeight = 1.0f;
+  options.timeout_s = 600.0f;
+  options.output = NULL;
+  std::vector<const char *> only;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--track") == 0 && i + 1 < argc)
+      options.robot.trackWidth_mm = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--wheels") == 0 && i + 2 < argc) {
+      options.robot.m1Wheel = (float)atof(argv[++i]);
+      options.robot.m2Wheel = (float)atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--motors") == 0 && i + 2 < argc) {
+      options.robot.m1Gain = (float)atof(argv[++i]);
+      options.robot.m2Gain = (float)atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--imu") == 0)
+      options.encoders = false;
+    else if (strcmp(argv[i], "--no-imu") == 0)
+      options.imu = false;
+    else if (strcmp(argv[i], "--seeds") == 0 && i + 1 < argc)
+      options.seeds = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      options.threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+      options.rounds = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--time-weight") == 0 && i + 1 < argc)
+      options.timeWeight = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--heading-weight") == 0 && i + 1 < argc)
+      options.headingWeight = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+      options.timeout_s = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+      options.output = argv[++i];
+    else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    }
+    else
+      only.push_back(argv[i]);
+  }
+  if (options.threads < 1)
+    options.threads = 1;
+  if (options.seeds < 1)
+    options.seeds = 1;
+  if (!options.imu && !options.encoders) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (only.empty())
+    only.assign(DEFAULT_SCENARIOS, DEFAULT_SCENARIOS + sizeof(DEFAULT_SCENARIOS) / sizeof(DEFAULT_SCENARIOS[0]));
+
+  std::vector<Scenario> scenarios = makeScenarios();
+  std::vector<TuneScenario> selected;
+  for (size_t j = 0; j < only.size(); j++) {
+    size_t i = 0;
+    while (i < scenarios.size() && strcmp(only[j], scenarios[i].name) != 0)
+      i++;
+    if (i == scenarios.size()) {
+      printf("unknown scenario %s\n", only[j]);
+      return 1;
+    }
+    TuneScenario tune;
+    tune.scenario = &scenarios[i];
+    std::vector<SimStep> prefix;
+    for (size_t s = 0; s < scenarios[i].steps.size(); s++) {
+      prefix.push_back(scenarios[i].steps[s]);
+      tune.checkpoints.push_back(idealPose(prefix));
+    }
+    selected.push_back(tune);
+  }
+
+  std::vector<TuneRun> runs;
+  for (size_t i = 0; i < selected.size(); i++) {
+    for (int mode = 0; mode < 2; mode++) {
+      if (!(mode ? options.imu : options.encoders))
+        continue;
+      for (int seed = 1; seed <= options.seeds; seed++) {
+        TuneRun run = { &selected[i], mode != 0, (uint32_t)seed };
+        runs.push_back(run);
+      }
+    }
+  }
+  printf("tuning against %lu runs on %d threads\n", (unsigned long)runs.size(), options.threads);
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  NavigationCalibration best = Drawbotic_Navigation::defaultCalibration();
+  TuneCost bestCost = evaluate(std::vector<NavigationCalibration>(1, best), runs, options)[0];
+  TuneCost defaultCost = bestCost;
+  printCost("default", bestCost);
+
+  // Pattern search: every round tries a step either way in each direction from the best calibration so far, all in
+  // parallel. The directions that improved on it are combined if that is better still, otherwise just the best one is
+  // taken. A direction that improved neither way has its step halved, until every step is too small to matter
+  float steps[DIRECTION_COUNT];
+  for (int d = 0; d < DIRECTION_COUNT; d++)
+    steps[d] = DIRECTIONS[d].step;
+  for (int round = 1; round <= options.rounds; round++) {
+    std::vector<NavigationCalibration> candidates;
+    std::vector<int> tried;
+    for (int d = 0; d < DIRECTION_COUNT; d++) {
+      if (steps[d] < DIRECTIONS[d].step * MIN_STEP_FRACTION)
+        continue;
+      for (int sign = -1; sign <= 1; sign += 2) {
+        NavigationCalibration candidate = best;
+        step(&candidate, DIRECTIONS[d], sign * steps[d]);
+        candidates.push_back(candidate);
+        tried.push_back(d);
+      }
+    }
+    if (candidates.empty())
+      break;
+    std::vector<TuneCost> costs = evaluate(candidates, runs, options);
+
+    NavigationCalibration combined = best;
+    int improved = 0;
+    size_t chosen = 0;
+    for (size_t c = 0; c < costs.size(); c += 2) {
+      size_t better = costs[c + 1].total < costs[c].total ? c + 1 : c;
+      int d = tried[c];
+      if (costs[better].total < bestCost.total) {
+        step(&combined, DIRECTIONS[d], (better == c ? -1 : 1) * steps[d]);
+        improved++;
+      }
+      else
+        steps[d] /= 2;
+      if (costs[better].total < costs[chosen].total)
+        chosen = better;
+    }
+
+    char label[24];
+    snprintf(label, sizeof(label), "round %d", round);
+    if (improved == 0) {
+      printf("%-10s no improvement, halving the steps\n", label);
+      continue;
+    }
+    NavigationCalibration next = candidates[chosen];
+    TuneCost nextCost = costs[chosen];
+    if (improved > 1) {
+      TuneCost combinedCost = evaluate(std::vector<NavigationCalibration>(1, combined), runs, options)[0];
+      if (combinedCost.total < nextCost.total) {
+        next = combined;
+        nextCost = combinedCost;
+      }
+    }
+    printCost(label, nextCost);
+    for (int i = 0; i < FIELD_COUNT; i++) {
+      if (next.*FIELDS[i].field != best.*FIELDS[i].field)
+        printf("           %s = %.6f\n", FIELDS[i].name, next.*FIELDS[i].field);
+    }
+    best = next;
+    bestCost = nextCost;
+  }
+  double wall_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  printf("\n");
+  printCost("default", defaultCost);
+  printCost("tuned", bestCost);
+  printf("%.1f s\n\n", wall_s);
+  writeProfile(stdout, best, options);
+  if (options.output) {
+    FILE *out = fopen(options.output, "w");
+    if (!out) {
+      printf("can't write %s\n", options.output);
+      return 1;
+    }
+    writeProfile(out, best, options);
+    fclose(out);
+  }
+  return 0;
+}
@@ -0,0 +1,334 @@
+// Regression checks of Drawbotic_Navigation against the simulated DB1. Each check queues a small case that once went
+// wrong and confirms the library now handles it. See README.md
+
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+
+struct Check {
+  const char *name;
+  bool (*run)();
+};
+
+static bool expect(bool condition, const char *what) {
+  if (!condition)
+    printf("    failed: %s\n", what);
+  return condition;
+}
+
+// Step the simulation and the navigation together a millisecond at a time
+static void runFor(Drawbotic_Navigation &nav, double time_ms) {
+  for (double end = DB1.simTime_ms() + time_ms; DB1.simTime_ms() < end;) {
+    DB1.simStep(1);
+    nav.update(1);
+  }
+}
+
+static bool runUntilEmpty(Drawbotic_Navigation &nav, double timeout_ms = 60000) {
+  while (nav.getQueueSize() > 0) {
+    if (DB1.simTime_ms() > timeout_ms)
+      return false;
+    DB1.simStep(1);
+    nav.update(1);
+  }
+  return true;
+}
+
+// A stream that hands over everything sent to it at once and keeps the replies
+class TextStream : public Stream {
+public:
+  std::string input;
+  std::string replies;
+  int available() { return (int)input.size(); }
+  int read() {
+    if (input.empty())
+      return -1;
+    int c = (uint8_t)input[0];
+    input.erase(0, 1);
+    return c;
+  }
+  int peek() { return input.empty() ? -1 : (uint8_t)input[0]; }
+  size_t write(uint8_t value) {
+    replies += (char)value;
+    return 1;
+  }
+};
+
+// Starts and completions reported to the callbacks, by action type
+struct EventCounts {
+  int starts[Drawbotic_Navigation::NAV_POLYLINE + 1];
+  int completions[Drawbotic_Navigation::NAV_POLYLINE + 1];
+};
+
+static void countStart(NavigationHandle, uint8_t type, void *context) {
+  ((EventCounts *)context)->starts[type]++;
+}
+
+static void countCompletion(NavigationHandle, uint8_t type, void *context) {
+  ((EventCounts *)context)->completions[type]++;
+}
+
+// Handles to completed actions never match again while their slot is free, however many times it has been reused
+static bool checkStaleHandles() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(false);
+  NavigationHandle stale = nav.addStopAction(0);
+  bool ok = expect(stale != NAV_NO_HANDLE, "the first action is queued");
+  // a stop of 0 ms completes on its first step, and each new action takes the slot the last one gave back
+  for (int i = 0; i < 600 && ok; i++) {
+    nav.update(1);
+    ok &= expect(nav.getQueueSize() == 0, "the stop completes");
+    ok &= expect(!nav.isActionQueued(stale), "a stale handle isn't queued once its slot is free");
+    ok &= expect(!nav.cancelAction(stale), "a stale handle can't cancel a free slot");
+    ok &= expect(!nav.replaceAction(stale, stale), "a stale handle can't replace a free slot");
+    ok &= expect(nav.getQueueSize() == 0, "the queue is still empty");
+    NavigationHandle next = nav.addStopAction(0);
+    ok &= expect(next != NAV_NO_HANDLE && nav.isActionQueued(next), "the slot is queued again");
+  }
+  return ok;
+}
+
+// Moving the action being performed into the place of a later one keeps what is left of it for when it is reached
+static bool checkReplaceRunning() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(true);
+  EventCounts events;
+  memset(&events, 0, sizeof(events));
+  nav.onActionStart(countStart, &events);
+  nav.onActionComplete(countCompletion, &events);
+  NavigationHandle forward = nav.addForwardAction(100);
+  nav.addRotateAction(90);
+  NavigationHandle stop = nav.addStopAction(0);
+  runFor(nav, 300);
+
+  bool ok = expect(nav.getCurrentAction() == forward, "the forward action is being performed");
+  ok &= expect(nav.replaceAction(stop, forward), "the stop is replaced by the running forward action");
+  ok &= expect(nav.getQueueSize() == 2 && nav.isActionQueued(forward) && !nav.isActionQueued(stop), "the rotation and the forward action are left");
+  ok &= expect(runUntilEmpty(nav), "the queue finishes");
+
+  // part of the forward action is driven before the rotation and the rest after it
+  DB1_SimPose pose = DB1.simPose();
+  printf("    finished at x %.2f y %.2f heading %.2f\n", pose.x, pose.y, pose.heading);
+  ok &= expect(pose.x > 5 && pose.y > 5 && abs(pose.x + pose.y - 100) < 3, "DB-1 drives 100 mm in two parts");
+  ok &= expect(abs(pose.heading - 90) < 1, "the rotation is performed between them");
+  ok &= expect(events.starts[Drawbotic_Navigation::NAV_FORWARD] == 1 && events.completions[Drawbotic_Navigation::NAV_FORWARD] == 1,
+               "the forward action starts and completes once");
+  ok &= expect(events.starts[Drawbotic_Navigation::NAV_ROTATE] == 1 && events.completions[Drawbotic_Navigation::NAV_ROTATE] == 1,
+               "the rotation starts and completes once");
+  ok &= expect(events.starts[Drawbotic_Navigation::NAV_STOP] == 0, "the replaced stop never starts");
+  return ok;
+}
+
+// Every encoder signal counted while actions are performed is either part of an action or left in the residual, including
+// the ones counted over the step an action finishes on
+static bool checkCarryTicks() {
+  DB1.simReset();
+  DB1.simStub(true, 3, 3);
+  Drawbotic_Navigation nav(false);
+  const float distances[2] = { 100, 55.5f };
+  int32_t ticks = 0;
+  for (int i = 0; i < 2; i++) {
+    nav.addForwardAction(distances[i]);
+    ticks += (int32_t)lround(distances[i] * ENC_BITS_P_MM * FORWARD_ERROR);
+  }
+  int32_t steps = 0;
+  while (nav.getQueueSize() > 0 && steps < 100000) {
+    nav.update(1);
+    steps++;
+  }
+  nav.clearAllActions();
+  DB1.simStub(false);
+
+  printf("    %ld signals over %ld steps, %ld in the actions and %ld left over\n", (long)(3 * steps), (long)steps, (long)ticks,
+         (long)nav.getEncoderResidual());
+  bool ok = expect(3 * steps == ticks + nav.getEncoderResidual(), "the signals of every step are accounted for");
+
+  // a negative distance goes nowhere, so it has no overshoot to shorten the next forward action with
+  DB1.simReset();
+  Drawbotic_Navigation model(false);
+  model.addForwardAction(-50);
+  model.addForwardAction(100);
+  ok &= expect(runUntilEmpty(model), "the forward actions finish");
+  DB1_SimPose pose = DB1.simPose();
+  printf("    a forward of -50 mm then 100 mm finished at x %.2f\n", pose.x);
+  ok &= expect(abs(pose.x - 100) < 2, "DB-1 drives the whole 100 mm");
+  return ok;
+}
+
+// A rotation that follows one which went past its target turns its whole angle, less the overshoot, however large
+static bool checkCarryRotation() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(false);
+  nav.addRotateAction(45);
+  nav.addRotateAction(350);
+  bool ok = expect(runUntilEmpty(nav), "the rotations finish");
+  DB1_SimPose pose = DB1.simPose();
+  printf("    rotations of 45 and 350 degrees finished facing %.2f\n", pose.heading);
+  ok &= expect(abs(pose.heading - 395) < 3, "DB-1 turns 395 degrees in total");
+  return ok;
+}
+
+// optimize() only drops a rotation before a move to or curve that turns DB-1 to face somewhere else, and only when it
+// knows where DB-1 will be
+static bool checkRotateBeforeMove() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(true);
+  nav.addRotateAction(90);
+  nav.addMoveToAction(0, 0);
+  NavigationOptimizeResult result = nav.optimize();
+  bool ok = expect(result.actionsRemoved == 0 && nav.getQueueSize() == 2, "a rotation before a move to where DB-1 already is stays");
+  nav.clearAllActions();
+
+  const float points[4] = { 0.2f, 0, 0.4f, 0.3f };
+  nav.addRotateAction(90);
+  nav.addPolylineAction(points, 2);
+  result = nav.optimize();
+  ok &= expect(result.actionsRemoved == 0 && nav.getQueueSize() == 2, "a rotation before a polyline that stays where DB-1 is stays");
+  nav.clearAllActions();
+
+  nav.addRotateAction(90);
+  nav.addMoveToAction(0, 100);
+  result = nav.optimize();
+  ok &= expect(result.actionsRemoved == 1 && nav.getQueueSize() == 1, "a rotation before a move to somewhere else is dropped");
+  nav.clearAllActions();
+
+  // once DB-1 is part way along a forward action, where it will finish isn't known
+  nav.addForwardAction(100);
+  nav.addRotateAction(90);
+  nav.addMoveToAction(0, 100);
+  nav.update(1);
+  result = nav.optimize();
+  ok &= expect(result.actionsRemoved == 0 && nav.getQueueSize() == 3, "a rotation after an action that has started stays");
+  nav.clearAllActions();
+  return ok;
+}
+
+// optimize() drops a negative forward distance, which goes nowhere, instead of taking it off the forward action next to it
+static bool checkMergeForward() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(true);
+  nav.addForwardAction(-50);
+  nav.addForwardAction(100);
+  NavigationOptimizeResult result = nav.optimize();
+  bool ok = expect(result.actionsRemoved == 1 && nav.getQueueSize() == 1, "the negative forward action is dropped");
+  ok &= expect(runUntilEmpty(nav), "the forward action finishes");
+  DB1_SimPose pose = DB1.simPose();
+  printf("    finished at x %.2f\n", pose.x);
+  ok &= expect(abs(pose.x - 100) < 2, "DB-1 drives the whole 100 mm");
+  return ok;
+}
+
+// The longest command a sender can stream, a bezier through points far from the origin, fits in the line buffer
+static bool checkStreamLines() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(false);
+  TextStream link;
+  nav.beginStream(link);
+  link.input = "B -3276.70 -3276.70 -3276.70 -3276.70 -3276.70 -3276.70\r\n";
+  nav.update(1);
+  printf("    replies \"%s\"\n", link.replies.c_str());
+  bool ok = expect(link.replies.find('E') == std::string::npos, "the line isn't refused");
+  ok &= expect(nav.getStreamedActions() == 1 && nav.getQueueSize() == 1, "the bezier is queued");
+  nav.endStream();
+  nav.clearAllActions();
+  return ok;
+}
+
+// Lines of actions that aren't curves are granted all of the free queue, even while curves queued by the sketch hold
+// every chunk of curve points, and bezier lines are only granted once chunks are free
+static bool checkStreamGrants() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(false);
+  int curves = 0;
+  while (nav.addBezierAction(10, 0, 20, 0, 30, 0))
+    curves++;
+  TextStream link;
+  nav.beginStream(link);
+  nav.update(1);
+  printf("    %d curves hold the points, replies \"%s\"\n", curves, link.replies.c_str());
+  int grant = link.replies.compare(0, 2, "K ") == 0 ? atoi(link.replies.c_str() + 2) : 0;
+  bool ok = expect(grant == NAV_QUEUE_CAPACITY - curves, "the free queue slots are granted");
+  ok &= expect(link.replies.find('C') == std::string::npos, "no bezier lines are granted");
+  for (int i = 0; i < grant; i++)
+    link.input += "F 1\n";
+  link.replies.clear();
+  while (link.available() > 0)
+    nav.update(1);
+  ok &= expect(nav.getStreamedActions() == (uint32_t)grant && nav.getStreamErrors() == 0, "every line granted is queued");
+
+  nav.clearAllActions();
+  nav.update(1);
+  printf("    once the queue is cleared, replies \"%s\"\n", link.replies.c_str());
+  ok &= expect(link.replies.find("C ") != std::string::npos, "bezier lines are granted once the points are free");
+  nav.endStream();
+  return ok;
+}
+
+// Actions with values too large to store are rejected rather than clamped to something DB-1 wasn't asked to do
+static bool checkOutOfRange() {
+  DB1.simReset();
+  Drawbotic_Navigation nav(false);
+  bool ok = expect(nav.addRotateAction(3276.7f) != NAV_NO_HANDLE, "a rotation of 3276.7 degrees is queued");
+  ok &= expect(nav.addRotateAction(-3300) == NAV_NO_HANDLE, "a rotation beyond 3276.7 degrees is rejected");
+  ok &= expect(nav.addForwardAction(1e9f) == NAV_NO_HANDLE, "a distance too far to count in encoder signals is rejected");
+  ok &= expect(nav.addStopAction(5e9f) == NAV_NO_HANDLE, "a stop longer than 2^32 - 1 ms is rejected");
+  ok &= expect(nav.addMoveToAction(0, 3300) == NAV_NO_HANDLE, "a move to beyond 3276.7 mm is rejected");
+  ok &= expect(nav.addArcToAction(-3300, 0) == NAV_NO_HANDLE, "an arc to beyond 3276.7 mm is rejected");
+  const float points[4] = { 10, 10, 10, 4000 };
+  ok &= expect(nav.addPolylineAction(points, 2) == NAV_NO_HANDLE, "a polyline through a point beyond 3276.7 mm is rejected");
+  ok &= expect(nav.addRotateToAction(NAN) == NAV_NO_HANDLE, "a heading that isn't a number is rejected");
+  ok &= expect(nav.addTurnAction(1000, 2000) == NAV_NO_HANDLE, "a turn of more than 65535 signals is rejected");
+  ok &= expect(nav.getQueueSize() == 1, "only the rotation is queued");
+  nav.clearAllActions();
+
+  // a heading is wrapped rather than rejected, and faced the same way
+  nav.addRotateToAction(3690);
+  ok &= expect(runUntilEmpty(nav), "the rotation to 3690 degrees finishes");
+  DB1_SimPose pose = DB1.simPose();
+  printf("    faced %.2f degrees for 3690\n", pose.heading);
+  ok &= expect(abs(pose.heading - 90) < 1, "a heading of 3690 degrees faces 90");
+
+  // a program stops at an action it can't queue instead of trying it again on every update
+  static const uint8_t program[] PROGMEM = { NAV_PROG_STOP(0), NAV_PROG_TURN(1000, 2000), NAV_PROG_STOP(0), NAV_PROG_END };
+  nav.runProgram(program);
+  runFor(nav, 10);
+  ok &= expect(!nav.isProgramRunning() && nav.getProgramError() == 3, "the program stops with an error at the turn");
+  nav.clearAllActions();
+  return ok;
+}
+
+static const Check checks[] = {
+  { "stale-handles", checkStaleHandles },
+  { "replace-running", checkReplaceRunning },
+  { "carry-ticks", checkCarryTicks },
+  { "carry-rotation", checkCarryRotation },
+  { "rotate-before-move", checkRotateBeforeMove },
+  { "merge-forward", checkMergeForward },
+  { "stream-lines", checkStreamLines },
+  { "stream-grants", checkStreamGrants },
+  { "out-of-range", checkOutOfRange },
+};
+
+int main(int argc, char **argv) {
+  int failed = 0;
+  int run = 0;
+  for (size_t i = 0; i < sizeof(checks) / sizeof(checks[0]); i++) {
+    bool selected = argc < 2;
+    for (int a = 1; a < argc; a++)
+      selected |= strcmp(argv[a], checks[i].name) == 0;
+    if (!selected)
+      continue;
+    printf("%s\n", checks[i].name);
+    bool passed = checks[i].run();
+    printf("    %s\n", passed ? "ok" : "FAILED");
+    failed += !passed;
+    run++;
+  }
+  printf("%d of %d checks passed\n", run - failed, run);
+  return failed > 0 ? 1 : 0;
+}
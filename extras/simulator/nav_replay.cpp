@@ -0,0 +1,384 @@
+// Plays recordings made with Drawbotic_Navigation::beginRecording() back through the library on the host. Each step is
+// fed the encoder deltas and IMU headings the robot read, and the motor powers and pen movements it writes are compared
+// with the ones the robot wrote. See README.md
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+
+struct ReplayOptions {
+  float tolerance;      // largest difference in motor power that still counts as a match
+  int   show;           // number of differing steps to print
+  int   repeat;         // times to replay each recording, the fastest is reported
+  const char *csv;      // file to write every step to, or NULL
+};
+
+struct ReplayResult {
+  unsigned long updates;
+  unsigned long steps;      // steps in the recording
+  unsigned long calls;      // queue and settings calls replayed
+  unsigned long mismatched; // steps whose outputs differ
+  unsigned long missing;    // recorded steps the replay didn't perform
+  unsigned long extra;      // steps the replay performed that weren't recorded
+  long   firstMismatch;     // index of the first step that differs, -1 if none
+  double maxDifference;
+  bool   ended;             // the recording was finished with endRecording()
+  const char *error;        // why the recording couldn't be read, or NULL
+  double wall_ms;
+};
+
+// A step as the robot performed it, waiting for the update it belongs to
+struct RecordedStep {
+  float    m1;
+  float    m2;
+  uint8_t  pen;
+};
+
+// Reads the little-endian fields of a recording, any read past the end returns zero and marks the reader as short
+class RecordReader {
+public:
+  RecordReader(const std::vector<uint8_t> &data) : m_data(data), m_next(0), m_short(false) {}
+  bool more() const { return m_next < m_data.size(); }
+  bool isShort() const { return m_short; }
+  uint8_t byte() {
+    if (m_next >= m_data.size()) {
+      m_short = true;
+      return 0;
+    }
+    return m_data[m_next++];
+  }
+  uint16_t word() {
+    uint16_t low = byte();
+    return low | (uint16_t)(byte() << 8);
+  }
+  uint32_t dword() {
+    uint32_t low = word();
+    return low | ((uint32_t)word() << 16);
+  }
+  float single() {
+    uint32_t bits = dword();
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+  }
+
+private:
+  const std::vector<uint8_t> &m_data;
+  size_t m_next;
+  bool   m_short;
+};
+
+static bool readFile(const char *path, std::vector<uint8_t> &data) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+  uint8_t buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    data.insert(data.end(), buffer, buffer + length);
+  fclose(file);
+  return true;
+}
+
+static void applySettings(Drawbotic_Navigation &nav, RecordReader &in, int loops) {
+  float speed = in.single();
+  float rotateSpeed = in.single();
+  bool fixedTimestep = in.byte() != 0;
+  uint8_t maxCatchUp = in.byte();
+  float imuPeriod = in.single();
+  NavigationGains gains[Drawbotic_Navigation::NAV_LOOP_COUNT];
+  for (int i = 0; i < loops; i++) {
+    NavigationGains loop;
+    loop.feedforward = in.single();
+    loop.kp = in.single();
+    loop.ki = in.single();
+    loop.kd = in.single();
+    loop.integralLimit = in.single();
+    loop.outputLimit = in.single();
+    if (i < Drawbotic_Navigation::NAV_LOOP_COUNT)
+      gains[i] = loop;
+  }
+  NavigationCalibration calibration;
+  calibration.turnErrorLeft = in.single();
+  calibration.turnErrorRight = in.single();
+  calibration.rotateErrorLeft = in.single();
+  calibration.rotateErrorRight = in.single();
+  calibration.forwardError = in.single();
+  calibration.forwardKp = in.single();
+  calibration.rotateKp = in.single();
+  calibration.imuTolerance = in.single();
+  NavigationMotorOutput output;
+  output.deadband = in.single();
+  output.slewRate = in.single();
+  output.writeThreshold = in.single();
+  output.refresh_ms = in.single();
+
+  // the calibration sets the heading gain from the speed, the recorded gains then replace it with whatever it was
+  nav.setSpeed(speed, rotateSpeed);
+  nav.setCalibration(calibration);
+  nav.setMotorOutput(output);
+  for (int i = 0; i < loops && i < Drawbotic_Navigation::NAV_LOOP_COUNT; i++)
+    nav.setGains((Drawbotic_Navigation::NavigationLoop)i, gains[i]);
+  nav.setFixedTimestep(fixedTimestep, maxCatchUp);
+  nav.setIMUPeriod(imuPeriod);
+}
+
+static void applyAction(Drawbotic_Navigation &nav, RecordReader &in) {
+  uint8_t type = in.byte();
+  bool front = in.byte() != 0;
+  uint16_t count = in.word();
+  std::vector<float> v(count + 6, 0.0f);
+  for (uint16_t i = 0; i < count; i++)
+    v[i] = in.single();
+
+  switch (type) {
+  case Drawbotic_Navigation::NAV_FORWARD:   nav.addForwardAction(v[0], front); break;
+  case Drawbotic_Navigation::NAV_TURN:      nav.addTurnAction(v[0], v[1], front); break;
+  case Drawbotic_Navigation::NAV_ROTATE:    nav.addRotateAction(v[0], front); break;
+  case Drawbotic_Navigation::NAV_STOP:      nav.addStopAction(v[0], front); break;
+  case Drawbotic_Navigation::NAV_PEN_UP:
+  case Drawbotic_Navigation::NAV_PEN_DOWN:  nav.addPenAction(v[0] != 0, front); break;
+  case Drawbotic_Navigation::NAV_ROTATE_TO: nav.addRotateToAction(v[0], front); break;
+  case Drawbotic_Navigation::NAV_MOVE_TO:   nav.addMoveToAction(v[0], v[1], front); break;
+  case Drawbotic_Navigation::NAV_ARC_TO:    nav.addArcToAction(v[0], v[1], front); break;
+  case Drawbotic_Navigation::NAV_BEZIER:    nav.addBezierAction(v[0], v[1], v[2], v[3], v[4], v[5], front); break;
+  case Drawbotic_Navigation::NAV_POLYLINE:  nav.addPolylineAction(&v[0], count / 2, front); break;
+  }
+}
+
+// Compare the steps the replay just performed with the ones recorded for the same update
+static void compareSteps(std::deque<RecordedStep> &recorded, double time_ms, const ReplayOptions &options,
+                         ReplayResult *result, FILE *csv) {
+  float m1, m2;
+  uint8_t pen;
+  while (DB1.simPlaybackOutput(&m1, &m2, &pen)) {
+    if (recorded.empty()) {
+      result->extra++;
+      continue;
+    }
+    RecordedStep step = recorded.front();
+    recorded.pop_front();
+    double difference = fabs(step.m1 - m1) > fabs(step.m2 - m2) ? fabs(step.m1 - m1) : fabs(step.m2 - m2);
+    if (difference > result->maxDifference)
+      result->maxDifference = difference;
+    if (difference > options.tolerance || step.pen != pen) {
+      if (result->firstMismatch < 0)
+        result->firstMismatch = result->steps;
+      if ((long)result->mismatched < options.show)
+        printf("    step %lu at %.0f ms: recorded %.5f %.5f pen %d, replayed %.5f %.5f pen %d\n", result->steps, time_ms,
+               step.m1, step.m2, step.pen, m1, m2, pen);
+      result->mismatched++;
+    }
+    if (csv)
+      fprintf(csv, "%lu,%.0f,%.6f,%.6f,%d,%.6f,%.6f,%d\n", result->steps, time_ms, step.m1, step.m2, step.pen, m1, m2, pen);
+    result->steps++;
+  }
+  // the recording has steps the replay didn't perform
+  result->missing += recorded.size();
+  result->steps += recorded.size();
+  recorded.clear();
+}
+
+static ReplayResult replay(const std::vector<uint8_t> &data, const ReplayOptions &options, FILE *csv) {
+  ReplayResult result;
+  memset(&result, 0, sizeof(result));
+  result.firstMismatch = -1;
+
+  RecordReader in(data);
+  if (in.byte() != 'N' || in.byte() != 'R') {
+    result.error = "not a recording";
+    return result;
+  }
+  if (in.byte() != NAV_RECORD_VERSION) {
+    result.error = "recorded by a different version of the library";
+    return result;
+  }
+  bool useIMU = in.byte() != 0;
+  float updateRate = in.single();
+  int loops = in.byte();
+
+  DB1.simReset();
+  DB1.simPlayback(true);
+  Drawbotic_Navigation nav(useIMU, updateRate);
+  std::deque<RecordedStep> recorded;
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  while (in.more() && !result.ended && !result.error) {
+    uint8_t tag = in.byte();
+    switch (tag) {
+    case NAV_REC_SETTINGS:
+      applySettings(nav, in, loops);
+      result.calls++;
+      break;
+    case NAV_REC_VELOCITY:
+      nav.setVelocityControl(in.byte() != 0);
+      result.calls++;
+      break;
+    case NAV_REC_POSE: {
+      float x = in.single();
+      float y = in.single();
+      nav.setPose(x, y, in.single());
+      result.calls++;
+      break;
+    }
+    case NAV_REC_ACTION:
+      applyAction(nav, in);
+      result.calls++;
+      break;
+    case NAV_REC_CLEAR:
+      nav.clearAllActions();
+      result.calls++;
+      break;
+    case NAV_REC_OPTIMIZE:
+      nav.optimize(in.byte() != 0);
+      result.calls++;
+      break;
+    case NAV_REC_CANCEL:
+      // the replay queues the same actions into the same slots, so the recorded handles refer to them
+      nav.cancelAction((NavigationHandle)in.dword());
+      result.calls++;
+      break;
+    case NAV_REC_REPLACE: {
+      NavigationHandle action = (NavigationHandle)in.dword();
+      nav.replaceAction(action, (NavigationHandle)in.dword());
+      result.calls++;
+      break;
+    }
+    case NAV_REC_SPEED: {
+      NavigationHandle action = (NavigationHandle)in.dword();
+      nav.setActionSpeed(action, in.single());
+      result.calls++;
+      break;
+    }
+    case NAV_REC_HEADING:
+      nav.setIMUHeading(in.single());
+      result.calls++;
+      break;
+    case NAV_REC_IMU:
+      DB1.simPlaybackHeading(in.single());
+      break;
+    case NAV_REC_STEP: {
+      int16_t delta1 = (int16_t)in.word();
+      int16_t delta2 = (int16_t)in.word();
+      RecordedStep step;
+      step.m1 = in.single();
+      step.m2 = in.single();
+      step.pen = in.byte();
+      DB1.simPlaybackStep(delta1, delta2);
+      recorded.push_back(step);
+      break;
+    }
+    case NAV_REC_UPDATE: {
+      uint32_t time_ms = in.dword();
+      float deltaTime_ms = in.single();
+      DB1.simSetTime_us((uint64_t)time_ms * 1000);
+      nav.update(deltaTime_ms);
+      compareSteps(recorded, time_ms, options, &result, csv);
+      result.updates++;
+      break;
+    }
+    case NAV_REC_END:
+      result.ended = true;
+      break;
+    default:
+      result.error = "unknown record";
+      break;
+    }
+    // a record cut off part way through can only be the end of a recording that was never finished
+    if (in.isShort())
+      break;
+  }
+  result.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  return result;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [--tolerance power] [--show n] [--repeat n] [--csv file] recording...\n", name);
+}
+
+int main(int argc, char **argv) {
+  ReplayOptions options;
+  options.tolerance = 0;
+  options.show = 5;
+  options.repeat = 1;
+  options.csv = NULL;
+  std::vector<const char *> paths;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--tolerance") == 0 && i + 1 < argc)
+      options.tolerance = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--show") == 0 && i + 1 < argc)
+      options.show = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+      options.repeat = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--csv") == 0 && i + 1 < argc)
+      options.csv = argv[++i];
+    else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 2;
+    }
+    else
+      paths.push_back(argv[i]);
+  }
+  if (paths.empty()) {
+    usage(argv[0]);
+    return 2;
+  }
+  if (options.repeat < 1)
+    options.repeat = 1;
+
+  FILE *csv = NULL;
+  if (options.csv) {
+    csv = fopen(options.csv, "w");
+    if (!csv) {
+      printf("can't write %s\n", options.csv);
+      return 2;
+    }
+    fprintf(csv, "step,time_ms,recorded_m1,recorded_m2,recorded_pen,replayed_m1,replayed_m2,replayed_pen\n");
+  }
+
+  int status = 0;
+  printf("%-32s %8s %9s %10s %10s %12s %10s\n", "recording", "updates", "steps", "differ", "max_diff", "ns/update", "speedup");
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::vector<uint8_t> data;
+    if (!readFile(paths[i], data)) {
+      printf("%-32s can't read\n", paths[i]);
+      status = 2;
+      continue;
+    }
+
+    // replay several times for a steadier timing, the results are the same every time
+    ReplayResult result = replay(data, options, csv);
+    ReplayOptions quiet = options;
+    quiet.show = 0;
+    for (int r = 1; r < options.repeat && !result.error; r++) {
+      ReplayResult again = replay(data, quiet, NULL);
+      if (again.wall_ms < result.wall_ms)
+        result.wall_ms = again.wall_ms;
+    }
+    if (result.error) {
+      printf("%-32s %s\n", paths[i], result.error);
+      status = 2;
+      continue;
+    }
+
+    double recorded_ms = DB1.simTime_ms();
+    printf("%-32s %8lu %9lu %10lu %10.6f %12.1f %9.0fx%s\n", paths[i], result.updates, result.steps,
+           result.mismatched + result.missing + result.extra, result.maxDifference,
+           result.updates > 0 ? result.wall_ms * 1e6 / result.updates : 0.0, result.wall_ms > 0 ? recorded_ms / result.wall_ms : 0.0,
+           result.ended ? "" : "  (unfinished)");
+    if (result.missing > 0 || result.extra > 0)
+      printf("    %lu recorded steps weren't replayed, %lu replayed steps weren't recorded\n", result.missing, result.extra);
+    if (result.firstMismatch >= 0)
+      printf("    first difference at step %ld\n", result.firstMismatch);
+    if (result.mismatched + result.missing + result.extra > 0 && status == 0)
+      status = 1;
+  }
+  if (csv)
+    fclose(csv);
+  return status;
+}
@@ -0,0 +1,559 @@
+// Deterministic host harness for Drawbotic_Navigation. Runs a set of standard queues against the
+// simulated DB1 and reports completion time and final pose error for each. See README.md
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+#include "sim_scenarios.h"
+
+struct SimOptions {
+  bool     useIMU;
+  bool     fixedTimestep;
+  float    dt_ms;
+  int      jitter_ms;
+  float    timeout_s;
+  uint32_t seed;
+  bool     stats;
+  bool     optimize;
+  bool     velocity;
+  float    speed;
+  float    battery;
+  bool     stream;
+  float    baud;
+  bool     program;
+  const char *record;   // prefix of the file each scenario is recorded to, or NULL
+  float    traction;
+  bool     idle;
+  bool     feed;
+  NavigationMotorOutput motor;
+};
+
+struct SimResult {
+  double time_s;
+  double positionError_mm;
+  double headingError_deg;
+  double estimateError_mm;
+  double wall_ms;
+  bool   timedOut;
+  unsigned long lateTicks;
+  unsigned long missedTicks;
+  int    actionsRemoved;
+  float  travelSaved_mm;
+  bool   streamed;
+  double starved_ms;
+  unsigned long streamedActions;
+  unsigned long streamErrors;
+  size_t programBytes;      // size of the compiled program, 0 if the scenario wasn't run as one
+  size_t programRepeats;
+  long   programError;
+  double writesPerStep;     // motor powers written to DB1 per navigation step
+  double slept_ms;
+  unsigned long updates;
+  unsigned long starts;     // actions reported to onActionStart() with --feed
+  unsigned long completions;
+  unsigned long lowCalls;   // calls to onQueueLow(), each topping the queue back up
+  double empty_ms;          // time the queue was empty with actions still to feed
+};
+
+// Feeds a scenario to the queue from the callbacks, like a planner that only queues its next few actions
+struct SimFeeder {
+  Drawbotic_Navigation *nav;
+  const std::vector<SimStep> *steps;
+  size_t *next;
+  SimResult *result;
+};
+
+static void feedActions(SimFeeder *feeder) {
+  // just enough for the speed planning to see the next NAV_LOOKAHEAD actions
+  while (*feeder->next < feeder->steps->size() && feeder->nav->getQueueSize() <= NAV_LOOKAHEAD) {
+    enqueue(*feeder->nav, (*feeder->steps)[*feeder->next]);
+    (*feeder->next)++;
+  }
+}
+
+static void feederStart(NavigationHandle, uint8_t, void *context) {
+  ((SimFeeder *)context)->result->starts++;
+}
+
+static void feederComplete(NavigationHandle, uint8_t, void *context) {
+  ((SimFeeder *)context)->result->completions++;
+}
+
+static void feederLow(int, void *context) {
+  SimFeeder *feeder = (SimFeeder *)context;
+  feeder->result->lowCalls++;
+  feedActions(feeder);
+}
+
+// A serial link between a simulated sender and DB-1. Lines from the sender arrive at the baud rate, replies from DB-1
+// are delivered straight away
+class SimLink : public Stream {
+public:
+  SimLink(float baud) : m_bytesPerMs(baud / 10000.0f), m_allowance(0) {}
+
+  int available() { return (int)m_received.size(); }
+  int read() {
+    if (m_received.empty())
+      return -1;
+    int c = m_received.front();
+    m_received.pop_front();
+    return c;
+  }
+  int peek() { return m_received.empty() ? -1 : m_received.front(); }
+  size_t write(uint8_t value) {
+    m_replies.push_back((char)value);
+    return 1;
+  }
+
+  void send(const std::string &line) { m_wire.insert(m_wire.end(), line.begin(), line.end()); }
+  void advance(float ms) {
+    m_allowance += m_bytesPerMs * ms;
+    while (m_allowance >= 1 && !m_wire.empty()) {
+      m_received.push_back((uint8_t)m_wire.front());
+      m_wire.pop_front();
+      m_allowance -= 1;
+    }
+    // an idle line can't save up bytes to send faster later
+    if (m_wire.empty() && m_allowance > 1)
+      m_allowance = 1;
+  }
+  bool idle() const { return m_wire.empty() && m_received.empty(); }
+  bool reply(std::string *line) {
+    size_t end = m_replies.find('\n');
+    if (end == std::string::npos)
+      return false;
+    *line = m_replies.substr(0, end);
+    m_replies.erase(0, end + 1);
+    return true;
+  }
+
+private:
+  float m_bytesPerMs;     // 10 bits on the wire per byte
+  float m_allowance;
+  std::deque<char> m_wire;
+  std::deque<uint8_t> m_received;
+  std::string m_replies;
+};
+
+
+// The stream command line for a step, or an empty string for polylines which can't be streamed
+static std::string streamLine(const SimStep &s) {
+  char line[96];
+  switch (s.type) {
+  case 'F': case 'R': case 'S': case 'P': case 'H':
+    snprintf(line, sizeof(line), "%c %g\n", s.type, s.a);
+    break;
+  case 'T': case 'M': case 'A':
+    snprintf(line, sizeof(line), "%c %g %g\n", s.type, s.a, s.b);
+    break;
+  case 'B':
+    snprintf(line, sizeof(line), "B %g %g %g %g %g %g\n", s.a, s.b, s.c, s.d, s.e, s.f);
+    break;
+  default:
+    return std::string();
+  }
+  return line;
+}
+
+// Writes a recording made with beginRecording() to a file
+class FilePrint : public Print {
+public:
+  explicit FilePrint(FILE *file) : m_file(file) {}
+  size_t write(uint8_t value) { return fputc(value, m_file) == EOF ? 0 : 1; }
+  size_t write(const uint8_t *buffer, size_t size) { return fwrite(buffer, 1, size, m_file); }
+
+private:
+  FILE *m_file;
+};
+
+static void programTenths(std::vector<uint8_t> &program, float value) {
+  int16_t tenths = (int16_t)(value * 10 + (value < 0 ? -0.5f : 0.5f));
+  program.push_back((uint8_t)((uint16_t)tenths & 0xFF));
+  program.push_back((uint8_t)((uint16_t)tenths >> 8));
+}
+
+// Append the instruction for a step to a program, returns false for polylines which programs can't hold
+static bool programStep(std::vector<uint8_t> &program, const SimStep &s) {
+  switch (s.type) {
+  case 'F': program.push_back(NAV_OP_FORWARD); programTenths(program, s.a); break;
+  case 'T': program.push_back(NAV_OP_TURN); programTenths(program, s.a); programTenths(program, s.b); break;
+  case 'R': program.push_back(NAV_OP_ROTATE); programTenths(program, s.a); break;
+  case 'S': {
+    uint16_t time = (uint16_t)s.a;
+    uint8_t bytes[] = { NAV_PROG_STOP(time) };
+    program.insert(program.end(), bytes, bytes + sizeof(bytes));
+    break;
+  }
+  case 'P': program.push_back(s.a != 0 ? NAV_OP_PEN_DOWN : NAV_OP_PEN_UP); break;
+  case 'M': program.push_back(NAV_OP_MOVE_TO); programTenths(program, s.a); programTenths(program, s.b); break;
+  case 'H': program.push_back(NAV_OP_ROTATE_TO); programTenths(program, s.a); break;
+  case 'A': program.push_back(NAV_OP_ARC_TO); programTenths(program, s.a); programTenths(program, s.b); break;
+  case 'B':
+    program.push_back(NAV_OP_BEZIER);
+    programTenths(program, s.a); programTenths(program, s.b); programTenths(program, s.c);
+    programTenths(program, s.d); programTenths(program, s.e); programTenths(program, s.f);
+    break;
+  default:
+    return false;
+  }
+  return true;
+}
+
+// Compile a scenario into a program for runProgram(), folding runs of up to eight steps that repeat into repeat blocks
+static bool compileProgram(const std::vector<SimStep> &steps, std::vector<uint8_t> &program, size_t *repeats) {
+  *repeats = 0;
+  size_t i = 0;
+  while (i < steps.size()) {
+    std::vector<uint8_t> single;
+    if (!programStep(single, steps[i]))
+      return false;
+
+    // find the block length that takes the most steps out of the program
+    size_t bestLength = 1;
+    size_t bestCount = 1;
+    for (size_t length = 1; length <= 8 && i + length * 2 <= steps.size(); length++) {
+      size_t count = 1;
+      while (count < 255 && i + length * (count + 1) <= steps.size()) {
+        bool same = true;
+        for (size_t k = 0; k < length && same; k++) {
+          std::vector<uint8_t> a, b;
+          same = programStep(a, steps[i + k]) && programStep(b, steps[i + length * count + k]) && a == b;
+        }
+        if (!same)
+          break;
+        count++;
+      }
+      if (count > 1 && length * (count - 1) > bestLength * (bestCount - 1)) {
+        bestLength = length;
+        bestCount = count;
+      }
+    }
+
+    if (bestCount > 1) {
+      uint8_t repeat[] = { NAV_PROG_REPEAT(bestCount) };
+      program.insert(program.end(), repeat, repeat + sizeof(repeat));
+      for (size_t k = 0; k < bestLength; k++)
+        programStep(program, steps[i + k]);
+      program.push_back(NAV_PROG_LOOP);
+      (*repeats)++;
+      i += bestLength * bestCount;
+    }
+    else {
+      program.insert(program.end(), single.begin(), single.end());
+      i++;
+    }
+  }
+  program.push_back(NAV_PROG_END);
+  return true;
+}
+
+static SimResult runScenario(const Scenario &scenario, const SimOptions &options) {
+  DB1_SimParams params = Drawbotic_DB1::defaultParams();
+  params.seed = options.seed;
+  params.m1Gain *= options.battery;
+  params.m2Gain *= options.battery;
+  params.traction_mm_s2 = options.traction;
+  DB1.simReset(params);
+
+  Drawbotic_Navigation nav(options.useIMU);
+  nav.setFixedTimestep(options.fixedTimestep);
+  if (options.speed > 0)
+    nav.setSpeed(options.speed);
+  nav.setVelocityControl(options.velocity);
+  nav.setMotorOutput(options.motor);
+  FILE *recording = NULL;
+  if (options.record) {
+    std::string path = std::string(options.record) + scenario.name + ".nrec";
+    recording = fopen(path.c_str(), "wb");
+    if (!recording)
+      printf("    can't write %s\n", path.c_str());
+  }
+  FilePrint recorder(recording);
+  if (recording)
+    nav.beginRecording(recorder);
+  uint32_t rng = options.seed * 2654435761u + 1;
+  float sinceUpdate_ms = 0;
+  float nextUpdate_ms = options.dt_ms;
+  size_t next = 0;
+  size_t queued = 0;
+  SimResult result;
+  result.timedOut = false;
+  result.actionsRemoved = 0;
+  result.travelSaved_mm = 0;
+  result.starved_ms = 0;
+  result.slept_ms = 0;
+  result.updates = 0;
+  result.starts = 0;
+  result.completions = 0;
+  result.lowCalls = 0;
+  result.empty_ms = 0;
+
+  // Stream the scenario over a simulated serial link instead of queuing it directly, unless it holds a polyline
+  result.streamed = options.stream;
+  for (size_t i = 0; i < scenario.steps.size(); i++)
+    result.streamed &= !streamLine(scenario.steps[i]).empty();
+  SimLink link(options.baud);
+  int credit = 0;
+  int curveCredit = 0;
+  if (result.streamed)
+    nav.beginStream(link);
+
+  // Or run it as a program, which queues its own actions as they are needed
+  std::vector<uint8_t> program;
+  result.programBytes = 0;
+  result.programRepeats = 0;
+  result.programError = -1;
+  if (options.program && !result.streamed && compileProgram(scenario.steps, program, &result.programRepeats)) {
+    result.programBytes = program.size();
+    nav.runProgram(&program[0]);
+    next = scenario.steps.size();
+  }
+
+  // Or queue the first few actions and the rest from the callbacks as the queue runs low
+  SimFeeder feeder = { &nav, &scenario.steps, &next, &result };
+  if (options.feed && !result.streamed && result.programBytes == 0) {
+    nav.onActionStart(feederStart, &feeder);
+    nav.onActionComplete(feederComplete, &feeder);
+    nav.onQueueLow(feederLow, NAV_LOOKAHEAD, &feeder);
+    feedActions(&feeder);
+  }
+
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  for (;;) {
+    if (result.streamed) {
+      // The sender only sends as many lines, and bezier lines, as DB-1 has asked for
+      std::string reply;
+      while (link.reply(&reply)) {
+        if (reply[0] == 'K')
+          credit += atoi(reply.c_str() + 2);
+        else if (reply[0] == 'C')
+          curveCredit += atoi(reply.c_str() + 2);
+      }
+      while (credit > 0 && next < scenario.steps.size()) {
+        bool curve = scenario.steps[next].type == 'B';
+        if (curve && curveCredit == 0)
+          break;
+        link.send(streamLine(scenario.steps[next]));
+        next++;
+        credit--;
+        curveCredit -= curve;
+      }
+      if (nav.getQueueSize() == 0 && (next < scenario.steps.size() || !link.idle()))
+        result.starved_ms += options.dt_ms;
+    }
+    else if (options.feed && result.programBytes == 0) {
+      if (nav.getQueueSize() == 0 && next < scenario.steps.size())
+        result.empty_ms += options.dt_ms;
+    }
+    else {
+      // Keep the queue topped up so scenarios longer than the queue capacity can run
+      while (next < scenario.steps.size() && nav.getQueueSize() < nav.getQueueCapacity()) {
+        enqueue(nav, scenario.steps[next]);
+        next++;
+      }
+    }
+    if (options.optimize && next > queued) {
+      // strokes can only be reordered before the first action starts
+      NavigationOptimizeResult optimized = nav.optimize(queued == 0);
+      result.actionsRemoved += optimized.actionsRemoved;
+      result.travelSaved_mm += optimized.travelSaved_mm;
+      queued = next;
+    }
+    if (nav.getQueueSize() == 0 && next == scenario.steps.size() && link.idle() && !nav.isProgramRunning())
+      break;
+    if (DB1.simTime_ms() > options.timeout_s * 1000.0) {
+      result.timedOut = true;
+      break;
+    }
+    // Sleep through the time update() has nothing to do, like a sketch that calls idleUntilNeeded() after update()
+    double slept_ms = 0;
+    if (options.idle && !result.streamed && nav.getQueueSize() > 0 && nav.getIdleTime() > options.dt_ms) {
+      double before_ms = DB1.simTime_ms();
+      nav.idleUntilNeeded();
+      slept_ms = DB1.simTime_ms() - before_ms;
+      result.slept_ms += slept_ms;
+    }
+    if (slept_ms > 0) {
+      link.advance((float)slept_ms);
+      sinceUpdate_ms += (float)slept_ms;
+    }
+    else {
+      DB1.simStep(options.dt_ms);
+      link.advance(options.dt_ms);
+      sinceUpdate_ms += options.dt_ms;
+    }
+
+    // Simulate a sketch whose loop() sometimes takes longer than usual before calling update
+    if (sinceUpdate_ms >= nextUpdate_ms) {
+      nav.update(sinceUpdate_ms);
+      result.updates++;
+      sinceUpdate_ms = 0;
+      nextUpdate_ms = options.dt_ms;
+      if (options.jitter_ms > 0) {
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        nextUpdate_ms += options.dt_ms * (rng % (options.jitter_ms + 1));
+      }
+    }
+  }
+  std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+  if (recording) {
+    nav.endRecording();
+    fclose(recording);
+  }
+
+  DB1_SimPose actual = DB1.simPose();
+  DB1_SimPose ideal = idealPose(scenario.steps);
+  double headingError = fmod(actual.heading - ideal.heading, 360.0);
+  if (headingError > 180.0) headingError -= 360.0;
+  if (headingError < -180.0) headingError += 360.0;
+
+  result.time_s = DB1.simTime_ms() / 1000.0;
+  result.positionError_mm = hypot(actual.x - ideal.x, actual.y - ideal.y);
+  result.headingError_deg = headingError;
+  NavigationPose estimate = nav.getPose();
+  result.estimateError_mm = hypot(actual.x - estimate.x, actual.y - estimate.y);
+  result.streamedActions = nav.getStreamedActions();
+  result.streamErrors = nav.getStreamErrors();
+  result.programError = nav.getProgramError();
+  result.lateTicks = nav.getLateTicks();
+  result.missedTicks = nav.getMissedTicks();
+  result.writesPerStep = DB1.simEncoderReads() > 0 ? (double)DB1.simMotorWrites() / DB1.simEncoderReads() : 0.0;
+  result.wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+#ifdef NAV_INSTRUMENTATION
+  if (options.stats) {
+    static const char *typeNames[] = { "forward", "turn", "rotate", "stop", "pen-up", "pen-down", "rotate-to", "move-to", "arc-to", "bezier", "polyline" };
+    NavigationActionStats stats;
+    for (int i = NAV_STATS_HISTORY - 1; i >= 0; i--) {
+      if (nav.getActionStats(i, &stats))
+        printf("    %-10s %8lu ms %8lu steps  error %8.2f  peak correction %.4f\n", typeNames[stats.type],
+               (unsigned long)stats.duration_ms, (unsigned long)stats.steps, stats.finalError, stats.peakCorrection);
+    }
+    printf("    step us:");
+    for (int i = 0; i < NAV_HISTOGRAM_BUCKETS; i++) {
+      if (nav.getStepTimeHistogram(i) > 0)
+        printf(" <%lu:%lu", 2ul << i, (unsigned long)nav.getStepTimeHistogram(i));
+    }
+    printf("\n");
+  }
+#endif
+  return result;
+}
+
+static void usage(const char *name) {
+  printf("usage: %s [--no-imu] [--fixed] [--dt ms] [--jitter steps] [--seed n] [--timeout s] [--stats] [--optimize] [--velocity] [--speed power] [--battery gain] [--stream] [--baud rate] [--program] [--record prefix] [--slip mm/s2] [--slew rate] [--deadband power] [--threshold power] [--idle] [--feed] [scenario...]\n", name);
+}
+
+int main(int argc, char **argv) {
+  SimOptions options;
+  options.useIMU = true;
+  options.fixedTimestep = false;
+  options.dt_ms = 1.0f;
+  options.jitter_ms = 0;
+  options.timeout_s = 600.0f;
+  options.seed = 1;
+  options.stats = false;
+  options.optimize = false;
+  options.velocity = false;
+  options.speed = 0;
+  options.battery = 1.0f;
+  options.stream = false;
+  options.baud = 115200;
+  options.program = false;
+  options.record = NULL;
+  options.traction = 0;
+  options.idle = false;
+  options.feed = false;
+  options.motor = Drawbotic_Navigation::defaultMotorOutput();
+  std::vector<const char *> only;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--no-imu") == 0)
+      options.useIMU = false;
+    else if (strcmp(argv[i], "--fixed") == 0)
+      options.fixedTimestep = true;
+    else if (strcmp(argv[i], "--dt") == 0 && i + 1 < argc)
+      options.dt_ms = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--jitter") == 0 && i + 1 < argc)
+      options.jitter_ms = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+      options.seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--timeout") == 0 && i + 1 < argc)
+      options.timeout_s = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--stats") == 0)
+      options.stats = true;
+    else if (strcmp(argv[i], "--optimize") == 0)
+      options.optimize = true;
+    else if (strcmp(argv[i], "--velocity") == 0)
+      options.velocity = true;
+    else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc)
+      options.speed = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--battery") == 0 && i + 1 < argc)
+      options.battery = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--stream") == 0)
+      options.stream = true;
+    else if (strcmp(argv[i], "--baud") == 0 && i + 1 < argc)
+      options.baud = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--program") == 0)
+      options.program = true;
+    else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+      options.record = argv[++i];
+    else if (strcmp(argv[i], "--idle") == 0)
+      options.idle = true;
+    else if (strcmp(argv[i], "--feed") == 0)
+      options.feed = true;
+    else if (strcmp(argv[i], "--slip") == 0 && i + 1 < argc)
+      options.traction = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--slew") == 0 && i + 1 < argc)
+      options.motor.slewRate = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--deadband") == 0 && i + 1 < argc)
+      options.motor.deadband = (float)atof(argv[++i]);
+    else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc)
+      options.motor.writeThreshold = (float)atof(argv[++i]);
+    else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    }
+    else
+      only.push_back(argv[i]);
+  }
+
+  printf("%-20s %8s %10s %12s %12s %12s %8s %8s %8s %10s\n", "scenario", "actions", "time_s", "pos_err_mm", "head_err_deg", "est_err_mm", "late", "missed", "writes", "speedup");
+  std::vector<Scenario> scenarios = makeScenarios();
+  double totalTime = 0;
+  for (size_t i = 0; i < scenarios.size(); i++) {
+    bool selected = only.empty();
+    for (size_t j = 0; j < only.size(); j++)
+      selected |= strcmp(only[j], scenarios[i].name) == 0;
+    if (!selected)
+      continue;
+
+    SimResult r = runScenario(scenarios[i], options);
+    totalTime += r.time_s;
+    printf("%-20s %8u %10.3f %12.2f %12.2f %12.2f %8lu %8lu %8.2f %9.0fx%s\n", scenarios[i].name, (unsigned)scenarios[i].steps.size(),
+           r.time_s, r.positionError_mm, r.headingError_deg, r.estimateError_mm, r.lateTicks, r.missedTicks, r.writesPerStep, r.wall_ms > 0 ? r.time_s * 1000.0 / r.wall_ms : 0.0,
+           r.timedOut ? "  TIMEOUT" : "");
+    if (r.streamed)
+      printf("    streamed %lu actions (%.0f per second), %lu errors, queue starved for %.0f ms\n", r.streamedActions,
+             r.time_s > 0 ? r.streamedActions / r.time_s : 0.0, r.streamErrors, r.starved_ms);
+    if (r.programBytes > 0)
+      printf("    program of %lu bytes with %lu repeat blocks%s\n", (unsigned long)r.programBytes, (unsigned long)r.programRepeats,
+             r.programError >= 0 ? ", stopped by an invalid instruction" : "");
+    if (options.idle)
+      printf("    asleep for %.1f%% of the time, %lu calls to update()\n", r.time_s > 0 ? r.slept_ms / (r.time_s * 10.0) : 0.0, r.updates);
+    if (r.lowCalls > 0)
+      printf("    fed by %lu calls to onQueueLow(), %lu starts and %lu completions reported, queue empty for %.0f ms\n", r.lowCalls,
+             r.starts, r.completions, r.empty_ms);
+    if (options.optimize)
+      printf("    optimize removed %d actions, saved %.1f mm of pen up travel\n", r.actionsRemoved, r.travelSaved_mm);
+  }
+  printf("%-20s %8s %10.3f\n", "total", "", totalTime);
+  return 0;
+}
@@ -0,0 +1,192 @@
+#include "sim_scenarios.h"
+
+static void addPolygon(std::vector<SimStep> &steps, float side_mm, int sides) {
+  for (int i = 0; i < sides; i++) {
+    steps.push_back({ 'F', side_mm, 0 });
+    steps.push_back({ 'R', 360.0f / sides, 0 });
+  }
+}
+
+std::vector<Scenario> makeScenarios() {
+  std::vector<Scenario> scenarios;
+
+  Scenario square = { "square-100", {} };
+  addPolygon(square.steps, 100, 4);
+  scenarios.push_back(square);
+
+  Scenario octagon = { "octagon-50", {} };
+  addPolygon(octagon.steps, 50, 8);
+  scenarios.push_back(octagon);
+
+  Scenario star = { "star-20", {} };
+  for (int i = 0; i < 20; i++) {
+    star.steps.push_back({ 'F', 30, 0 });
+    star.steps.push_back({ 'R', i % 2 ? -144.0f : 144.0f, 0 });
+  }
+  scenarios.push_back(star);
+
+  Scenario closedStar = star;
+  closedStar.name = "star-20-closed";
+  closedStar.steps.push_back({ 'M', 0, 0 });
+  closedStar.steps.push_back({ 'H', 0, 0 });
+  scenarios.push_back(closedStar);
+
+  Scenario arcs = { "s-curves", {} };
+  for (int i = 0; i < 6; i++) {
+    arcs.steps.push_back({ 'T', 150, 90 });
+    arcs.steps.push_back({ 'T', 150, -90 });
+  }
+  scenarios.push_back(arcs);
+
+  Scenario rounded = { "rounded-square", {} };
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 10; j++)
+      rounded.steps.push_back({ 'F', 10, 0 });
+    rounded.steps.push_back({ 'T', 30, 90 });
+  }
+  scenarios.push_back(rounded);
+
+  Scenario rotations = { "rotations", {} };
+  for (int i = 0; i < 12; i++) {
+    rotations.steps.push_back({ 'R', 45, 0 });
+    rotations.steps.push_back({ 'R', -90, 0 });
+    rotations.steps.push_back({ 'R', 45, 0 });
+  }
+  scenarios.push_back(rotations);
+
+  Scenario strokes = { "pen-strokes", {} };
+  for (int i = 0; i < 20; i++) {
+    strokes.steps.push_back({ 'P', 1, 0 });
+    strokes.steps.push_back({ 'F', 40, 0 });
+    strokes.steps.push_back({ 'P', 0, 0 });
+    strokes.steps.push_back({ 'S', 50, 0 });
+    strokes.steps.push_back({ 'R', 90, 0 });
+    strokes.steps.push_back({ 'F', 10, 0 });
+    strokes.steps.push_back({ 'R', -90, 0 });
+  }
+  scenarios.push_back(strokes);
+
+  // Short strokes visited in a poor order with pen up travel between them, finishing back at the origin
+  Scenario scattered = { "scattered-strokes", {} };
+  for (int i = 0; i < 10; i++) {
+    scattered.steps.push_back({ 'M', (i % 2) * 200.0f + i * 10.0f, (i % 3) * 60.0f });
+    scattered.steps.push_back({ 'H', 90, 0 });
+    scattered.steps.push_back({ 'P', 1, 0 });
+    scattered.steps.push_back({ 'F', 20, 0 });
+    scattered.steps.push_back({ 'P', 0, 0 });
+  }
+  scattered.steps.push_back({ 'M', 0, 0 });
+  scattered.steps.push_back({ 'H', 0, 0 });
+  scenarios.push_back(scattered);
+
+  // The same circle drawn as 36 forward and rotate pairs, and as a single polyline action
+  Scenario polygonCircle = { "circle-36gon", {} };
+  addPolygon(polygonCircle.steps, 2 * 50 * sin(M_PI / 36), 36);
+  scenarios.push_back(polygonCircle);
+
+  Scenario polylineCircle = { "circle-polyline", {} };
+  SimStep circle = { 'L', 0, 0 };
+  for (int i = 1; i <= 36; i++) {
+    double angle = i * M_PI / 18 - M_PI / 2;
+    circle.points.push_back((float)(50 * cos(angle)));
+    circle.points.push_back((float)(50 + 50 * sin(angle)));
+  }
+  polylineCircle.steps.push_back(circle);
+  scenarios.push_back(polylineCircle);
+
+  // A wave of bezier curves joined smoothly, then arcs that carry on from the current heading
+  Scenario curves = { "bezier-arcs", {} };
+  for (int i = 0; i < 4; i++) {
+    float x = i * 80.0f;
+    curves.steps.push_back({ 'B', x + 30, i % 2 ? -40.0f : 40.0f, x + 50, i % 2 ? -40.0f : 40.0f, x + 80, 0 });
+  }
+  curves.steps.push_back({ 'A', 320, -100 });
+  curves.steps.push_back({ 'A', 220, -100 });
+  curves.steps.push_back({ 'M', 0, 0 });
+  curves.steps.push_back({ 'H', 0, 0 });
+  scenarios.push_back(curves);
+
+  // Hundreds of very short actions, to check the queue can be refilled over a stream faster than it empties
+  Scenario burst = { "short-actions", {} };
+  for (int i = 0; i < 100; i++) {
+    burst.steps.push_back({ 'S', 5 });
+    burst.steps.push_back({ 'F', 1 });
+    burst.steps.push_back({ 'R', i % 2 ? 1.0f : -1.0f });
+    burst.steps.push_back({ 'P', (float)(i % 2) });
+  }
+  scenarios.push_back(burst);
+
+  return scenarios;
+}
+
+DB1_SimPose idealPose(const std::vector<SimStep> &steps) {
+  DB1_SimPose pose = { 0, 0, 0 };
+  for (size_t i = 0; i < steps.size(); i++) {
+    const SimStep &s = steps[i];
+    double theta = pose.heading * M_PI / 180.0;
+    if (s.type == 'F') {
+      pose.x += s.a * cos(theta);
+      pose.y += s.a * sin(theta);
+    }
+    else if (s.type == 'T') {
+      double signedRadius = s.b >= 0 ? s.a : -s.a;
+      double cx = pose.x - signedRadius * sin(theta);
+      double cy = pose.y + signedRadius * cos(theta);
+      pose.heading += s.b;
+      theta = pose.heading * M_PI / 180.0;
+      pose.x = cx + signedRadius * sin(theta);
+      pose.y = cy - signedRadius * cos(theta);
+    }
+    else if (s.type == 'R') {
+      pose.heading += s.a;
+    }
+    else if (s.type == 'M') {
+      if (s.a != pose.x || s.b != pose.y)
+        pose.heading = atan2(s.b - pose.y, s.a - pose.x) * 180.0 / M_PI;
+      pose.x = s.a;
+      pose.y = s.b;
+    }
+    else if (s.type == 'H') {
+      pose.heading = s.a;
+    }
+    else if (s.type == 'A') {
+      // finishes heading along the tangent of the arc, twice the angle to the target from the start heading
+      double ahead = (s.a - pose.x) * cos(theta) + (s.b - pose.y) * sin(theta);
+      double left = (s.b - pose.y) * cos(theta) - (s.a - pose.x) * sin(theta);
+      pose.heading += 2 * atan2(left, ahead) * 180.0 / M_PI;
+      pose.x = s.a;
+      pose.y = s.b;
+    }
+    else if (s.type == 'B') {
+      // finishes heading from the second control point to the end
+      pose.heading = atan2(s.f - s.d, s.e - s.c) * 180.0 / M_PI;
+      pose.x = s.e;
+      pose.y = s.f;
+    }
+    else if (s.type == 'L') {
+      for (size_t p = 0; p < s.points.size(); p += 2) {
+        if (s.points[p] != pose.x || s.points[p + 1] != pose.y)
+          pose.heading = atan2(s.points[p + 1] - pose.y, s.points[p] - pose.x) * 180.0 / M_PI;
+        pose.x = s.points[p];
+        pose.y = s.points[p + 1];
+      }
+    }
+  }
+  return pose;
+}
+
+bool enqueue(Drawbotic_Navigation &nav, const SimStep &s) {
+  switch (s.type) {
+  case 'F': return nav.addForwardAction(s.a);
+  case 'T': return nav.addTurnAction(s.a, s.b);
+  case 'R': return nav.addRotateAction(s.a);
+  case 'S': return nav.addStopAction(s.a);
+  case 'P': return nav.addPenAction(s.a != 0);
+  case 'M': return nav.addMoveToAction(s.a, s.b);
+  case 'H': return nav.addRotateToAction(s.a);
+  case 'A': return nav.addArcToAction(s.a, s.b);
+  case 'B': return nav.addBezierAction(s.a, s.b, s.c, s.d, s.e, s.f);
+  case 'L': return nav.addPolylineAction(&s.points[0], (int)s.points.size() / 2);
+  }
+  return true;
+}
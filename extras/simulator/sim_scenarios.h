@@ -0,0 +1,35 @@
+#ifndef SIM_SCENARIOS_H
+#define SIM_SCENARIOS_H
+
+// The standard queues shared by the host tools, with the pose a perfect robot would finish them at. See README.md
+
+#include <vector>
+#include "Drawbotic_DB1.h"
+#include "Drawbotic_Navigation.h"
+
+struct SimStep {
+  char  type;   // 'F'orward, 'T'urn, 'R'otate, 'S'top, 'P'en, 'M'ove to, 'H'eading (rotate to), 'A'rc to, 'B'ezier, 'L'ine (polyline)
+  float a;
+  float b;
+  float c;
+  float d;
+  float e;
+  float f;
+  std::vector<float> points;  // polyline points as x, y pairs
+
+  SimStep(char type, float a, float b = 0, float c = 0, float d = 0, float e = 0, float f = 0)
+    : type(type), a(a), b(b), c(c), d(d), e(e), f(f) {}
+};
+
+struct Scenario {
+  const char *name;
+  std::vector<SimStep> steps;
+};
+
+std::vector<Scenario> makeScenarios();
+// Pose the robot would reach if every step was performed perfectly
+DB1_SimPose idealPose(const std::vector<SimStep> &steps);
+// Queue a step, returns false if the queue was full
+bool enqueue(Drawbotic_Navigation &nav, const SimStep &s);
+
+#endif